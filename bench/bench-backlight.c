@@ -0,0 +1,88 @@
+/* Microbenchmark: fopen/fscanf sysfs path against the cached-fd reader */
+#include "../src/backlight.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static char actual_path[MAXPATHLEN];
+static char max_path[MAXPATHLEN];
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Without a real backlight, read from regular files with the same content */
+static void use_fake_backlight(void) {
+  char dir[] = "/tmp/bench-backlight-XXXXXX";
+  FILE *f;
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(actual_path, sizeof(actual_path), "%s/actual_brightness", dir);
+  snprintf(max_path, sizeof(max_path), "%s/max_brightness", dir);
+
+  f = fopen(actual_path, "w");
+  fprintf(f, "12345\n");
+  fclose(f);
+  f = fopen(max_path, "w");
+  fprintf(f, "19393\n");
+  fclose(f);
+  printf("no sysfs backlight, using %s\n", dir);
+}
+
+/* The watch loop before the reader: actual, then actual and max again */
+static double read_fopen(void) {
+  int actual, max;
+  get_brightness_file_val(actual_path, &actual);
+  get_brightness_file_val(actual_path, &actual);
+  get_brightness_file_val(max_path, &max);
+  return actual + (double)actual / max;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  BacklightRegistry registry;
+  BacklightReader reader;
+  volatile double sink = 0;
+  double start, old_ns, new_ns;
+  int raw;
+  double normalized;
+
+  if (backlight_registry_init(&registry, NULL, NULL)) {
+    snprintf(actual_path, sizeof(actual_path), "%s",
+             registry.backlights[0].actual_brightness);
+    snprintf(max_path, sizeof(max_path), "%s",
+             registry.backlights[0].max_brightness);
+  } else {
+    use_fake_backlight();
+  }
+  backlight_registry_destroy(&registry);
+
+  start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    sink += read_fopen();
+  }
+  old_ns = (now_ns() - start) / iterations;
+
+  if (!backlight_reader_open(&reader, actual_path, max_path)) {
+    perror("backlight_reader_open");
+    return 1;
+  }
+  start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    backlight_reader_read(&reader, &raw, &normalized);
+    sink += raw + normalized;
+  }
+  new_ns = (now_ns() - start) / iterations;
+  backlight_reader_close(&reader);
+
+  printf("iterations:            %d\n", iterations);
+  printf("fopen/fscanf path:     %10.1f ns/event\n", old_ns);
+  printf("cached fd reader:      %10.1f ns/event\n", new_ns);
+  printf("speedup:               %10.1fx\n", old_ns / new_ns);
+  return sink < 0;
+}
@@ -0,0 +1,379 @@
+/*
+Microbenchmark: building each profile with colord or lcms2 against patching
+the serialized template at every vcgt size and copying out of a profile
+pack, after checking they all parse to the same curve with lcms2, with
+neutral layers and with a warm white point and a gamma per channel, on sRGB
+and on a calibrated base profile.
+ */
+#include "../src/colord-utils.h"
+#include "../src/profile-pack.h"
+#include "../src/profile-writer.h"
+#include "../src/vcgt.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Not neutral in any layer, green and blue get different gammas */
+static const VcgtLayers warm = {3400, {1.0, 1.1, 0.9}};
+
+/* vcgt of the calibrated base, out = in ^ calibration per channel */
+static const double calibration[3] = {1.05, 1.0, 0.92};
+
+/* The base as lcms2 reads it back, levels are checked against its curves */
+static cmsHPROFILE calibrated_profile;
+static cmsToneCurve **calibrated_vcgt;
+
+/* An sRGB profile with a calibration vcgt, as a panel vendor would ship */
+static bool make_base(BaseProfile *base) {
+  cmsHPROFILE profile = cmsCreate_sRGBProfile();
+  cmsToneCurve *curves[3];
+  cmsUInt32Number size = 0;
+  uint8_t *data = NULL;
+  bool ok = false;
+
+  for (int c = 0; c < 3; c++) {
+    curves[c] = cmsBuildGamma(NULL, calibration[c]);
+  }
+  cmsWriteTag(profile, cmsSigVcgtTag, curves);
+  for (int c = 0; c < 3; c++) {
+    cmsFreeToneCurve(curves[c]);
+  }
+  if (cmsSaveProfileToMem(profile, NULL, &size)) {
+    data = malloc(size);
+    ok = cmsSaveProfileToMem(profile, data, &size) &&
+         base_profile_parse(base, data, size) && base->vcgt != NULL &&
+         (calibrated_profile = cmsOpenProfileFromMem(data, size)) != NULL &&
+         (calibrated_vcgt = cmsReadTag(calibrated_profile, cmsSigVcgtTag)) !=
+             NULL;
+  }
+  free(data);
+  cmsCloseProfile(profile);
+  return ok;
+}
+
+/*
+Compare a parsed profile against brightness composed with layers (NULL for
+neutral ones) and then the base vcgt if calibrated, tolerance in 16-bit
+steps
+ */
+static bool check_profile(cmsHPROFILE profile, double brightness,
+                          const VcgtLayers *layers, bool calibrated,
+                          int tolerance) {
+  cmsToneCurve **vcgt = cmsReadTag(profile, cmsSigVcgtTag);
+  char expected[32], description[32];
+  VcgtLayers neutral;
+  double white[3];
+
+  if (vcgt == NULL) {
+    printf("%0.2f: no vcgt\n", brightness);
+    return false;
+  }
+  if (layers == NULL) {
+    vcgt_layers_init(&neutral);
+    layers = &neutral;
+  }
+  vcgt_white_point(layers->temperature, white);
+  for (int c = 0; c < 3; c++) {
+    for (int i = 0; i < 256; i++) {
+      int want = lround(pow(i / 255.0, 1 / layers->gamma[c]) * brightness *
+                        white[c] * 65535);
+      int got = cmsEvalToneCurve16(vcgt[c], i * 257);
+      if (calibrated) {
+        want = cmsEvalToneCurve16(calibrated_vcgt[c], want);
+      }
+      if (abs(want - got) > tolerance) {
+        printf("%0.2f: vcgt[%d][%d] %d, want %d\n", brightness, c, i, got,
+               want);
+        return false;
+      }
+    }
+  }
+
+  snprintf(expected, sizeof(expected), "Brightness %0.2f", brightness);
+  cmsGetProfileInfoASCII(profile, cmsInfoDescription, "en", "US", description,
+                         sizeof(description));
+  if (strcmp(expected, description) != 0) {
+    printf("%0.2f: description '%s'\n", brightness, description);
+    return false;
+  }
+  return true;
+}
+
+/* Profile ID is the MD5 with flags, intent and the ID itself zeroed */
+static bool check_profile_id(const ProfileWriter *writer) {
+  uint8_t *copy = g_malloc(writer->size);
+  guint8 digest[16];
+  gsize len = sizeof(digest);
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_MD5);
+  bool ok;
+
+  memcpy(copy, writer->data, writer->size);
+  memset(copy + 44, 0, 4);
+  memset(copy + 64, 0, 4);
+  memset(copy + 84, 0, 16);
+  g_checksum_update(checksum, copy, writer->size);
+  g_checksum_get_digest(checksum, digest, &len);
+  ok = memcmp(digest, writer->data + 84, sizeof(digest)) == 0;
+
+  g_checksum_free(checksum);
+  g_free(copy);
+  return ok;
+}
+
+/*
+Every level the daemon may produce, from the template and from colord.
+Layers go through 16-bit shapes, allow a second step of rounding. The
+calibration is interpolated between its samples on top, which steepens
+dark entries, allow two more.
+ */
+static bool validate(ProfileWriter *writer, const VcgtLayers *layers,
+                     const BaseProfile *base) {
+  int tolerance = base != NULL ? 4 : layers != NULL ? 2 : 1;
+
+  if (layers != NULL) {
+    vcgt_set_layers(&writer->vcgt, layers);
+  }
+  for (int level = 0; level <= 100; level++) {
+    double brightness = level / 100.0;
+    cmsHPROFILE profile;
+    CdIcc *icc;
+    GBytes *bytes;
+    bool ok;
+
+    profile_writer_set_brightness(writer, brightness);
+    profile = cmsOpenProfileFromMem(writer->data, writer->size);
+    ok = profile != NULL &&
+         check_profile(profile, brightness, layers, base != NULL,
+                       tolerance) &&
+         check_profile_id(writer);
+    if (profile != NULL) {
+      cmsCloseProfile(profile);
+    }
+    if (!ok) {
+      printf("template profile %0.2f is invalid\n", brightness);
+      return false;
+    }
+
+    /* colord goes through float, allow one step of rounding */
+    icc = cdutils_create_brightness_profile_colord(
+        brightness, writer->vcgt.size, layers, base, NULL);
+    bytes = cd_icc_save_data(icc, CD_ICC_SAVE_FLAGS_NONE, NULL);
+    profile = cmsOpenProfileFromMem(g_bytes_get_data(bytes, NULL),
+                                    g_bytes_get_size(bytes));
+    ok = profile != NULL && check_profile(profile, brightness, layers,
+                                          base != NULL, tolerance);
+    if (profile != NULL) {
+      cmsCloseProfile(profile);
+    }
+    g_bytes_unref(bytes);
+    g_object_unref(icc);
+    if (!ok) {
+      printf("colord profile %0.2f differs\n", brightness);
+      return false;
+    }
+
+    profile = cdutils_create_brightness_profile_lcms(brightness, layers, base);
+    ok = check_profile(profile, brightness, layers, base != NULL, tolerance);
+    cmsCloseProfile(profile);
+    if (!ok) {
+      printf("lcms profile %0.2f differs\n", brightness);
+      return false;
+    }
+  }
+  return true;
+}
+
+static double time_colord(const char *path, int iterations) {
+  double start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    CdIcc *icc = cdutils_create_brightness_profile_colord(
+        (i % 101) / 100.0, VCGT_SIZE_DEFAULT, NULL, NULL, NULL);
+    GFile *file = g_file_new_for_path(path);
+    cd_icc_save_file(icc, file, CD_ICC_SAVE_FLAGS_NONE, NULL, NULL);
+    g_object_unref(file);
+    g_object_unref(icc);
+  }
+  return (now_ns() - start) / iterations;
+}
+
+static double time_lcms(const char *path, int iterations) {
+  double start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    cmsHPROFILE profile =
+        cdutils_create_brightness_profile_lcms((i % 101) / 100.0, NULL, NULL);
+    cmsSaveProfileToFile(profile, path);
+    cmsCloseProfile(profile);
+  }
+  return (now_ns() - start) / iterations;
+}
+
+static double time_template(ProfileWriter *writer, const char *path,
+                            int iterations) {
+  double start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    profile_writer_set_brightness(writer, (i % 101) / 100.0);
+    profile_writer_save(writer, path);
+  }
+  return (now_ns() - start) / iterations;
+}
+
+/*
+Table generation alone, should not grow with the size. With layers only
+brightness changes, the shapes of the gamma layer are computed once. A base
+adds one lookup pass.
+ */
+static double time_vcgt(unsigned int size, const VcgtLayers *layers,
+                        const BaseProfile *base, int iterations) {
+  Vcgt vcgt;
+  uint8_t *be = malloc(3 * size * sizeof(uint16_t));
+  double start;
+
+  vcgt_init(&vcgt, size);
+  if (layers != NULL) {
+    vcgt_set_layers(&vcgt, layers);
+  }
+  if (base != NULL) {
+    vcgt_set_base(&vcgt, base->vcgt, base->vcgt_size);
+  }
+  start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    vcgt_fill_brightness(&vcgt, (i % 101) / 100.0);
+    vcgt_store_be(&vcgt, be);
+  }
+  start = (now_ns() - start) / iterations;
+  vcgt_destroy(&vcgt);
+  free(be);
+  return start;
+}
+
+/* Every level of a fresh pack parses, and a pack of another step is stale */
+static bool validate_pack(ProfilePack *pack, const char *path) {
+  ProfilePack stale;
+
+  if (profile_pack_open(&stale, path, 0.05, VCGT_SIZE_DEFAULT)) {
+    printf("pack of step 0.01 opened as 0.05\n");
+    profile_pack_close(&stale);
+    return false;
+  }
+  for (int level = 0; level <= 100; level++) {
+    uint32_t size;
+    const uint8_t *icc = profile_pack_lookup(pack, level, &size);
+    cmsHPROFILE profile = icc != NULL ? cmsOpenProfileFromMem(icc, size) : NULL;
+    bool ok =
+        profile != NULL &&
+        check_profile(profile, level / 100.0, NULL, false, 1);
+    if (profile != NULL) {
+      cmsCloseProfile(profile);
+    }
+    if (!ok) {
+      printf("pack profile %0.2f is invalid\n", level / 100.0);
+      return false;
+    }
+  }
+  return true;
+}
+
+static double time_pack(const ProfilePack *pack, const char *path,
+                        int iterations) {
+  double start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    profile_pack_save(pack, i % 101, path);
+  }
+  return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  const unsigned int sizes[] = {256, 1024, 4096};
+  char dir[] = "/tmp/bench-profile-XXXXXX";
+  char path[MAXPATHLEN], pack_path[MAXPATHLEN];
+  double colord_ns, lcms_ns, start;
+  ProfilePack pack;
+  BaseProfile base;
+
+  if (!make_base(&base)) {
+    printf("calibrated base profile failed\n");
+    return 1;
+  }
+  for (unsigned int i = 0; i < G_N_ELEMENTS(sizes); i++) {
+    ProfileWriter writer;
+    if (!profile_writer_init(&writer, sizes[i], NULL) ||
+        !validate(&writer, NULL, NULL) || !validate(&writer, &warm, NULL)) {
+      printf("template with %u vcgt entries failed\n", sizes[i]);
+      return 1;
+    }
+    profile_writer_destroy(&writer);
+
+    if (!profile_writer_init(&writer, sizes[i], &base) ||
+        !validate(&writer, NULL, &base) || !validate(&writer, &warm, &base)) {
+      printf("calibrated template with %u vcgt entries failed\n", sizes[i]);
+      return 1;
+    }
+    profile_writer_destroy(&writer);
+  }
+  printf("validated 101 levels against lcms2, neutral, layered and "
+         "calibrated\n");
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/brightness.icc", dir);
+  snprintf(pack_path, sizeof(pack_path), "%s/brightness.pack", dir);
+
+  printf("iterations:            %d\n", iterations);
+  colord_ns = time_colord(path, iterations);
+  printf("colord build + save:   %10.1f us/profile\n", colord_ns / 1000);
+  lcms_ns = time_lcms(path, iterations);
+  printf("lcms build + save:     %10.1f us/profile\n", lcms_ns / 1000);
+
+  for (unsigned int i = 0; i < G_N_ELEMENTS(sizes); i++) {
+    ProfileWriter writer;
+    double template_ns, vcgt_ns, layered_ns, calibrated_ns;
+
+    profile_writer_init(&writer, sizes[i], NULL);
+    template_ns = time_template(&writer, path, iterations);
+    vcgt_ns = time_vcgt(sizes[i], NULL, NULL, iterations * 100);
+    layered_ns = time_vcgt(sizes[i], &warm, NULL, iterations * 100);
+    calibrated_ns = time_vcgt(sizes[i], NULL, &base, iterations * 100);
+    profile_writer_destroy(&writer);
+
+    printf("template %4u + save:  %10.1f us/profile, %5.2fx colord\n",
+           sizes[i], template_ns / 1000, colord_ns / template_ns);
+    printf("vcgt %4u table:       %10.1f ns\n", sizes[i], vcgt_ns);
+    printf("vcgt %4u layered:     %10.1f ns\n", sizes[i], layered_ns);
+    printf("vcgt %4u calibrated:  %10.1f ns\n", sizes[i], calibrated_ns);
+  }
+
+  start = now_ns();
+  if (!cdutils_build_profile_pack(pack_path, 0.01, VCGT_SIZE_DEFAULT, 0) ||
+      !profile_pack_open(&pack, pack_path, 0.01, VCGT_SIZE_DEFAULT)) {
+    printf("profile pack failed\n");
+    return 1;
+  }
+  printf("pack build, %2u threads: %8.1f ms for 101 levels\n",
+         g_get_num_processors(), (now_ns() - start) / 1e6);
+  if (!validate_pack(&pack, pack_path)) {
+    return 1;
+  }
+  start = time_pack(&pack, path, iterations);
+  printf("pack save:             %10.1f us/profile, %5.2fx colord\n",
+         start / 1000, colord_ns / start);
+  profile_pack_close(&pack);
+  base_profile_destroy(&base);
+  cmsCloseProfile(calibrated_profile);
+
+  remove(pack_path);
+  remove(path);
+  remove(dir);
+  return 0;
+}
@@ -0,0 +1,223 @@
+/*
+Microbenchmark of every hot-path stage on its own: median and p99 latency,
+and heap allocations per call counted by wrapping the libc allocator.
+ */
+#include "../src/backlight.h"
+#include "../src/brightness-map.h"
+#include "../src/colord-utils.h"
+#include "../src/profile-writer.h"
+#include "../src/vcgt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+
+/* Every malloc in the process, glib, colord and lcms2 included */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+static char actual_path[MAXPATHLEN];
+static char max_path[MAXPATHLEN];
+static char icc_path[MAXPATHLEN];
+static BacklightReader reader;
+static ProfileWriter writer;
+static CdIcc *saved_icc;
+static volatile double sink;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Run stage iterations times, each argument a brightness level in [0, 1] */
+static void bench_stage(const char *name, void (*stage)(double),
+                        int iterations) {
+  double *samples = __libc_malloc(iterations * sizeof(double));
+  unsigned long before;
+
+  stage(0.5); /* warm up caches and lazy init */
+  before = allocations;
+  for (int i = 0; i < iterations; i++) {
+    double start = now_ns();
+    stage((i % 101) / 100.0);
+    samples[i] = now_ns() - start;
+  }
+  before = allocations - before;
+
+  qsort(samples, iterations, sizeof(double), compare_double);
+  printf("%-28s %12.0f %12.0f %10.1f\n", name, samples[iterations / 2],
+         samples[iterations * 99 / 100], (double)before / iterations);
+  free(samples);
+}
+
+static void stage_sysfs_fopen(double brightness) {
+  int actual, max;
+  (void)brightness;
+  get_brightness_file_val(actual_path, &actual);
+  get_brightness_file_val(max_path, &max);
+  sink += (double)actual / max;
+}
+
+static void stage_sysfs_reader(double brightness) {
+  int raw;
+  double normalized;
+  (void)brightness;
+  backlight_reader_read(&reader, &raw, &normalized);
+  sink += normalized;
+}
+
+static void stage_mapped_brightness(double brightness) {
+  sink += brightness_map(brightness, 0.2);
+}
+
+/* What the daemon does per change instead, raw is already an int */
+static BrightnessTable table;
+
+static void stage_brightness_table(double brightness) {
+  int raw = (int)(brightness * table.max_raw);
+  sink += brightness_table_brightness(&table,
+                                      brightness_table_lookup(&table, raw));
+}
+
+static void stage_create_vcgt(double brightness) {
+  g_ptr_array_unref(
+      cdutils_create_vcgt(brightness, VCGT_SIZE_DEFAULT, NULL, NULL));
+}
+
+static void stage_profile_colord(double brightness) {
+  g_object_unref(cdutils_create_brightness_profile_colord(
+      brightness, VCGT_SIZE_DEFAULT, NULL, NULL, NULL));
+}
+
+static void stage_profile_lcms(double brightness) {
+  cmsCloseProfile(
+      cdutils_create_brightness_profile_lcms(brightness, NULL, NULL));
+}
+
+static void stage_profile_template(double brightness) {
+  profile_writer_set_brightness(&writer, brightness);
+}
+
+static void stage_save_colord(double brightness) {
+  GFile *file = g_file_new_for_path(icc_path);
+  (void)brightness;
+  cd_icc_save_file(saved_icc, file, CD_ICC_SAVE_FLAGS_NONE, NULL, NULL);
+  g_object_unref(file);
+}
+
+static void stage_save_template(double brightness) {
+  (void)brightness;
+  profile_writer_save(&writer, icc_path);
+}
+
+static void stage_filename(double brightness) {
+  gchar *filename = cdutils_new_profile_filename(brightness);
+  gchar *filepath = g_build_filename(CDUTILS_PROFILE_DIR, filename, NULL);
+  g_free(filepath);
+  g_free(filename);
+}
+
+/* Without a real backlight, read from regular files with the same content */
+static void use_fake_backlight(const char *dir) {
+  FILE *f;
+
+  snprintf(actual_path, sizeof(actual_path), "%s/actual_brightness", dir);
+  snprintf(max_path, sizeof(max_path), "%s/max_brightness", dir);
+  f = fopen(actual_path, "w");
+  fprintf(f, "12345\n");
+  fclose(f);
+  f = fopen(max_path, "w");
+  fprintf(f, "19393\n");
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+  char dir[] = "/tmp/bench-stages-XXXXXX";
+  BacklightRegistry registry;
+  bool fake = false;
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(icc_path, sizeof(icc_path), "%s/brightness.icc", dir);
+
+  if (backlight_registry_init(&registry, NULL, NULL)) {
+    snprintf(actual_path, sizeof(actual_path), "%s",
+             registry.backlights[0].actual_brightness);
+    snprintf(max_path, sizeof(max_path), "%s",
+             registry.backlights[0].max_brightness);
+  } else {
+    use_fake_backlight(dir);
+    fake = true;
+  }
+  backlight_registry_destroy(&registry);
+
+  BrightnessMapping mapping = {
+      .curve = BRIGHTNESS_CURVE_LSTAR,
+      .min_brightness = 0.2,
+      .step = 0.01,
+      .dead_band = BRIGHTNESS_DEAD_BAND,
+  };
+  if (!backlight_reader_open(&reader, actual_path, max_path) ||
+      !brightness_table_init(&table, reader.max, &mapping) ||
+      !profile_writer_init(&writer, VCGT_SIZE_DEFAULT, NULL)) {
+    printf("setup failed\n");
+    return 1;
+  }
+  saved_icc = cdutils_create_brightness_profile_colord(0.5, VCGT_SIZE_DEFAULT,
+                                                       NULL, NULL, NULL);
+
+  printf("iterations: %d\n", iterations);
+  printf("%-28s %12s %12s %10s\n", "stage", "median ns", "p99 ns",
+         "allocs");
+  bench_stage("sysfs read fopen", stage_sysfs_fopen, iterations);
+  bench_stage("sysfs read cached fd", stage_sysfs_reader, iterations);
+  bench_stage("get_mapped_brightness", stage_mapped_brightness, iterations);
+  bench_stage("brightness table lookup", stage_brightness_table, iterations);
+  bench_stage("cdutils_create_vcgt", stage_create_vcgt, iterations);
+  bench_stage("profile colord", stage_profile_colord, iterations);
+  bench_stage("profile lcms", stage_profile_lcms, iterations);
+  bench_stage("profile template", stage_profile_template, iterations);
+  bench_stage("cd_icc_save_file", stage_save_colord, iterations);
+  bench_stage("template save", stage_save_template, iterations);
+  bench_stage("uuid + filename", stage_filename, iterations);
+
+  g_object_unref(saved_icc);
+  brightness_table_destroy(&table);
+  profile_writer_destroy(&writer);
+  backlight_reader_close(&reader);
+  if (fake) {
+    remove(actual_path);
+    remove(max_path);
+  }
+  remove(icc_path);
+  remove(dir);
+  return sink < 0;
+}
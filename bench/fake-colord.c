@@ -0,0 +1,748 @@
+/*
+Stand-in for colord on a private bus, and a latency driver for --watch.
+
+  dbus-daemon --session --fork --print-address
+  DBUS_SYSTEM_BUS_ADDRESS=<address> fake-colord --sysfs-root <dir> ...
+
+Serves the org.freedesktop.ColorManager calls icc-brightness makes on one
+embedded display, every method can be delayed with --delay Method=ms.
+With --count it writes <dir>/class/backlight/<name>/actual_brightness at
+--rate once the daemon applied its first profile, and reports the time from
+each write to the MakeProfileDefault of its brightness level.
+bench/latency.sh sets all of this up.
+ */
+#include "../src/brightness-map.h"
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COLORD_NAME "org.freedesktop.ColorManager"
+#define COLORD_PATH "/org/freedesktop/ColorManager"
+#define DEVICE_PATH COLORD_PATH "/devices/xrandr_eDP_1"
+
+static const char introspection_xml[] =
+    "<node>"
+    " <interface name='org.freedesktop.ColorManager'>"
+    "  <method name='GetDevices'><arg type='ao' direction='out'/></method>"
+    "  <method name='GetDevicesByKind'>"
+    "   <arg type='s' direction='in'/><arg type='ao' direction='out'/>"
+    "  </method>"
+    "  <method name='GetProfiles'><arg type='ao' direction='out'/></method>"
+    "  <method name='FindProfileById'>"
+    "   <arg type='s' direction='in'/><arg type='o' direction='out'/>"
+    "  </method>"
+    "  <method name='CreateProfile'>"
+    "   <arg type='s' direction='in'/><arg type='s' direction='in'/>"
+    "   <arg type='a{ss}' direction='in'/><arg type='o' direction='out'/>"
+    "  </method>"
+    "  <method name='CreateProfileWithFd'>"
+    "   <arg type='s' direction='in'/><arg type='s' direction='in'/>"
+    "   <arg type='h' direction='in'/><arg type='a{ss}' direction='in'/>"
+    "   <arg type='o' direction='out'/>"
+    "  </method>"
+    "  <method name='DeleteProfile'><arg type='o' direction='in'/></method>"
+    "  <signal name='Changed'/>"
+    "  <signal name='ProfileAdded'><arg type='o'/></signal>"
+    "  <signal name='ProfileRemoved'><arg type='o'/></signal>"
+    "  <property name='DaemonVersion' type='s' access='read'/>"
+    "  <property name='SystemVendor' type='s' access='read'/>"
+    "  <property name='SystemModel' type='s' access='read'/>"
+    " </interface>"
+    " <interface name='org.freedesktop.ColorManager.Device'>"
+    "  <method name='AddProfile'>"
+    "   <arg type='s' direction='in'/><arg type='o' direction='in'/>"
+    "  </method>"
+    "  <method name='RemoveProfile'><arg type='o' direction='in'/></method>"
+    "  <method name='MakeProfileDefault'>"
+    "   <arg type='o' direction='in'/>"
+    "  </method>"
+    "  <signal name='Changed'/>"
+    "  <property name='Id' type='s' access='read'/>"
+    "  <property name='Kind' type='s' access='read'/>"
+    "  <property name='Model' type='s' access='read'/>"
+    "  <property name='Vendor' type='s' access='read'/>"
+    "  <property name='Serial' type='s' access='read'/>"
+    "  <property name='Seat' type='s' access='read'/>"
+    "  <property name='Format' type='s' access='read'/>"
+    "  <property name='Mode' type='s' access='read'/>"
+    "  <property name='Colorspace' type='s' access='read'/>"
+    "  <property name='Scope' type='s' access='read'/>"
+    "  <property name='Owner' type='u' access='read'/>"
+    "  <property name='Created' type='t' access='read'/>"
+    "  <property name='Modified' type='t' access='read'/>"
+    "  <property name='Embedded' type='b' access='read'/>"
+    "  <property name='Enabled' type='b' access='read'/>"
+    "  <property name='Metadata' type='a{ss}' access='read'/>"
+    "  <property name='Profiles' type='ao' access='read'/>"
+    "  <property name='ProfilingInhibitors' type='as' access='read'/>"
+    " </interface>"
+    " <interface name='org.freedesktop.ColorManager.Profile'>"
+    "  <signal name='Changed'/>"
+    "  <property name='Id' type='s' access='read'/>"
+    "  <property name='Filename' type='s' access='read'/>"
+    "  <property name='Title' type='s' access='read'/>"
+    "  <property name='Kind' type='s' access='read'/>"
+    "  <property name='Colorspace' type='s' access='read'/>"
+    "  <property name='Qualifier' type='s' access='read'/>"
+    "  <property name='Format' type='s' access='read'/>"
+    "  <property name='Scope' type='s' access='read'/>"
+    "  <property name='Owner' type='u' access='read'/>"
+    "  <property name='Created' type='x' access='read'/>"
+    "  <property name='HasVcgt' type='b' access='read'/>"
+    "  <property name='IsSystemWide' type='b' access='read'/>"
+    "  <property name='Metadata' type='a{ss}' access='read'/>"
+    "  <property name='Warnings' type='as' access='read'/>"
+    " </interface>"
+    "</node>";
+
+/* A profile registered by the daemon */
+typedef struct {
+  guint registration;
+  gchar *path;
+  gchar *id;
+  gchar *filename;
+  GHashTable *metadata;
+} FakeProfile;
+
+static struct {
+  GDBusConnection *bus;
+  GDBusNodeInfo *introspection;
+  GHashTable *profiles;   /* path -> FakeProfile */
+  GPtrArray *assigned;    /* profile paths of the device, default first */
+  GHashTable *delays;     /* method name -> ms */
+  guint next_profile;
+  GMainLoop *loop;
+} fake;
+
+/* A write to actual_brightness and the level the daemon should apply */
+typedef struct {
+  gint64 time;
+  gchar level[8];
+} DriverWrite;
+
+static struct {
+  gchar *actual_path;
+  int max;
+  unsigned int rate, count;
+  double min_brightness, step;
+  BrightnessTable table; /* the daemon defaults, for the level of a write */
+  unsigned int phase;
+  int level; /* of the previous write */
+  DriverWrite *writes;
+  unsigned int written;
+  unsigned int resolved; /* writes before this one are applied or skipped */
+  GArray *latencies;     /* ms, of writes whose level was applied */
+  gboolean started;
+  gint64 start;
+} driver;
+
+static void fake_profile_free(gpointer data) {
+  FakeProfile *profile = data;
+  g_dbus_connection_unregister_object(fake.bus, profile->registration);
+  g_free(profile->path);
+  g_free(profile->id);
+  g_free(profile->filename);
+  g_hash_table_unref(profile->metadata);
+  g_free(profile);
+}
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  GVariant *reply;
+} FakeReply;
+
+static gboolean fake_reply_cb(gpointer user_data) {
+  FakeReply *reply = user_data;
+  g_dbus_method_invocation_return_value(reply->invocation, reply->reply);
+  if (reply->reply != NULL) {
+    g_variant_unref(reply->reply);
+  }
+  g_free(reply);
+  return G_SOURCE_REMOVE;
+}
+
+/* Reply now, or after the --delay of the method */
+static void fake_return(GDBusMethodInvocation *invocation, GVariant *value) {
+  guint ms = GPOINTER_TO_UINT(g_hash_table_lookup(
+      fake.delays, g_dbus_method_invocation_get_method_name(invocation)));
+  FakeReply *reply;
+
+  if (ms == 0) {
+    g_dbus_method_invocation_return_value(invocation, value);
+    return;
+  }
+  reply = g_new0(FakeReply, 1);
+  reply->invocation = invocation;
+  reply->reply = value != NULL ? g_variant_ref_sink(value) : NULL;
+  g_timeout_add(ms, fake_reply_cb, reply);
+}
+
+static void fake_return_error(GDBusMethodInvocation *invocation,
+                              const char *message) {
+  g_dbus_method_invocation_return_dbus_error(
+      invocation, COLORD_NAME ".Failed", message);
+}
+
+static GVariant *fake_metadata(GHashTable *metadata) {
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{ss}"));
+  if (metadata != NULL) {
+    g_hash_table_iter_init(&iter, metadata);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      g_variant_builder_add(&builder, "{ss}", key, value);
+    }
+  }
+  return g_variant_builder_end(&builder);
+}
+
+static GVariant *fake_paths(GPtrArray *paths) {
+  GVariantBuilder builder;
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("ao"));
+  for (guint i = 0; paths != NULL && i < paths->len; i++) {
+    g_variant_builder_add(&builder, "o", g_ptr_array_index(paths, i));
+  }
+  return g_variant_builder_end(&builder);
+}
+
+/* libcolord caches properties, keep Profiles of its proxy up to date */
+static void fake_device_changed(void) {
+  GVariantBuilder changed;
+
+  g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+  g_variant_builder_add(&changed, "{sv}", "Profiles",
+                        fake_paths(fake.assigned));
+  g_dbus_connection_emit_signal(
+      fake.bus, NULL, DEVICE_PATH, "org.freedesktop.DBus.Properties",
+      "PropertiesChanged",
+      g_variant_new("(sa{sv}as)", COLORD_NAME ".Device", &changed, NULL),
+      NULL);
+  g_dbus_connection_emit_signal(fake.bus, NULL, DEVICE_PATH,
+                                COLORD_NAME ".Device", "Changed", NULL, NULL);
+}
+
+static GVariant *fake_profile_get_property(GDBusConnection *bus,
+                                           const gchar *sender,
+                                           const gchar *path,
+                                           const gchar *interface,
+                                           const gchar *name, GError **error,
+                                           gpointer user_data) {
+  FakeProfile *profile = user_data;
+  (void)bus;
+  (void)sender;
+  (void)path;
+  (void)interface;
+  (void)error;
+
+  if (g_strcmp0(name, "Id") == 0 || g_strcmp0(name, "Title") == 0) {
+    return g_variant_new_string(profile->id);
+  } else if (g_strcmp0(name, "Filename") == 0) {
+    return g_variant_new_string(profile->filename);
+  } else if (g_strcmp0(name, "Kind") == 0) {
+    return g_variant_new_string("display-device");
+  } else if (g_strcmp0(name, "Colorspace") == 0) {
+    return g_variant_new_string("rgb");
+  } else if (g_strcmp0(name, "Scope") == 0) {
+    return g_variant_new_string("normal");
+  } else if (g_strcmp0(name, "Owner") == 0) {
+    return g_variant_new_uint32(getuid());
+  } else if (g_strcmp0(name, "Created") == 0) {
+    return g_variant_new_int64(g_get_real_time() / G_USEC_PER_SEC);
+  } else if (g_strcmp0(name, "HasVcgt") == 0) {
+    return g_variant_new_boolean(TRUE);
+  } else if (g_strcmp0(name, "IsSystemWide") == 0) {
+    return g_variant_new_boolean(FALSE);
+  } else if (g_strcmp0(name, "Metadata") == 0) {
+    return fake_metadata(profile->metadata);
+  } else if (g_strcmp0(name, "Warnings") == 0) {
+    return g_variant_new_strv(NULL, 0);
+  }
+  return g_variant_new_string("");
+}
+
+static const GDBusInterfaceVTable fake_profile_vtable = {
+    NULL, fake_profile_get_property, NULL, {0}};
+
+/* Filename is a property of the profile, every other key is metadata */
+static void fake_create_profile(GDBusMethodInvocation *invocation,
+                                const gchar *id, GVariantIter *props) {
+  FakeProfile *profile = g_new0(FakeProfile, 1);
+  gchar *key, *value;
+  GError *error = NULL;
+
+  profile->id = g_strdup(id);
+  profile->path = g_strdup_printf(COLORD_PATH "/profiles/fake_%u",
+                                  fake.next_profile++);
+  profile->metadata =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  while (g_variant_iter_next(props, "{ss}", &key, &value)) {
+    if (g_strcmp0(key, "Filename") == 0) {
+      profile->filename = value;
+      g_free(key);
+    } else {
+      g_hash_table_insert(profile->metadata, key, value);
+    }
+  }
+
+  profile->registration = g_dbus_connection_register_object(
+      fake.bus, profile->path,
+      g_dbus_node_info_lookup_interface(fake.introspection,
+                                        COLORD_NAME ".Profile"),
+      &fake_profile_vtable, profile, NULL, &error);
+  if (profile->registration == 0) {
+    fake_return_error(invocation, error->message);
+    g_error_free(error);
+    return;
+  }
+  g_hash_table_insert(fake.profiles, profile->path, profile);
+  g_dbus_connection_emit_signal(fake.bus, NULL, COLORD_PATH, COLORD_NAME,
+                                "ProfileAdded",
+                                g_variant_new("(o)", profile->path), NULL);
+  fake_return(invocation, g_variant_new("(o)", profile->path));
+}
+
+static void driver_applied(const gchar *level);
+
+static void fake_manager_method_call(GDBusConnection *bus, const gchar *sender,
+                                     const gchar *path, const gchar *interface,
+                                     const gchar *method, GVariant *parameters,
+                                     GDBusMethodInvocation *invocation,
+                                     gpointer user_data) {
+  (void)bus;
+  (void)sender;
+  (void)path;
+  (void)interface;
+  (void)user_data;
+
+  if (g_strcmp0(method, "GetDevices") == 0 ||
+      g_strcmp0(method, "GetDevicesByKind") == 0) {
+    g_autoptr(GPtrArray) devices = g_ptr_array_new();
+    g_ptr_array_add(devices, DEVICE_PATH);
+    fake_return(invocation, g_variant_new("(@ao)", fake_paths(devices)));
+  } else if (g_strcmp0(method, "GetProfiles") == 0) {
+    g_autoptr(GPtrArray) paths = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, fake.profiles);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+      g_ptr_array_add(paths, key);
+    }
+    fake_return(invocation, g_variant_new("(@ao)", fake_paths(paths)));
+  } else if (g_strcmp0(method, "FindProfileById") == 0) {
+    const gchar *id;
+    GHashTableIter iter;
+    gpointer value;
+    g_variant_get(parameters, "(&s)", &id);
+    g_hash_table_iter_init(&iter, fake.profiles);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      FakeProfile *profile = value;
+      if (g_strcmp0(profile->id, id) == 0) {
+        fake_return(invocation, g_variant_new("(o)", profile->path));
+        return;
+      }
+    }
+    fake_return_error(invocation, "profile id not found");
+  } else if (g_strcmp0(method, "CreateProfile") == 0) {
+    const gchar *id;
+    GVariantIter *props;
+    g_variant_get(parameters, "(&s&sa{ss})", &id, NULL, &props);
+    fake_create_profile(invocation, id, props);
+    g_variant_iter_free(props);
+  } else if (g_strcmp0(method, "CreateProfileWithFd") == 0) {
+    const gchar *id;
+    GVariantIter *props;
+    g_variant_get(parameters, "(&s&sha{ss})", &id, NULL, NULL, &props);
+    fake_create_profile(invocation, id, props);
+    g_variant_iter_free(props);
+  } else if (g_strcmp0(method, "DeleteProfile") == 0) {
+    const gchar *object_path;
+    g_variant_get(parameters, "(&o)", &object_path);
+    if (!g_hash_table_contains(fake.profiles, object_path)) {
+      fake_return_error(invocation, "profile not found");
+      return;
+    }
+    if (g_ptr_array_remove(fake.assigned, (gpointer)object_path)) {
+      fake_device_changed();
+    }
+    g_dbus_connection_emit_signal(fake.bus, NULL, COLORD_PATH, COLORD_NAME,
+                                  "ProfileRemoved",
+                                  g_variant_new("(o)", object_path), NULL);
+    g_hash_table_remove(fake.profiles, object_path);
+    fake_return(invocation, NULL);
+  }
+}
+
+static GVariant *fake_manager_get_property(GDBusConnection *bus,
+                                           const gchar *sender,
+                                           const gchar *path,
+                                           const gchar *interface,
+                                           const gchar *name, GError **error,
+                                           gpointer user_data) {
+  (void)bus;
+  (void)sender;
+  (void)path;
+  (void)interface;
+  (void)error;
+  (void)user_data;
+
+  if (g_strcmp0(name, "DaemonVersion") == 0) {
+    return g_variant_new_string("1.4.6");
+  }
+  return g_variant_new_string("fake-colord");
+}
+
+static const GDBusInterfaceVTable fake_manager_vtable = {
+    fake_manager_method_call, fake_manager_get_property, NULL, {0}};
+
+/* Assigned profiles are kept by path, the strings are owned by fake.profiles */
+static gpointer fake_assigned_lookup(const gchar *object_path) {
+  FakeProfile *profile = g_hash_table_lookup(fake.profiles, object_path);
+  return profile != NULL ? profile->path : NULL;
+}
+
+static void fake_device_method_call(GDBusConnection *bus, const gchar *sender,
+                                    const gchar *path, const gchar *interface,
+                                    const gchar *method, GVariant *parameters,
+                                    GDBusMethodInvocation *invocation,
+                                    gpointer user_data) {
+  const gchar *object_path;
+  gpointer profile_path;
+  (void)bus;
+  (void)sender;
+  (void)path;
+  (void)interface;
+  (void)user_data;
+
+  if (g_strcmp0(method, "AddProfile") == 0) {
+    g_variant_get(parameters, "(&s&o)", NULL, &object_path);
+  } else {
+    g_variant_get(parameters, "(&o)", &object_path);
+  }
+  profile_path = fake_assigned_lookup(object_path);
+  if (profile_path == NULL) {
+    fake_return_error(invocation, "profile not found");
+    return;
+  }
+
+  if (g_strcmp0(method, "AddProfile") == 0) {
+    if (g_ptr_array_find(fake.assigned, profile_path, NULL)) {
+      fake_return_error(invocation, "profile already added");
+      return;
+    }
+    g_ptr_array_add(fake.assigned, profile_path);
+  } else if (g_strcmp0(method, "RemoveProfile") == 0) {
+    g_ptr_array_remove(fake.assigned, profile_path);
+  } else if (g_strcmp0(method, "MakeProfileDefault") == 0) {
+    FakeProfile *profile = g_hash_table_lookup(fake.profiles, object_path);
+    g_ptr_array_remove(fake.assigned, profile_path);
+    g_ptr_array_insert(fake.assigned, 0, profile_path);
+    driver_applied(g_hash_table_lookup(profile->metadata,
+                                       "Profile brightness"));
+  }
+  fake_device_changed();
+  fake_return(invocation, NULL);
+}
+
+static GVariant *fake_device_get_property(GDBusConnection *bus,
+                                          const gchar *sender,
+                                          const gchar *path,
+                                          const gchar *interface,
+                                          const gchar *name, GError **error,
+                                          gpointer user_data) {
+  (void)bus;
+  (void)sender;
+  (void)path;
+  (void)interface;
+  (void)error;
+  (void)user_data;
+
+  if (g_strcmp0(name, "Id") == 0) {
+    return g_variant_new_string("xrandr-eDP-1");
+  } else if (g_strcmp0(name, "Kind") == 0) {
+    return g_variant_new_string("display");
+  } else if (g_strcmp0(name, "Mode") == 0) {
+    return g_variant_new_string("physical");
+  } else if (g_strcmp0(name, "Colorspace") == 0) {
+    return g_variant_new_string("rgb");
+  } else if (g_strcmp0(name, "Scope") == 0) {
+    return g_variant_new_string("temp");
+  } else if (g_strcmp0(name, "Owner") == 0) {
+    return g_variant_new_uint32(getuid());
+  } else if (g_strcmp0(name, "Created") == 0 ||
+             g_strcmp0(name, "Modified") == 0) {
+    return g_variant_new_uint64(g_get_real_time() / G_USEC_PER_SEC);
+  } else if (g_strcmp0(name, "Embedded") == 0 ||
+             g_strcmp0(name, "Enabled") == 0) {
+    return g_variant_new_boolean(TRUE);
+  } else if (g_strcmp0(name, "Metadata") == 0) {
+    g_autoptr(GHashTable) metadata = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(metadata, "XRANDR_name", "eDP-1");
+    return fake_metadata(metadata);
+  } else if (g_strcmp0(name, "Profiles") == 0) {
+    return fake_paths(fake.assigned);
+  } else if (g_strcmp0(name, "ProfilingInhibitors") == 0) {
+    return g_variant_new_strv(NULL, 0);
+  }
+  return g_variant_new_string("fake");
+}
+
+static const GDBusInterfaceVTable fake_device_vtable = {
+    fake_device_method_call, fake_device_get_property, NULL, {0}};
+
+static int compare_double(gconstpointer a, gconstpointer b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void driver_report(void) {
+  GArray *latencies = driver.latencies;
+  double elapsed = (g_get_monotonic_time() - driver.start) / 1e6;
+
+  g_array_sort(latencies, compare_double);
+  printf("writes:            %u in %0.1f s\n", driver.written, elapsed);
+  printf("applied:           %u (%0.1f/s)\n", latencies->len,
+         latencies->len / elapsed);
+  printf("coalesced:         %u\n", driver.resolved - latencies->len);
+  printf("never applied:     %u\n", driver.written - driver.resolved);
+  if (latencies->len > 0) {
+    printf("latency p50:       %8.2f ms\n",
+           g_array_index(latencies, double, latencies->len / 2));
+    printf("latency p99:       %8.2f ms\n",
+           g_array_index(latencies, double, latencies->len * 99 / 100));
+    printf("latency max:       %8.2f ms\n",
+           g_array_index(latencies, double, latencies->len - 1));
+  }
+}
+
+static gboolean driver_quit_cb(gpointer user_data) {
+  (void)user_data;
+  driver_report();
+  g_main_loop_quit(fake.loop);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+Triangle over the whole range, raw values the daemon maps to the level of
+the previous write are skipped so every write is a new level
+ */
+static gboolean driver_write_cb(gpointer user_data) {
+  unsigned int period = 2 * driver.max;
+  int raw = 0, level = driver.level;
+  char buf[16];
+  int fd, len;
+  (void)user_data;
+
+  for (unsigned int n = 0; n < period; n++) {
+    unsigned int phase = driver.phase++ % period;
+    raw = phase <= (unsigned int)driver.max ? (int)phase
+                                            : (int)(period - phase);
+    level = brightness_table_lookup(&driver.table, raw);
+    if (level != driver.level) {
+      break;
+    }
+  }
+  driver.level = level;
+
+  /* Same as the daemon quantization, then the "Profile brightness" format */
+  DriverWrite *write_ = &driver.writes[driver.written];
+  snprintf(write_->level, sizeof(write_->level), "%0.2f",
+           brightness_table_brightness(&driver.table, level));
+
+  /* Fixed width and no truncation, every state of the file parses */
+  len = snprintf(buf, sizeof(buf), "%10d\n", raw);
+  fd = open(driver.actual_path, O_WRONLY | O_CLOEXEC);
+  write_->time = g_get_monotonic_time();
+  if (fd == -1 || pwrite(fd, buf, len, 0) != len) {
+    perror(driver.actual_path);
+    exit(1);
+  }
+  close(fd);
+
+  if (++driver.written == driver.count) {
+    g_timeout_add_seconds(1, driver_quit_cb, NULL);
+    return G_SOURCE_REMOVE;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+/* Latency of the newest write of this level, older ones were coalesced */
+static void driver_applied(const gchar *level) {
+  gint64 now = g_get_monotonic_time();
+
+  if (driver.count == 0 || level == NULL) {
+    return;
+  }
+  if (!driver.started) {
+    /* The daemon applied its start level, it is watching now */
+    driver.started = TRUE;
+    driver.start = now;
+    g_timeout_add(1000 / driver.rate, driver_write_cb, NULL);
+    return;
+  }
+
+  for (unsigned int i = driver.written; i > driver.resolved; i--) {
+    DriverWrite *write_ = &driver.writes[i - 1];
+    if (g_strcmp0(write_->level, level) == 0) {
+      double latency = (now - write_->time) / 1000.0;
+      g_array_append_val(driver.latencies, latency);
+      driver.resolved = i;
+      return;
+    }
+  }
+}
+
+static void on_bus_acquired(GDBusConnection *bus, const gchar *name,
+                            gpointer user_data) {
+  GError *error = NULL;
+  (void)name;
+  (void)user_data;
+
+  fake.bus = bus;
+  if (g_dbus_connection_register_object(
+          bus, COLORD_PATH,
+          g_dbus_node_info_lookup_interface(fake.introspection, COLORD_NAME),
+          &fake_manager_vtable, NULL, NULL, &error) == 0 ||
+      g_dbus_connection_register_object(
+          bus, DEVICE_PATH,
+          g_dbus_node_info_lookup_interface(fake.introspection,
+                                            COLORD_NAME ".Device"),
+          &fake_device_vtable, NULL, NULL, &error) == 0) {
+    printf("register: %s\n", error->message);
+    exit(1);
+  }
+}
+
+static void on_name_acquired(GDBusConnection *bus, const gchar *name,
+                             gpointer user_data) {
+  (void)bus;
+  (void)user_data;
+  printf("%s ready\n", name);
+  fflush(stdout);
+}
+
+static void on_name_lost(GDBusConnection *bus, const gchar *name,
+                         gpointer user_data) {
+  (void)bus;
+  (void)user_data;
+  printf("%s lost, is DBUS_SYSTEM_BUS_ADDRESS a private bus?\n", name);
+  exit(1);
+}
+
+static void show_help(const char *program_name) {
+  fprintf(stderr, "\
+Usage: %s [options]\n\
+  --sysfs-root [dir]          \tfake sysfs, same as the daemon's --sysfs-root.\n\
+  --backlight [name]          \tinterface to write. (default: fake).\n\
+  --rate [hz]                 \tbrightness writes per second. (default: 20).\n\
+  --count [val]               \twrites before reporting, 0 only serves. (default: 0).\n\
+  --min-brightness [val]      \tsame as the daemon's. (default: 0.2).\n\
+  --cache-step [val]          \tsame as the daemon's. (default: 0.01).\n\
+  --delay [Method=ms]         \tdelay replies of a method, repeatable.\n",
+          program_name);
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+      {"sysfs-root", required_argument, 0, 's'},
+      {"backlight", required_argument, 0, 'b'},
+      {"rate", required_argument, 0, 'r'},
+      {"count", required_argument, 0, 'c'},
+      {"min-brightness", required_argument, 0, 'm'},
+      {"cache-step", required_argument, 0, 'q'},
+      {"delay", required_argument, 0, 'd'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  const char *sysfs_root = "/sys", *backlight = "fake";
+  gchar *max_path, *contents = NULL;
+  int c;
+
+  fake.delays = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  driver.rate = 20;
+  driver.min_brightness = 0.2;
+  driver.step = 0.01;
+
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    gchar **delay;
+    switch (c) {
+    case 's':
+      sysfs_root = optarg;
+      break;
+    case 'b':
+      backlight = optarg;
+      break;
+    case 'r':
+      driver.rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      driver.count = strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      driver.min_brightness = strtod(optarg, NULL);
+      break;
+    case 'q':
+      driver.step = strtod(optarg, NULL);
+      break;
+    case 'd':
+      delay = g_strsplit(optarg, "=", 2);
+      if (delay[0] == NULL || delay[1] == NULL) {
+        show_help(argv[0]);
+        exit(1);
+      }
+      g_hash_table_insert(fake.delays, g_strdup(delay[0]),
+                          GUINT_TO_POINTER(strtoul(delay[1], NULL, 10)));
+      g_strfreev(delay);
+      break;
+    default:
+      show_help(argv[0]);
+      exit(c == 'h' ? 0 : 1);
+    }
+  }
+  if (driver.rate < 1 || driver.step <= 0) {
+    show_help(argv[0]);
+    exit(1);
+  }
+
+  if (driver.count > 0) {
+    driver.actual_path = g_strdup_printf(
+        "%s/class/backlight/%s/actual_brightness", sysfs_root, backlight);
+    max_path = g_strdup_printf("%s/class/backlight/%s/max_brightness",
+                               sysfs_root, backlight);
+    if (!g_file_get_contents(max_path, &contents, NULL, NULL) ||
+        (driver.max = atoi(contents)) <= 0) {
+      printf("no max_brightness at %s\n", max_path);
+      exit(1);
+    }
+    g_free(contents);
+    g_free(max_path);
+    BrightnessMapping mapping = {
+        .curve = BRIGHTNESS_CURVE_LINEAR,
+        .min_brightness = driver.min_brightness,
+        .step = driver.step,
+        .dead_band = BRIGHTNESS_DEAD_BAND,
+    };
+    brightness_table_init(&driver.table, driver.max, &mapping);
+    driver.level = -1;
+    driver.writes = g_new0(DriverWrite, driver.count);
+    driver.latencies = g_array_new(FALSE, FALSE, sizeof(double));
+  }
+
+  fake.introspection = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+  fake.profiles =
+      g_hash_table_new_full(g_str_hash, g_str_equal, NULL, fake_profile_free);
+  fake.assigned = g_ptr_array_new();
+
+  /* GDBus takes the system bus from DBUS_SYSTEM_BUS_ADDRESS */
+  g_bus_own_name(G_BUS_TYPE_SYSTEM, COLORD_NAME, G_BUS_NAME_OWNER_FLAGS_NONE,
+                 on_bus_acquired, on_name_acquired, on_name_lost, NULL, NULL);
+
+  fake.loop = g_main_loop_new(NULL, FALSE);
+  g_main_loop_run(fake.loop);
+  return 0;
+}
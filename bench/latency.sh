@@ -0,0 +1,57 @@
+#!/bin/sh
+# End-to-end latency of --watch: fake sysfs, fake colord on a private bus.
+# Arguments go to fake-colord, e.g. --rate 50 --count 500 --delay CreateProfile=30
+# DAEMON_ARGS go to icc-brightness, e.g. DAEMON_ARGS="--cache-size 100"
+# RSS_BUDGET_KB fails the run if the daemon grows more than that after the
+# first 10 seconds, which fill the profile cache and the library caches
+set -e
+
+dir=$(mktemp -d /tmp/icc-brightness-latency-XXXXXX)
+backlight=$dir/sys/class/backlight/fake
+mkdir -p "$backlight" "$dir/icc"
+echo 100 >"$backlight/max_brightness"
+echo 50 >"$backlight/actual_brightness"
+echo raw >"$backlight/type"
+
+dbus-daemon --session --fork --print-address=3 --print-pid=4 \
+  3>"$dir/address" 4>"$dir/bus.pid"
+DBUS_SYSTEM_BUS_ADDRESS=$(cat "$dir/address")
+export DBUS_SYSTEM_BUS_ADDRESS
+
+cleanup() {
+  kill "$daemon" "$(cat "$dir/bus.pid")" 2>/dev/null || true
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+./fake-colord --sysfs-root "$dir/sys" --count 200 "$@" &
+fake=$!
+until dbus-send --system --print-reply --dest=org.freedesktop.DBus / \
+  org.freedesktop.DBus.NameHasOwner string:org.freedesktop.ColorManager |
+  grep -q true; do
+  sleep 0.05
+done
+
+# shellcheck disable=SC2086
+./icc-brightness --watch --sysfs-root "$dir/sys" --profile-dir "$dir/icc" \
+  $DAEMON_ARGS >"$dir/daemon.log" &
+daemon=$!
+
+if [ -n "$RSS_BUDGET_KB" ]; then
+  while kill -0 "$daemon" 2>/dev/null; do
+    awk '/^VmRSS:/ { print $2 }' "/proc/$daemon/status" 2>/dev/null || true
+    sleep 1
+  done >"$dir/rss" &
+fi
+
+wait "$fake"
+
+if [ -n "$RSS_BUDGET_KB" ]; then
+  base=$(sed -n 10p "$dir/rss")
+  last=$(tail -n 1 "$dir/rss")
+  echo "daemon rss:        ${base} kB after warm-up, ${last} kB at the end"
+  if [ -z "$base" ] || [ $((last - base)) -gt "$RSS_BUDGET_KB" ]; then
+    echo "daemon rss grew more than $RSS_BUDGET_KB kB"
+    exit 1
+  fi
+fi
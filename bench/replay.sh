@@ -0,0 +1,49 @@
+#!/bin/sh
+# Every trace-gen pattern replayed through --watch against the fake colord.
+# Arguments go to icc-brightness, e.g. --coalesce-ms 20 or --output drm.
+# SPEED is --replay-speed, 0 (default) replays as fast as the daemon keeps up,
+# 1 in real time. PATTERNS picks a subset, TRACE replays that file instead.
+set -e
+
+dir=$(mktemp -d /tmp/icc-brightness-replay-XXXXXX)
+backlight=$dir/sys/class/backlight/fake
+mkdir -p "$backlight" "$dir/icc"
+echo 100 >"$backlight/max_brightness"
+echo 50 >"$backlight/actual_brightness"
+echo raw >"$backlight/type"
+
+dbus-daemon --session --fork --print-address=3 --print-pid=4 \
+  3>"$dir/address" 4>"$dir/bus.pid"
+DBUS_SYSTEM_BUS_ADDRESS=$(cat "$dir/address")
+export DBUS_SYSTEM_BUS_ADDRESS
+
+cleanup() {
+  kill "$fake" "$(cat "$dir/bus.pid")" 2>/dev/null || true
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+./fake-colord --sysfs-root "$dir/sys" --count 0 &
+fake=$!
+until dbus-send --system --print-reply --dest=org.freedesktop.DBus / \
+  org.freedesktop.DBus.NameHasOwner string:org.freedesktop.ColorManager |
+  grep -q true; do
+  sleep 0.05
+done
+
+if [ -n "$TRACE" ]; then
+  traces=$TRACE
+else
+  traces=
+  for pattern in ${PATTERNS:-held-key als-jitter resume-storm sweep}; do
+    ./trace-gen "$pattern" "$dir/$pattern.trace"
+    traces="$traces $dir/$pattern.trace"
+  done
+fi
+
+for trace in $traces; do
+  echo "########## $(basename "$trace" .trace)"
+  ./icc-brightness --replay "$trace" --replay-speed "${SPEED:-0}" \
+    --sysfs-root "$dir/sys" --profile-dir "$dir/icc" "$@" >"$dir/daemon.log"
+  sed -n '/== replay ==/,$p' "$dir/daemon.log"
+done
@@ -0,0 +1,192 @@
+/*
+Synthetic traces for --replay, the patterns that are hard to reproduce by
+hand. Deterministic for a given --seed, so runs can be compared.
+
+  trace-gen held-key held-key.trace
+  icc-brightness --replay held-key.trace --replay-speed 0
+
+bench/replay.sh replays each of them against the fake colord.
+ */
+#include "../src/trace.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct {
+  uint32_t max;
+  unsigned int count;
+  uint64_t seed;
+  TraceWriter writer;
+  int64_t us;
+  uint32_t raw;
+} gen;
+
+/* xorshift64, the same sequence on every libc */
+static uint32_t gen_random(uint32_t bound) {
+  gen.seed ^= gen.seed << 13;
+  gen.seed ^= gen.seed >> 7;
+  gen.seed ^= gen.seed << 17;
+  return bound > 0 ? (uint32_t)(gen.seed % bound) : 0;
+}
+
+static uint32_t gen_clamp(int64_t raw) {
+  return raw < 0 ? 0 : raw > gen.max ? gen.max : (uint32_t)raw;
+}
+
+/* Write raw after delay_us, unchanged values are not written like sysfs */
+static void gen_write(int64_t delay_us, int64_t raw) {
+  gen.us += delay_us;
+  if (gen_clamp(raw) == gen.raw) {
+    return;
+  }
+  gen.raw = gen_clamp(raw);
+  trace_writer_append(&gen.writer, gen.us, 0, gen.raw);
+}
+
+/* Key repeat at 30 Hz, 5% a step, bouncing between dark and full */
+static void gen_held_key(void) {
+  int64_t step = gen.max / 20 > 0 ? gen.max / 20 : 1;
+  int direction = -1;
+
+  for (unsigned int i = 0; i < gen.count; i++) {
+    if ((direction < 0 && gen.raw == 0) ||
+        (direction > 0 && gen.raw == gen.max)) {
+      direction = -direction;
+      gen.us += 500000; /* let go, then hold the other key */
+    }
+    gen_write(33000, (int64_t)gen.raw + direction * step);
+  }
+}
+
+/*
+Ambient light sensor at 10 Hz: noise of 2% around a target that drifts by
+up to 10% every 5 seconds
+ */
+static void gen_als_jitter(void) {
+  int64_t target = gen.max / 2;
+  uint32_t noise = gen.max / 50 > 0 ? gen.max / 50 : 1;
+
+  for (unsigned int i = 0; i < gen.count; i++) {
+    if (i % 50 == 0) {
+      target = gen_clamp(target + (int64_t)gen_random(gen.max / 5 + 1) -
+                         gen.max / 10);
+    }
+    gen_write(100000, target + (int64_t)gen_random(2 * noise + 1) - noise);
+  }
+}
+
+/*
+Every 5 seconds a resume: firmware drops to 0 and restores the saved value
+through a few steps within 2 ms, the desktop writes it again 50 ms later
+ */
+static void gen_resume_storm(void) {
+  uint32_t saved = gen.max * 3 / 4;
+
+  for (unsigned int i = 0; i < gen.count; i++) {
+    gen_write(5000000, 0);
+    for (int s = 1; s <= 4; s++) {
+      gen_write(500, (int64_t)saved * s / 4);
+    }
+    gen_write(50000, saved > 0 ? saved - 1 : 1);
+    gen_write(1000, saved);
+    saved = gen_clamp((int64_t)saved + gen_random(gen.max / 10 + 1) -
+                      gen.max / 20);
+  }
+}
+
+/* Every raw value down and up again at 1 kHz, count times */
+static void gen_sweep(void) {
+  for (unsigned int i = 0; i < gen.count; i++) {
+    for (int64_t raw = gen.max; raw >= 0; raw--) {
+      gen_write(1000, raw);
+    }
+    for (int64_t raw = 0; raw <= gen.max; raw++) {
+      gen_write(1000, raw);
+    }
+  }
+}
+
+static const struct {
+  const char *name;
+  void (*generate)(void);
+  unsigned int count; /* of its unit when --count is not given */
+} patterns[] = {
+    {"held-key", gen_held_key, 200},
+    {"als-jitter", gen_als_jitter, 600},
+    {"resume-storm", gen_resume_storm, 20},
+    {"sweep", gen_sweep, 1},
+};
+
+static void show_help(const char *program_name) {
+  fprintf(stderr, "\
+Usage: %s [options] PATTERN OUT\n\
+Patterns:\n\
+  held-key                    \tkey repeat at 30 Hz, --count steps.\n\
+  als-jitter                  \tambient light sensor at 10 Hz, --count samples.\n\
+  resume-storm                \tbursts of firmware writes, --count resumes.\n\
+  sweep                       \tevery raw value down and up, --count times.\n\
+Options:\n\
+  --max [val]                 \tmax_brightness of the backlight. (default: 100).\n\
+  --count [val]               \tlength, in the unit of the pattern.\n\
+  --seed [val]                \tof the random parts. (default: 1).\n",
+          program_name);
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+      {"max", required_argument, 0, 'm'},
+      {"count", required_argument, 0, 'c'},
+      {"seed", required_argument, 0, 's'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  int c;
+
+  gen.max = 100;
+  gen.seed = 1;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'm':
+      gen.max = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      gen.count = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      gen.seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      show_help(argv[0]);
+      exit(c == 'h' ? 0 : 1);
+    }
+  }
+  if (argc - optind != 2 || gen.max < 1 || gen.seed == 0) {
+    show_help(argv[0]);
+    exit(1);
+  }
+
+  for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    if (strcmp(argv[optind], patterns[i].name) != 0) {
+      continue;
+    }
+    if (!trace_writer_open(&gen.writer, argv[optind + 1], 1, &gen.max, 0)) {
+      perror(argv[optind + 1]);
+      exit(1);
+    }
+    if (gen.count == 0) {
+      gen.count = patterns[i].count;
+    }
+    /* Start from the middle, the first record is the value at start */
+    gen.raw = gen.max + 1;
+    gen_write(0, gen.max / 2);
+    patterns[i].generate();
+    if (!trace_writer_close(&gen.writer)) {
+      perror(argv[optind + 1]);
+      exit(1);
+    }
+    return 0;
+  }
+
+  show_help(argv[0]);
+  exit(1);
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# --output drm on the vkms virtual KMS driver, no GPU needed: the daemon
+# follows a fake sysfs backlight and --list reads the GAMMA_LUT back.
+# Needs root, a kernel whose vkms has a GAMMA_LUT, and no other DRM master.
+set -e
+
+modprobe vkms
+card=
+for dev in /sys/class/drm/card[0-9]*; do
+  case $(basename "$dev") in *-*) continue ;; esac
+  case $(readlink -f "$dev/device") in */vkms) card=/dev/dri/$(basename "$dev") ;; esac
+done
+if [ -z "$card" ]; then
+  echo "no vkms card" >&2
+  exit 1
+fi
+echo "vkms: $card"
+
+dir=$(mktemp -d /tmp/icc-brightness-vkms-XXXXXX)
+backlight=$dir/sys/class/backlight/fake
+mkdir -p "$backlight"
+echo 100 >"$backlight/max_brightness"
+echo 100 >"$backlight/actual_brightness"
+echo raw >"$backlight/type"
+
+cleanup() {
+  kill "$daemon" 2>/dev/null || true
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+args="--output drm --drm-device $card --sysfs-root $dir/sys"
+# shellcheck disable=SC2086
+./icc-brightness --watch $args --min-brightness 0 --metrics-file "" \
+  >"$dir/daemon.log" &
+daemon=$!
+sleep 0.5
+
+status=0
+for level in 50 20 75 100; do
+  # same width every time, the daemon never sees a truncated file
+  printf '%3d\n' "$level" 1<>"$backlight/actual_brightness"
+  sleep 0.2
+  want=$(awk "BEGIN { printf \"%.2f\", $level / 100 }")
+  # shellcheck disable=SC2086
+  got=$(./icc-brightness --list $args | sed -n 's/.*gamma lut max: //p' |
+    head -n 1)
+  echo "brightness $want: gamma lut max $got"
+  [ "$got" = "$want" ] || status=1
+done
+
+[ $status -eq 0 ] || cat "$dir/daemon.log"
+exit $status
@@ -1,85 +1,296 @@
 #define _DEFAULT_SOURCE // exposes u_short in glibc, needed by fts(3)
+#include "backlight.h"
 #include <ctype.h>
+#include <fcntl.h>
 #include <fts.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/param.h> // for MAXPATHLEN
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
-char backlight_interface[MAXPATHLEN];
-char actual_brightness_value[MAXPATHLEN];
-char maximum_brightness_value[MAXPATHLEN];
+#define SYSFS_ROOT "/sys"
+#define SYSFS_BACKLIGHT "/class/backlight"
+/* Room for the longest attribute name after an interface directory */
+#define SYSFS_ATTR_MAX 32
 
-bool has_sysfs_backlight(void) {
-  bool found = false;
-  char *path_argv[] = {"/sys/class/backlight", NULL};
-  FTS *ftsp = fts_open(path_argv, FTS_LOGICAL | FTS_NOSTAT, NULL);
-  if (ftsp != NULL) {
-    fts_read(ftsp);
-
-    struct stat statb;
-    FTSENT *cur = fts_children(ftsp, FTS_NAMEONLY);
-    while (!found && cur != NULL) {
-      snprintf(actual_brightness_value, sizeof(actual_brightness_value),
-               "%s%s/actual_brightness", cur->fts_path, cur->fts_name);
-      if (stat(actual_brightness_value, &statb) == 0 &&
-          S_ISREG(statb.st_mode)) {
-        found = true;
-        snprintf(maximum_brightness_value, sizeof(maximum_brightness_value),
-                 "%s%s/max_brightness", cur->fts_path, cur->fts_name);
-        snprintf(backlight_interface, sizeof(backlight_interface),
-                 "%s%s/brightness", cur->fts_path, cur->fts_name);
-      }
-      cur = cur->fts_link;
-    }
-    fts_close(ftsp);
-  }
-  return found;
-}
-
-bool _get_brightness_file_val(char *path, int *v) {
+bool get_brightness_file_val(const char *path, int *v) {
   int val;
   FILE *src = fopen(path, "r");
   if (src != NULL) {
     int nv = fscanf(src, "%i", &val);
+    fclose(src);
     if (nv == 1)
       *v = val;
     else
       return false;
-    fclose(src);
   } else {
     return false;
   }
   return true;
 }
 
-int get_brightness_file_val(char *path) {
-  int v;
-  if (_get_brightness_file_val(path, &v)) {
-    return v;
-  } else {
-    printf("get_brightness_file_val: fail\n");
-    exit(1);
+/*
+Backlights registered by a DRM driver (intel_backlight, amdgpu_bl0) have the
+connector as parent device, e.g. device -> ../../card0-eDP-1.
+Firmware ones (acpi_video0) point at the PCI device instead.
+ */
+static bool get_backlight_connector(const char *dir, char *connector,
+                                    size_t len) {
+  char link[MAXPATHLEN];
+  char target[MAXPATHLEN];
+  ssize_t n;
+  char *base;
+  int card, consumed = 0;
+
+  snprintf(link, sizeof(link), "%s/device", dir);
+  n = readlink(link, target, sizeof(target) - 1);
+  if (n == -1)
+    return false;
+  target[n] = '\0';
+
+  base = strrchr(target, '/');
+  base = base != NULL ? base + 1 : target;
+  if (sscanf(base, "card%d-%n", &card, &consumed) != 1 || consumed == 0)
+    return false;
+  snprintf(connector, len, "%s", base + consumed);
+  return true;
+}
+
+/* firmware < platform < raw, unknown types last */
+static int get_backlight_type_rank(const char *dir) {
+  static const char *types[] = {"firmware", "platform", "raw"};
+  char path[MAXPATHLEN];
+  char type[16] = "";
+  FILE *src;
+
+  snprintf(path, sizeof(path), "%s/type", dir);
+  src = fopen(path, "r");
+  if (src != NULL) {
+    if (fscanf(src, "%15s", type) != 1)
+      type[0] = '\0';
+    fclose(src);
   }
+  for (int i = 0; i < 3; i++) {
+    if (strcmp(type, types[i]) == 0)
+      return i;
+  }
+  return 3;
 }
 
-int get_actual_brightness() {
-  return get_brightness_file_val(actual_brightness_value);
+/* Position of name in the comma separated order, or -1 */
+static int get_backlight_order_rank(const char *order, const char *name) {
+  size_t len = strlen(name);
+  int rank = 0;
+
+  while (order != NULL && *order != '\0') {
+    const char *comma = strchr(order, ',');
+    size_t item = comma != NULL ? (size_t)(comma - order) : strlen(order);
+    if (item == len && strncmp(order, name, len) == 0)
+      return rank;
+    rank++;
+    order = comma != NULL ? comma + 1 : NULL;
+  }
+  return -1;
 }
 
-int get_max_brightness() {
-  return get_brightness_file_val(maximum_brightness_value);
+typedef struct {
+  Backlight backlight;
+  int order_rank;
+  int type_rank;
+} BacklightCandidate;
+
+static int compare_backlight_candidates(const void *a, const void *b) {
+  const BacklightCandidate *x = a, *y = b;
+
+  if (x->order_rank != y->order_rank) {
+    if (x->order_rank == -1)
+      return 1;
+    if (y->order_rank == -1)
+      return -1;
+    return x->order_rank - y->order_rank;
+  }
+  if (x->type_rank != y->type_rank)
+    return x->type_rank - y->type_rank;
+  return strcmp(x->backlight.name, y->backlight.name);
 }
 
-double get_brightness() {
-  return (double)get_actual_brightness() / get_max_brightness();
+bool backlight_registry_init(BacklightRegistry *registry,
+                             const char *sysfs_root, const char *order) {
+  char class_dir[MAXPATHLEN - SYSFS_ATTR_MAX - NAME_MAX];
+  char *path_argv[] = {class_dir, NULL};
+  BacklightCandidate *candidates = NULL;
+  unsigned int count = 0;
+
+  memset(registry, 0, sizeof(*registry));
+  registry->inotify_fd = -1;
+
+  if (snprintf(class_dir, sizeof(class_dir), "%s" SYSFS_BACKLIGHT,
+               sysfs_root != NULL ? sysfs_root : SYSFS_ROOT) >=
+      (int)sizeof(class_dir))
+    return false;
+
+  FTS *ftsp = fts_open(path_argv, FTS_LOGICAL | FTS_NOSTAT, NULL);
+  if (ftsp == NULL)
+    return false;
+  fts_read(ftsp);
+
+  for (FTSENT *cur = fts_children(ftsp, FTS_NAMEONLY); cur != NULL;
+       cur = cur->fts_link) {
+    char dir[MAXPATHLEN - SYSFS_ATTR_MAX];
+    struct stat statb;
+    BacklightCandidate *candidate;
+
+    snprintf(dir, sizeof(dir), "%s/%s", class_dir, cur->fts_name);
+    candidates = realloc(candidates, (count + 1) * sizeof(*candidates));
+    candidate = &candidates[count];
+    memset(candidate, 0, sizeof(*candidate));
+
+    snprintf(candidate->backlight.actual_brightness,
+             sizeof(candidate->backlight.actual_brightness),
+             "%s/actual_brightness", dir);
+    if (stat(candidate->backlight.actual_brightness, &statb) != 0 ||
+        !S_ISREG(statb.st_mode))
+      continue;
+
+    snprintf(candidate->backlight.name, sizeof(candidate->backlight.name),
+             "%s", cur->fts_name);
+    snprintf(candidate->backlight.max_brightness,
+             sizeof(candidate->backlight.max_brightness), "%s/max_brightness",
+             dir);
+    if (!get_backlight_connector(dir, candidate->backlight.connector,
+                                 sizeof(candidate->backlight.connector)))
+      candidate->backlight.connector[0] = '\0';
+    candidate->order_rank = get_backlight_order_rank(order, cur->fts_name);
+    candidate->type_rank = get_backlight_type_rank(dir);
+    count++;
+  }
+  fts_close(ftsp);
+
+  qsort(candidates, count, sizeof(*candidates), compare_backlight_candidates);
+
+  registry->backlights = calloc(count > 0 ? count : 1, sizeof(Backlight));
+  for (unsigned int i = 0; i < count; i++) {
+    Backlight *backlight = &registry->backlights[registry->count];
+    *backlight = candidates[i].backlight;
+    backlight->wd = -1;
+    backlight->last_raw = -1;
+    backlight->changed = false;
+    if (!backlight_reader_open(&backlight->reader,
+                               backlight->actual_brightness,
+                               backlight->max_brightness)) {
+      printf("skip backlight %s: cannot read it\n", backlight->name);
+      continue;
+    }
+    registry->count++;
+  }
+  free(candidates);
+
+  return registry->count > 0;
+}
+
+void backlight_registry_destroy(BacklightRegistry *registry) {
+  for (unsigned int i = 0; i < registry->count; i++) {
+    backlight_reader_close(&registry->backlights[i].reader);
+  }
+  if (registry->inotify_fd != -1) {
+    close(registry->inotify_fd);
+  }
+  free(registry->backlights);
+  free(registry->by_wd);
+  memset(registry, 0, sizeof(*registry));
+  registry->inotify_fd = -1;
+}
+
+bool backlight_registry_watch(BacklightRegistry *registry, uint32_t mask) {
+  registry->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (registry->inotify_fd == -1)
+    return false;
+
+  for (unsigned int i = 0; i < registry->count; i++) {
+    Backlight *backlight = &registry->backlights[i];
+    int wd = inotify_add_watch(registry->inotify_fd,
+                               backlight->actual_brightness, mask);
+    if (wd == -1)
+      return false;
+    backlight->wd = wd;
+
+    /* Watch descriptors are small integers handed out in sequence */
+    if (wd >= registry->by_wd_len) {
+      int len = wd + 1;
+      registry->by_wd = realloc(registry->by_wd, len * sizeof(Backlight *));
+      for (int j = registry->by_wd_len; j < len; j++)
+        registry->by_wd[j] = NULL;
+      registry->by_wd_len = len;
+    }
+    registry->by_wd[wd] = backlight;
+  }
+  return true;
+}
+
+Backlight *backlight_registry_lookup(BacklightRegistry *registry, int wd) {
+  if (wd < 0 || wd >= registry->by_wd_len)
+    return NULL;
+  return registry->by_wd[wd];
 }
 
-// int main() {
-//   if (has_sysfs_backlight()) {
-//     printf("brightness: %0.2f\n", get_brightness());
-//   }
-// }
\ No newline at end of file
+/* Parse a non-negative decimal sysfs value, stops at the newline or INT_MAX */
+static bool parse_brightness(const char *buf, ssize_t len, int *v) {
+  int val = 0;
+  ssize_t i = 0;
+
+  while (i < len && isspace((unsigned char)buf[i]))
+    i++;
+  if (i == len || !isdigit((unsigned char)buf[i]))
+    return false;
+  while (i < len && isdigit((unsigned char)buf[i])) {
+    int digit = buf[i] - '0';
+    if (val > (INT_MAX - digit) / 10)
+      return false;
+    val = val * 10 + digit;
+    i++;
+  }
+  *v = val;
+  return true;
+}
+
+bool backlight_reader_open(BacklightReader *reader, const char *actual_path,
+                           const char *max_path) {
+  reader->max = 0;
+  if (!get_brightness_file_val(max_path, &reader->max) || reader->max <= 0) {
+    reader->fd = -1;
+    return false;
+  }
+
+  reader->fd = open(actual_path, O_RDONLY | O_CLOEXEC);
+  return reader->fd != -1;
+}
+
+void backlight_reader_close(BacklightReader *reader) {
+  if (reader->fd != -1) {
+    close(reader->fd);
+    reader->fd = -1;
+  }
+}
+
+bool backlight_reader_read(BacklightReader *reader, int *raw,
+                           double *normalized) {
+  char buf[16];
+  ssize_t len;
+  int val;
+
+  len = pread(reader->fd, buf, sizeof(buf), 0);
+  if (len <= 0 || !parse_brightness(buf, len, &val))
+    return false;
+
+  if (raw != NULL)
+    *raw = val;
+  if (normalized != NULL)
+    *normalized = (double)val / reader->max;
+  return true;
+}
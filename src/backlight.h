@@ -1,9 +1,71 @@
+#ifndef ICC_BRIGHTNESS_BACKLIGHT_H
+#define ICC_BRIGHTNESS_BACKLIGHT_H
+
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/param.h> // for MAXPATHLEN
+
+/* Keeps actual_brightness open, max_brightness never changes */
+typedef struct {
+  int fd;
+  int max;
+} BacklightReader;
+
+/* One interface under /sys/class/backlight */
+typedef struct {
+  char name[NAME_MAX + 1];      /* e.g. intel_backlight */
+  char connector[NAME_MAX + 1]; /* e.g. eDP-1, empty if sysfs does not tell */
+  char actual_brightness[MAXPATHLEN];
+  char max_brightness[MAXPATHLEN];
+  BacklightReader reader;
+  int wd;       /* inotify watch descriptor, -1 if not watched */
+  int last_raw; /* last actual_brightness seen by the watcher */
+  bool changed; /* modified since the watcher last read it */
+} Backlight;
+
+/*
+Every backlight interface, enumerated once, in priority order.
+The first one is the primary backlight.
+ */
+typedef struct {
+  Backlight *backlights;
+  unsigned int count;
+  int inotify_fd;
+  Backlight **by_wd; /* watch descriptor -> interface */
+  int by_wd_len;
+} BacklightRegistry;
+
+/*
+Enumerate and open every interface under sysfs_root (NULL for /sys), a fake
+tree lets tests drive the daemon. order is a comma separated list of
+preferred interface names, e.g. "intel_backlight,acpi_video0", listed ones
+come first in that order. Without it firmware interfaces are preferred over
+platform and raw ones, like the kernel documentation recommends.
+ */
+bool backlight_registry_init(BacklightRegistry *registry,
+                             const char *sysfs_root, const char *order);
+
+void backlight_registry_destroy(BacklightRegistry *registry);
+
+/* Watch actual_brightness of every interface on a single inotify fd */
+bool backlight_registry_watch(BacklightRegistry *registry, uint32_t mask);
+
+/* O(1), NULL for an unknown watch descriptor */
+Backlight *backlight_registry_lookup(BacklightRegistry *registry, int wd);
+
+/* fopen/fscanf a sysfs value, for one-shot use */
+bool get_brightness_file_val(const char *path, int *v);
 
-bool has_sysfs_backlight(void);
+/* Open actual_brightness and read max_brightness once */
+bool backlight_reader_open(BacklightReader *reader, const char *actual_path,
+                           const char *max_path);
 
-int get_actual_brightness();
+void backlight_reader_close(BacklightReader *reader);
 
-int get_max_brightness();
+/* One pread(2), no allocation. raw or normalized may be NULL */
+bool backlight_reader_read(BacklightReader *reader, int *raw,
+                           double *normalized);
 
-double get_brightness();
+#endif
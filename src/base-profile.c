@@ -0,0 +1,102 @@
+#include "base-profile.h"
+#include <glib.h>
+#include <lcms2.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Sample the vcgt of profile, NULL if it has none or it is linear */
+static uint16_t *base_profile_read_vcgt(cmsHPROFILE profile) {
+  cmsToneCurve **curves = cmsReadTag(profile, cmsSigVcgtTag);
+  uint16_t *vcgt;
+  bool linear = true;
+
+  if (curves == NULL || curves[0] == NULL || curves[1] == NULL ||
+      curves[2] == NULL) {
+    return NULL;
+  }
+  vcgt = malloc(3 * BASE_PROFILE_VCGT_SIZE * sizeof(uint16_t));
+  if (vcgt == NULL) {
+    return NULL;
+  }
+  for (int c = 0; c < 3; c++) {
+    for (unsigned int i = 0; i < BASE_PROFILE_VCGT_SIZE; i++) {
+      uint16_t in =
+          (uint16_t)((i * 65535u + (BASE_PROFILE_VCGT_SIZE - 1) / 2) /
+                     (BASE_PROFILE_VCGT_SIZE - 1));
+      uint16_t out = cmsEvalToneCurve16(curves[c], in);
+      vcgt[c * BASE_PROFILE_VCGT_SIZE + i] = out;
+      linear = linear && abs((int)out - (int)in) <= 1;
+    }
+  }
+
+  /* A factory profile often carries an identity table, keep the fast path */
+  if (linear) {
+    free(vcgt);
+    return NULL;
+  }
+  return vcgt;
+}
+
+bool base_profile_parse(BaseProfile *base, const uint8_t *data,
+                        uint32_t size) {
+  cmsContext context;
+  cmsHPROFILE profile;
+  cmsUInt32Number saved;
+  GChecksum *checksum;
+
+  memset(base, 0, sizeof(*base));
+  checksum = g_checksum_new(G_CHECKSUM_MD5);
+  g_checksum_update(checksum, data, size);
+  g_strlcpy(base->id, g_checksum_get_string(checksum), sizeof(base->id));
+  g_checksum_free(checksum);
+
+  context = cmsCreateContext(NULL, NULL);
+  profile = cmsOpenProfileFromMemTHR(context, data, size);
+  if (profile == NULL) {
+    cmsDeleteContext(context);
+    return false;
+  }
+  base->vcgt = base_profile_read_vcgt(profile);
+  base->vcgt_size = base->vcgt != NULL ? BASE_PROFILE_VCGT_SIZE : 0;
+
+  /* Levels bring a vcgt of their own */
+  cmsWriteTag(profile, cmsSigVcgtTag, NULL);
+  if (cmsSaveProfileToMem(profile, NULL, &saved)) {
+    base->data = malloc(saved);
+    if (base->data != NULL &&
+        !cmsSaveProfileToMem(profile, base->data, &saved)) {
+      free(base->data);
+      base->data = NULL;
+    }
+    base->size = saved;
+  }
+
+  cmsCloseProfile(profile);
+  cmsDeleteContext(context);
+  if (base->data == NULL) {
+    base_profile_destroy(base);
+    return false;
+  }
+  return true;
+}
+
+bool base_profile_load(BaseProfile *base, const char *path) {
+  gchar *contents;
+  gsize length;
+  bool ret;
+
+  memset(base, 0, sizeof(*base));
+  if (!g_file_get_contents(path, &contents, &length, NULL)) {
+    return false;
+  }
+  ret = length <= UINT32_MAX &&
+        base_profile_parse(base, (const uint8_t *)contents, length);
+  g_free(contents);
+  return ret;
+}
+
+void base_profile_destroy(BaseProfile *base) {
+  free(base->data);
+  free(base->vcgt);
+  memset(base, 0, sizeof(*base));
+}
@@ -0,0 +1,32 @@
+#ifndef ICC_BRIGHTNESS_BASE_PROFILE_H
+#define ICC_BRIGHTNESS_BASE_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Entries per channel the calibration is sampled at, the largest vcgt */
+#define BASE_PROFILE_VCGT_SIZE 4096
+
+/*
+The calibrated profile of a display, parsed once. Levels are built on its
+serialized form and compose brightness with its VCGT, so dimming keeps the
+factory or user calibration instead of starting from sRGB.
+ */
+typedef struct {
+  uint8_t *data;       /* serialized without its vcgt tag, NULL if none */
+  uint32_t size;
+  uint16_t *vcgt;      /* its calibration, 3 * vcgt_size, NULL if linear */
+  unsigned int vcgt_size;
+  char id[33];         /* MD5 of the profile as read, hex */
+} BaseProfile;
+
+/* Parse an icc profile in memory, false if lcms2 cannot */
+bool base_profile_parse(BaseProfile *base, const uint8_t *data,
+                        uint32_t size);
+
+/* Read and parse an icc file */
+bool base_profile_load(BaseProfile *base, const char *path);
+
+void base_profile_destroy(BaseProfile *base);
+
+#endif
@@ -0,0 +1,85 @@
+#include "brightness-map.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+double brightness_map(double brightness, double min_brightness) {
+  return min_brightness + (1 - min_brightness) * brightness;
+}
+
+bool brightness_curve_parse(const char *name, BrightnessCurve *curve) {
+  if (strcmp(name, "linear") == 0) {
+    *curve = BRIGHTNESS_CURVE_LINEAR;
+  } else if (strcmp(name, "gamma") == 0) {
+    *curve = BRIGHTNESS_CURVE_GAMMA;
+  } else if (strcmp(name, "lstar") == 0) {
+    *curve = BRIGHTNESS_CURVE_LSTAR;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* CIE 1976 lightness of relative luminance y, and its inverse */
+static double brightness_lstar(double y) {
+  return y > 216.0 / 24389 ? 116 * cbrt(y) - 16 : y * 24389 / 27;
+}
+
+static double brightness_luminance(double lstar) {
+  return lstar > 8 ? pow((lstar + 16) / 116, 3) : lstar * 27 / 24389;
+}
+
+double brightness_curve_apply(const BrightnessMapping *mapping,
+                              double brightness) {
+  switch (mapping->curve) {
+  case BRIGHTNESS_CURVE_GAMMA:
+    brightness = pow(brightness, mapping->gamma);
+    break;
+  case BRIGHTNESS_CURVE_LSTAR:
+    brightness = brightness_luminance(brightness * 100);
+    break;
+  case BRIGHTNESS_CURVE_LINEAR:
+    break;
+  }
+  return brightness_map(brightness, mapping->min_brightness);
+}
+
+/*
+Walk raw upwards, a quantized level only replaces the current one once it
+is dead_band L* away, so sysfs noise and tiny steps map to the same level.
+The top raw value always gets full brightness.
+ */
+bool brightness_table_init(BrightnessTable *table, int max_raw,
+                           const BrightnessMapping *mapping) {
+  int current = -1;
+
+  if (max_raw <= 0 || mapping->step <= 0) {
+    return false;
+  }
+  table->levels = malloc((max_raw + 1) * sizeof(int));
+  if (table->levels == NULL) {
+    return false;
+  }
+  table->max_raw = max_raw;
+  table->step = mapping->step;
+
+  for (int raw = 0; raw <= max_raw; raw++) {
+    double brightness =
+        brightness_curve_apply(mapping, (double)raw / max_raw);
+    int level = (int)lround(brightness / mapping->step);
+    if (current == -1 || raw == max_raw ||
+        fabs(brightness_lstar(level * mapping->step) -
+             brightness_lstar(current * mapping->step)) >=
+            mapping->dead_band) {
+      current = level;
+    }
+    table->levels[raw] = current;
+  }
+  return true;
+}
+
+void brightness_table_destroy(BrightnessTable *table) {
+  free(table->levels);
+  table->levels = NULL;
+  table->max_raw = 0;
+}
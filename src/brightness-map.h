@@ -0,0 +1,63 @@
+#ifndef ICC_BRIGHTNESS_BRIGHTNESS_MAP_H
+#define ICC_BRIGHTNESS_BRIGHTNESS_MAP_H
+
+#include <stdbool.h>
+
+/* Lift [0, 1] to [min_brightness, 1] in case the screen is too dark */
+double brightness_map(double brightness, double min_brightness);
+
+/* How a backlight position becomes a level before the lift */
+typedef enum {
+  BRIGHTNESS_CURVE_LINEAR,
+  BRIGHTNESS_CURVE_GAMMA, /* position ^ gamma */
+  BRIGHTNESS_CURVE_LSTAR, /* position is CIE L* / 100, even perceived steps */
+} BrightnessCurve;
+
+/* Changes smaller than this many CIE L* keep the level */
+#define BRIGHTNESS_DEAD_BAND 1.0
+
+typedef struct {
+  BrightnessCurve curve;
+  double gamma;          /* of BRIGHTNESS_CURVE_GAMMA */
+  double min_brightness; /* level of raw 0 */
+  double step;           /* levels are quantized like the profile cache */
+  double dead_band;      /* in CIE L*, 0 keeps every quantized level */
+} BrightnessMapping;
+
+/* raw actual_brightness -> quantized level, built once per backlight */
+typedef struct {
+  int *levels; /* max_raw + 1 entries, brightness = level * step */
+  int max_raw;
+  double step;
+} BrightnessTable;
+
+/* "linear", "gamma" or "lstar" */
+bool brightness_curve_parse(const char *name, BrightnessCurve *curve);
+
+/* Level of brightness in [0, 1] without the table */
+double brightness_curve_apply(const BrightnessMapping *mapping,
+                              double brightness);
+
+bool brightness_table_init(BrightnessTable *table, int max_raw,
+                           const BrightnessMapping *mapping);
+
+void brightness_table_destroy(BrightnessTable *table);
+
+/* The hot path, raw beyond max_brightness is clamped */
+static inline int brightness_table_lookup(const BrightnessTable *table,
+                                          int raw) {
+  if (raw < 0) {
+    raw = 0;
+  } else if (raw > table->max_raw) {
+    raw = table->max_raw;
+  }
+  return table->levels[raw];
+}
+
+static inline double brightness_table_brightness(const BrightnessTable *table,
+                                                 int level) {
+  double brightness = level * table->step;
+  return brightness < 1 ? brightness : 1;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#include "brightness-slot.h"
+#include "metrics.h"
+
+void brightness_slot_init(BrightnessSlot *slot) {
+  slot->brightness = 0;
+  slot->pending = false;
+}
+
+void brightness_slot_post(BrightnessSlot *slot, double brightness) {
+  if (slot->pending) {
+    metrics_inc(METRICS_EVENTS_COALESCED);
+  }
+  slot->brightness = brightness;
+  slot->pending = true;
+}
+
+bool brightness_slot_take(BrightnessSlot *slot, double *brightness) {
+  if (!slot->pending) {
+    return false;
+  }
+  *brightness = slot->brightness;
+  slot->pending = false;
+  return true;
+}
@@ -0,0 +1,22 @@
+#ifndef ICC_BRIGHTNESS_BRIGHTNESS_SLOT_H
+#define ICC_BRIGHTNESS_BRIGHTNESS_SLOT_H
+
+#include <stdbool.h>
+
+/*
+Latest-value handoff between the event reader and the profile applier.
+Posting over a value that was not taken yet drops (coalesces) it.
+ */
+typedef struct {
+  double brightness;
+  bool pending;
+} BrightnessSlot;
+
+void brightness_slot_init(BrightnessSlot *slot);
+
+void brightness_slot_post(BrightnessSlot *slot, double brightness);
+
+/* Take the newest value, false if nothing was posted since the last take */
+bool brightness_slot_take(BrightnessSlot *slot, double *brightness);
+
+#endif
@@ -1,13 +1,18 @@
 /* Colord uitls */
+#include "colord-utils.h"
 #include "backlight.h"
+#include "metrics.h"
+#include "vcgt.h"
 #include <colord.h>
 #include <lcms2.h>
 #include <locale.h>
+#include <math.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
@@ -15,11 +20,6 @@
 #define props_key_creator "Creator"
 #define props_value_creator "icc-brightness"
 
-typedef struct {
-  CdClient *client;
-  GPtrArray *devices;
-} CdUtilConnection;
-
 /* Check if this profile is created by us
 make sure you have connected to this proifle before calling this function
 */
@@ -39,22 +39,48 @@ static gboolean cdutils_is_profile_created_by_us(CdProfile *profile) {
 
 static gchar *get_uuid() {
   uuid_t uuid;
-  gchar str[36];
+  gchar str[37];
 
   uuid_generate(uuid);
   uuid_unparse(uuid, str);
   return g_strdup(str);
 }
 
-/* Create icc profile with Little CMS, alternative */
-cmsHPROFILE cdutils_create_brightness_profile_lcms(double brightness) {
-  cmsHPROFILE hsRGB;
-  cmsContext context_id;
+gchar *cdutils_new_profile_filename(double brightness) {
+  gchar *uid = get_uuid();
+  gchar *filename = g_strdup_printf("brightness-%0.2f-%s", brightness, uid);
+  g_free(uid);
+  return filename;
+}
+
+/* Stored as "Profile layers", a profile is only reused with the same */
+gchar *cdutils_layers_to_string(const VcgtLayers *layers) {
+  return g_strdup_printf("%.0fK %0.2f,%0.2f,%0.2f", layers->temperature,
+                         layers->gamma[0], layers->gamma[1], layers->gamma[2]);
+}
+
+/*
+Create icc profile with Little CMS, alternative
+The vcgt is a parametric curve, lcms2 samples it into a 256 entries table.
+Composed with a calibrated base it is the sampled table instead.
+ */
+cmsHPROFILE cdutils_create_brightness_profile_lcms(double brightness,
+                                                   const VcgtLayers *layers,
+                                                   const BaseProfile *base) {
+  cmsHPROFILE hsRGB = NULL;
   char description[20];
   cmsMLU *mlu;
+  VcgtLayers neutral;
+  double white[3];
+  Vcgt table;
 
-  hsRGB = cmsCreate_sRGBProfile();
-  context_id = cmsCreateContext(NULL, NULL);
+  if (base != NULL) {
+    hsRGB = cmsOpenProfileFromMem(base->data, base->size);
+  }
+  if (hsRGB == NULL) {
+    hsRGB = cmsCreate_sRGBProfile();
+    base = NULL;
+  }
 
   /* description */
   mlu = cmsMLUalloc(NULL, 1);
@@ -70,63 +96,106 @@ cmsHPROFILE cdutils_create_brightness_profile_lcms(double brightness) {
   // cmsDictFree(hDict);
 
   /* vcgt */
-  /* map the brightness in case it is too dark */
-  double curve[] = {1.0, brightness, 0.0}; // gamma, a, b for (a X +b)^gamma
-  cmsToneCurve *tone_curve[3] = {
-      cmsBuildParametricToneCurve(context_id, 2, curve),
-      cmsBuildParametricToneCurve(context_id, 2, curve),
-      cmsBuildParametricToneCurve(context_id, 2, curve),
-  };
-  cmsWriteTag(hsRGB, cmsSigVcgtTag, tone_curve);
-  cmsFreeToneCurve(tone_curve[0]);
-  cmsFreeToneCurve(tone_curve[1]);
-  cmsFreeToneCurve(tone_curve[2]);
+  if (layers == NULL) {
+    vcgt_layers_init(&neutral);
+    layers = &neutral;
+  }
+  vcgt_white_point(layers->temperature, white);
+
+  cmsToneCurve *tone_curves[3] = {NULL, NULL, NULL};
+  if (base != NULL && base->vcgt != NULL &&
+      vcgt_init(&table, VCGT_SIZE_DEFAULT)) {
+    vcgt_set_layers(&table, layers);
+    vcgt_set_base(&table, base->vcgt, base->vcgt_size);
+    vcgt_fill_brightness(&table, brightness);
+    for (int c = 0; c < 3; c++) {
+      tone_curves[c] = cmsBuildTabulatedToneCurve16(
+          NULL, table.size, vcgt_channel(&table, c));
+    }
+    vcgt_destroy(&table);
+  } else {
+    /* k * X^(1/g) is (k^g X)^(1/g), k is brightness times the white point */
+    for (int c = 0; c < 3; c++) {
+      double g = layers->gamma[c];
+      /* (a X + b)^gamma, else c */
+      double curve[] = {1 / g, pow(brightness * white[c], g), 0.0, 0.0};
+      tone_curves[c] = cmsBuildParametricToneCurve(NULL, 2, curve);
+    }
+  }
+  if (tone_curves[0] != NULL && tone_curves[1] != NULL &&
+      tone_curves[2] != NULL) {
+    cmsWriteTag(hsRGB, cmsSigVcgtTag, tone_curves);
+  }
+  for (int c = 0; c < 3; c++) {
+    if (tone_curves[c] != NULL) {
+      cmsFreeToneCurve(tone_curves[c]);
+    }
+  }
 
   return hsRGB;
 }
 
-/* Create vcgt data for icc */
-static GPtrArray *cdutils_create_vcgt(double brightness) {
+/* Create vcgt data for icc, colord wants one CdColorRGB per entry */
+GPtrArray *cdutils_create_vcgt(double brightness, unsigned int size,
+                               const VcgtLayers *layers,
+                               const BaseProfile *base) {
   GPtrArray *array = cd_color_rgb_array_new();
-  CdColorRGB *data = NULL;
-  double smin = 0, smax = 1, dmin = 0, dmax = 1;
-
-  dmax = brightness;
-
-  int size = 256;
-  /* create array */
-  // array = g_ptr_array_new_with_free_func((GDestroyNotify)cd_color_rgb_free);
-  for (int i = 0; i < size; i++) {
-    data = cd_color_rgb_new();
-    float in = (gdouble)i / (gdouble)(size - 1);
-    // (x - smin) / (smax - smin) * (brightness - dmin) + dmin
-    float toneCurveVal = (in - smin) / (smax - smin) * (dmax - dmin) + dmin;
-    // printf("in: %f %f\n", in, toneCurveVal);
-    cd_color_rgb_set(data, toneCurveVal, toneCurveVal, toneCurveVal);
+  Vcgt vcgt;
+
+  if (!vcgt_init(&vcgt, size)) {
+    return array;
+  }
+  if (layers != NULL) {
+    vcgt_set_layers(&vcgt, layers);
+  }
+  if (base != NULL) {
+    vcgt_set_base(&vcgt, base->vcgt, base->vcgt_size);
+  }
+  vcgt_fill_brightness(&vcgt, brightness);
+
+  for (unsigned int i = 0; i < size; i++) {
+    CdColorRGB *data = cd_color_rgb_new();
+    cd_color_rgb_set(data, vcgt_channel(&vcgt, 0)[i] / 65535.0,
+                     vcgt_channel(&vcgt, 1)[i] / 65535.0,
+                     vcgt_channel(&vcgt, 2)[i] / 65535.0);
     g_ptr_array_add(array, data);
   }
 
+  vcgt_destroy(&vcgt);
   return array;
 }
 
-/* Create icc profile with colord */
+/*
+Create icc profile with colord, NULL and error set on failure. A base is
+loaded from its cached bytes, never from its file.
+ */
 CdIcc *cdutils_create_brightness_profile_colord(double brightness,
-                                                GError *error) {
-  CdIcc *icc = cd_icc_new();
+                                                unsigned int vcgt_size,
+                                                const VcgtLayers *layers,
+                                                const BaseProfile *base,
+                                                GError **error) {
+  g_autoptr(CdIcc) icc = cd_icc_new();
   char description[20];
   gpointer context = cd_icc_get_context(icc);
-  cmsHPROFILE hsRGB = cmsCreate_sRGBProfileTHR(context);
-  if (!cd_icc_load_handle(icc, hsRGB, CD_ICC_LOAD_FLAGS_NONE, &error)) {
+  cmsHPROFILE hsRGB =
+      base != NULL ? cmsOpenProfileFromMemTHR(context, base->data, base->size)
+                   : cmsCreate_sRGBProfileTHR(context);
+  g_autoptr(GPtrArray) vcgt = NULL;
+
+  /* The icc owns the handle once it is loaded */
+  if (hsRGB == NULL ||
+      !cd_icc_load_handle(icc, hsRGB, CD_ICC_LOAD_FLAGS_NONE, error)) {
     return NULL;
   }
 
-  if (!cd_icc_set_vcgt(icc, cdutils_create_vcgt(brightness), &error)) {
+  vcgt = cdutils_create_vcgt(brightness, vcgt_size, layers, base);
+  if (!cd_icc_set_vcgt(icc, vcgt, error)) {
     return NULL;
   }
-  sprintf(description, "Brightness %0.2f", brightness);
+  snprintf(description, sizeof(description), "Brightness %0.2f", brightness);
   cd_icc_set_description(icc, NULL, description);
 
-  return icc;
+  return g_steal_pointer(&icc);
 }
 
 /* Make sure you have connected to device before you show it */
@@ -154,226 +223,1757 @@ static void cdutils_show_profile(CdProfile *profile) {
          cdutils_is_profile_created_by_us(profile) ? "true" : "false");
 }
 
-static CdUtilConnection *cdutils_create_connection(GError **error) {
-  CdUtilConnection *connection = NULL;
-  CdClient *client = NULL;
-  GPtrArray *devices = NULL;
+static void cdutils_connection_drop_devices(CdUtilConnection *connection) {
+  for (guint i = 0; i < connection->n_displays; i++) {
+    g_object_unref(connection->displays[i].device);
+    g_clear_pointer(&connection->displays[i].checked, g_free);
+  }
+  connection->n_displays = 0;
+  profile_cache_reset_devices(&connection->cache);
 
-  /* Connecto to colord */
-  client = cd_client_new();
-  if (!cd_client_connect_sync(client, NULL, error)) {
-    printf("cannot connect to colord\n");
-    goto out;
+  if (connection->devices != NULL) {
+    g_ptr_array_unref(connection->devices);
+    connection->devices = NULL;
   }
+}
+
+/* A background delete, timed for the delete_profile histogram */
+typedef struct {
+  CdUtilConnection *connection;
+  gint64 start;
+  CdUtilDoneFunc done; /* may be NULL */
+  gpointer user_data;
+} CdUtilDeleteOp;
+
+static void cdutils_delete_profile_cb(GObject *source, GAsyncResult *res,
+                                      gpointer user_data) {
+  CdUtilDeleteOp *op = user_data;
+  CdUtilConnection *connection = op->connection;
+  GError *error = NULL;
+
+  gboolean success;
+
+  metrics_observe(METRICS_STAGE_DELETE_PROFILE, op->start);
+  connection->pending--;
+  success = cd_client_delete_profile_finish(CD_CLIENT(source), res, &error);
+  if (!success) {
+    printf("delete profile fail: %s\n", error->message);
+    g_error_free(error);
+  }
+  if (op->done != NULL) {
+    op->done(success, op->user_data);
+  }
+  g_free(op);
+}
+
+/* Delete a profile in the background, done may be NULL if nobody waits */
+static void cdutils_delete_profile(CdUtilConnection *connection,
+                                   CdProfile *profile, CdUtilDoneFunc done,
+                                   gpointer user_data) {
+  CdUtilDeleteOp *op = g_new(CdUtilDeleteOp, 1);
+
+  op->connection = connection;
+  op->start = metrics_now();
+  op->done = done;
+  op->user_data = user_data;
+  metrics_inc(METRICS_DBUS_DELETE_PROFILE);
+  connection->pending++;
+  cd_client_delete_profile(connection->client, profile, NULL,
+                           cdutils_delete_profile_cb, op);
+}
+
+/* Delete an evicted profile from colord and its icc file from disk */
+static void cdutils_profile_cache_evict(ProfileCacheEntry *entry,
+                                        void *user_data) {
+  CdUtilConnection *connection = user_data;
+  CdProfile *profile = entry->profile;
 
-  /* Get all display devices */
-  devices = cd_client_get_devices_by_kind_sync(client, CD_DEVICE_KIND_DISPLAY,
-                                               NULL, error);
-  if (devices == NULL) {
-    goto out;
+  /* Profiles do not survive a colord restart, only our icc file does */
+  if (!connection->restarted) {
+    cdutils_delete_profile(connection, profile, NULL, NULL);
   }
 
-  connection = malloc(sizeof(CdUtilConnection));
-  connection->client = client;
-  connection->devices = devices;
+  remove(entry->filepath);
+  g_object_unref(profile);
+}
+
+/* Forget everything learned from colord, keep the CdClient for reuse */
+static void cdutils_connection_close(CdUtilConnection *connection) {
+  profile_cache_clear(&connection->cache);
+  g_hash_table_remove_all(connection->foreign);
+  cdutils_connection_drop_devices(connection);
+
+  /* The parsed base stays, it is only read again if its contents changed */
+  if (connection->base_profile != NULL) {
+    g_signal_handlers_disconnect_by_data(connection->base_profile,
+                                         connection);
+    g_clear_object(&connection->base_profile);
+  }
+}
+
+/* colord restarted or dropped off the bus */
+static void cdutils_client_changed_cb(CdClient *client, gpointer user_data) {
+  CdUtilConnection *connection = user_data;
+  (void)client;
+  connection->stale = TRUE;
+  connection->restarted = TRUE;
+}
+
+/* A display was hotplugged, our profiles are still valid */
+static void cdutils_client_device_cb(CdClient *client, CdDevice *device,
+                                     gpointer user_data) {
+  CdUtilConnection *connection = user_data;
+  (void)client;
+  (void)device;
+  connection->devices_changed = TRUE;
+}
+
+static void cdutils_backlight_clear(gpointer data) {
+  CdUtilBacklight *backlight = data;
+  g_free(backlight->name);
+  g_free(backlight->connector);
+}
 
+/*
+Create a connection object, the colord session is opened on first use.
+Up to cache_size profiles are kept registered, brightness is quantized to
+cache_step so nearby levels share a profile.
+ */
+CdUtilConnection *cdutils_connection_new(double cache_step,
+                                         unsigned int cache_size) {
+  CdUtilConnection *connection = g_new0(CdUtilConnection, 1);
+  connection->stale = TRUE;
+  connection->follow = CDUTILS_FOLLOW_PRIMARY;
+  connection->generator = CDUTILS_GENERATOR_TEMPLATE;
+  connection->vcgt_size = VCGT_SIZE_DEFAULT;
+  vcgt_layers_init(&connection->layers);
+  connection->retired = CDUTILS_RETIRED_LEVEL - 1;
+  connection->use_base = TRUE;
+  connection->profile_dir = g_strdup(CDUTILS_PROFILE_DIR);
+  connection->max_profiles = CDUTILS_MAX_PROFILES;
+  connection->foreign =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  connection->backlights = g_array_new(FALSE, TRUE, sizeof(CdUtilBacklight));
+  g_array_set_clear_func(connection->backlights, cdutils_backlight_clear);
+  profile_cache_init(&connection->cache, cache_step, cache_size,
+                     cdutils_profile_cache_evict, connection);
   return connection;
+}
+
+void cdutils_connection_set_profile_dir(CdUtilConnection *connection,
+                                        const char *profile_dir) {
+  g_free(connection->profile_dir);
+  connection->profile_dir = g_strdup(profile_dir);
+}
 
-out:
-  if (*error != NULL) {
-    printf("error: %s\n", (*error)->message);
-    g_error_free(*error);
+gboolean cdutils_connection_set_pack(CdUtilConnection *connection,
+                                     const char *path) {
+  profile_pack_close(&connection->pack);
+  return profile_pack_open(&connection->pack, path, connection->cache.step,
+                           connection->vcgt_size);
+}
+
+/* Levels are handed out through next, each thread serializes its own */
+typedef struct {
+  double step;
+  unsigned int vcgt_size;
+  guint count;
+  gint next;
+  GBytes **icc;
+  gint failed;
+} CdUtilPackBuild;
+
+static gpointer cdutils_pack_build_thread(gpointer user_data) {
+  CdUtilPackBuild *build = user_data;
+  gint level;
+
+  while ((level = g_atomic_int_add(&build->next, 1)) < (gint)build->count) {
+    g_autoptr(GError) error = NULL;
+    double brightness = MIN(level * build->step, 1);
+    g_autoptr(CdIcc) icc = cdutils_create_brightness_profile_colord(
+        brightness, build->vcgt_size, NULL, NULL, &error);
+
+    if (icc != NULL) {
+      build->icc[level] = cd_icc_save_data(icc, CD_ICC_SAVE_FLAGS_NONE, &error);
+    }
+    if (build->icc[level] == NULL) {
+      printf("level %0.2f: %s\n", brightness,
+             error != NULL ? error->message : "failed");
+      g_atomic_int_set(&build->failed, 1);
+    }
   }
+  return NULL;
+}
 
-  if (client != NULL) {
-    g_object_unref(client);
+gboolean cdutils_build_profile_pack(const char *path, double cache_step,
+                                    unsigned int vcgt_size,
+                                    unsigned int jobs) {
+  CdUtilPackBuild build = {cache_step, vcgt_size,
+                           profile_pack_count(cache_step), 0, NULL, 0};
+  GThread **threads;
+  const uint8_t **icc;
+  uint32_t *sizes;
+  gboolean ret = FALSE;
+
+  if (jobs == 0) {
+    jobs = g_get_num_processors();
+  }
+  jobs = MIN(jobs, build.count);
+  build.icc = g_new0(GBytes *, build.count);
+  threads = g_new0(GThread *, jobs);
+  for (unsigned int i = 0; i < jobs; i++) {
+    threads[i] = g_thread_new("pack", cdutils_pack_build_thread, &build);
   }
+  for (unsigned int i = 0; i < jobs; i++) {
+    g_thread_join(threads[i]);
+  }
+  g_free(threads);
 
-  if (devices != NULL) {
-    g_ptr_array_unref(devices);
+  if (!build.failed) {
+    icc = g_new(const uint8_t *, build.count);
+    sizes = g_new(uint32_t, build.count);
+    for (guint i = 0; i < build.count; i++) {
+      gsize size;
+      icc[i] = g_bytes_get_data(build.icc[i], &size);
+      sizes[i] = size;
+    }
+    ret = profile_pack_write(path, cache_step, vcgt_size, icc, sizes,
+                             build.count);
+    g_free(icc);
+    g_free(sizes);
   }
 
-  return NULL;
+  for (guint i = 0; i < build.count; i++) {
+    if (build.icc[i] != NULL) {
+      g_bytes_unref(build.icc[i]);
+    }
+  }
+  g_free(build.icc);
+  return ret;
 }
 
 /*
-1. Connect to colord
-2. Get all display devices
-3. Connect to first display device
-4. Create new icc
-5. Save icc file
-6. Create profile with icc
-7. Device add profile
-8. Device make profile default
-9. Remove previous profile
+Register a sysfs backlight before connecting, its index is what
+cdutils_icc_change_brightness_async() takes. connector may be NULL.
  */
-static gboolean cdutils_icc_change_brightness(double brightness,
-                                              CdObjectScope cdObjectScope) {
-  GError *error = NULL;
-  CdUtilConnection *connection;
-  CdDevice *device = NULL;
-  CdProfile *default_profile = NULL;
-  CdProfile *new_profile = NULL;
-  gboolean ret = FALSE;    // stores returned value by other functions
-  gboolean retVal = FALSE; // the value this function returns
-  char *uid;
-  char filepath[255];
-  gchar filename[255];
-  g_autoptr(GHashTable) profile_props = NULL;
+int cdutils_connection_add_backlight(CdUtilConnection *connection,
+                                     const char *name, const char *connector) {
+  CdUtilBacklight backlight = {g_strdup(name), g_strdup(connector)};
+  g_array_append_val(connection->backlights, backlight);
+  connection->devices_changed = TRUE;
+  return connection->backlights->len - 1;
+}
 
-  connection = cdutils_create_connection(&error);
+/* Leave our profiles registered in colord, only drop the references */
+void cdutils_connection_detach_profiles(CdUtilConnection *connection) {
   if (connection == NULL) {
-    goto out;
+    return;
   }
+  for (unsigned int i = 0; i < connection->cache.len; i++) {
+    g_object_unref(connection->cache.entries[i].profile);
+  }
+  profile_cache_forget(&connection->cache);
+}
 
-  /* Connect to first display device */
-  device = g_ptr_array_index(connection->devices, 0);
-  if (!cd_device_connect_sync(device, NULL, &error)) {
-    goto out;
+void cdutils_connection_free(CdUtilConnection *connection) {
+  if (connection == NULL) {
+    return;
   }
 
-  /* Show first display */
-  printf("========== Show current device ==========\n");
-  cdutils_show_device(device);
+  cdutils_connection_close(connection);
 
-  default_profile = cd_device_get_default_profile(device);
+  /* Background calls reference the connection */
+  while (connection->pending > 0) {
+    g_main_context_iteration(NULL, TRUE);
+  }
 
-  /* Show current default profile */
-  // if (default_profile != NULL) {
-  //   printf("get default profile success\n");
-  //   if (cd_profile_connect_sync(default_profile, NULL, &error)) {
-  //     cdutils_show_profile(default_profile);
-  //   }
-  // }
+  profile_cache_destroy(&connection->cache);
+  profile_writer_destroy(&connection->writer);
+  profile_pack_close(&connection->pack);
+  base_profile_destroy(&connection->base);
+  g_free(connection->profile_dir);
+  g_hash_table_unref(connection->foreign);
+  g_array_unref(connection->backlights);
+  if (connection->client != NULL) {
+    g_signal_handlers_disconnect_by_data(connection->client, connection);
+    g_object_unref(connection->client);
+  }
+  g_free(connection);
+}
 
-  /* Create new profile */
-  printf("========== Creating New profile ==========\n");
+/*
+Pair displays with backlights:
+1. the display whose connector matches the one sysfs reports
+2. otherwise the embedded panel, e.g. for acpi_video0
+3. otherwise the first display drives the primary backlight, as before
+ */
+static void cdutils_match_displays(CdUtilConnection *connection) {
+  for (guint i = 0; i < connection->n_displays; i++) {
+    connection->displays[i].backlight = CDUTILS_NO_BACKLIGHT;
+    connection->displays[i].current = -1;
+  }
 
-  uid = get_uuid();
-  sprintf(filename, "brightness-%0.2f-%s", brightness, uid);
-  sprintf(filepath, "/tmp/icc-brightness/%s", strdup(filename));
+  for (guint b = 0; b < connection->backlights->len; b++) {
+    CdUtilBacklight *backlight =
+        &g_array_index(connection->backlights, CdUtilBacklight, b);
+    gboolean matched = FALSE;
 
-  // printf("uid: %s\n", uid);
-  // printf("filename: %s\n", filename);
-  // printf("filepth: %s\n", filepath);
+    for (guint i = 0; backlight->connector != NULL && i < connection->n_displays;
+         i++) {
+      CdUtilDisplay *display = &connection->displays[i];
+      if (display->backlight == CDUTILS_NO_BACKLIGHT &&
+          g_strcmp0(cd_device_get_metadata_item(
+                        display->device, CD_DEVICE_METADATA_XRANDR_NAME),
+                    backlight->connector) == 0) {
+        display->backlight = b;
+        matched = TRUE;
+      }
+    }
 
-  /* create profile with colord */
-  ret = cd_icc_save_file(
-      cdutils_create_brightness_profile_colord(brightness, error),
-      g_file_new_for_path(filepath), CD_ICC_SAVE_FLAGS_NONE, NULL, &error);
+    for (guint i = 0; !matched && i < connection->n_displays; i++) {
+      CdUtilDisplay *display = &connection->displays[i];
+      if (display->backlight == CDUTILS_NO_BACKLIGHT &&
+          cd_device_get_embedded(display->device)) {
+        display->backlight = b;
+        matched = TRUE;
+      }
+    }
 
-  /* create profile with Little CMS, alternative */
-  // ret =
-  // cmsSaveProfileToFile(cdutils_create_brightness_profile_lcms(brightness),
-  //                            filepath);
+    if (!matched && b == 0 && connection->n_displays > 0 &&
+        connection->displays[0].backlight == CDUTILS_NO_BACKLIGHT) {
+      connection->displays[0].backlight = 0;
+    }
+  }
+}
 
-  if (ret) {
-    printf("save icc success\n");
-  } else {
-    printf("save icc fail\n");
-    goto out;
+/* Whether a change of this backlight is applied to the display */
+static gboolean cdutils_display_follows(CdUtilConnection *connection,
+                                        CdUtilDisplay *display,
+                                        int backlight) {
+  if (display->backlight == backlight) {
+    return TRUE;
   }
+  return display->backlight == CDUTILS_NO_BACKLIGHT && backlight == 0 &&
+         connection->follow == CDUTILS_FOLLOW_PRIMARY;
+}
 
-  /* Create new profile by cd_client_create_profile_sync */
-  profile_props = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
-  g_hash_table_insert(profile_props, (gpointer)CD_PROFILE_PROPERTY_FILENAME,
-                      filepath);
-  g_hash_table_insert(profile_props, (gpointer)props_key_creator,
-                      (gpointer)props_value_creator);
-  g_hash_table_insert(profile_props, (gpointer) "Profile brightness",
-                      (gpointer)g_strdup_printf("%0.2f", brightness));
-
-  new_profile = cd_client_create_profile_sync(
-      connection->client, filename, cdObjectScope, profile_props, NULL, &error);
-
-  /* Device add profile and make profile default */
-  if (CD_IS_PROFILE(new_profile)) {
-    printf("create new profile success\n");
-    if (cd_device_add_profile_sync(device, CD_DEVICE_RELATION_HARD, new_profile,
-                                   NULL, &error)) {
-      printf("device add new_profile success\n");
-    }
-
-    if (cd_device_make_profile_default_sync(device, new_profile, NULL,
-                                            &error)) {
-      printf("device make new_profile default success\n");
-    }
-  }
-
-  /* Delete our previous profile */
-  if (CD_IS_PROFILE(default_profile)) {
-    if (cd_profile_connect_sync(default_profile, NULL, &error)) {
-      if (cdutils_is_profile_created_by_us(default_profile)) {
-        if (cd_client_delete_profile_sync(connection->client, default_profile,
-                                          NULL, &error)) {
-          printf("delete previous profile succes\n");
-        }
-        const gchar *previous_profile_filename = NULL;
-        previous_profile_filename = cd_profile_get_filename(default_profile);
-        if (remove(previous_profile_filename) == 0) {
-          printf("delete previous icc file success\n");
-        }
-      }
+/* State of one chain of async calls */
+typedef struct {
+  CdUtilConnection *connection;
+  guint outstanding;   /* device or profile connects still in flight */
+  GPtrArray *profiles; /* of the primary display, looking for the base */
+  CdUtilDoneFunc done;
+  gpointer user_data;
+} CdUtilOpenJob;
+
+static void cdutils_connection_set_base(CdUtilConnection *connection,
+                                        CdProfile *profile);
+static void cdutils_connection_drop_base(CdUtilConnection *connection);
+
+static void cdutils_open_job_finish(CdUtilOpenJob *job, gboolean success,
+                                    GError *error) {
+  if (error != NULL) {
+    printf("error: %s\n", error->message);
+    g_error_free(error);
+  }
+
+  if (success) {
+    job->connection->stale = FALSE;
+    job->connection->devices_changed = FALSE;
+  }
+
+  job->done(success, job->user_data);
+  g_free(job);
+}
+
+/* Levels are shared by every display, they are built on the primary one */
+static guint cdutils_base_display(CdUtilConnection *connection) {
+  for (guint i = 0; i < connection->n_displays; i++) {
+    if (connection->displays[i].backlight == 0) {
+      return i;
     }
   }
+  return 0;
+}
+
+/* Levels are shared, the calibration of one display is wrong for others */
+static gboolean cdutils_base_fits(CdUtilConnection *connection) {
+  guint dimmed = 0;
 
-  /* Print current default profile */
-  printf("========== Show current default profile ==========\n");
-  default_profile = cd_device_get_default_profile(device);
-  if (default_profile != NULL) {
-    if (cd_profile_connect_sync(default_profile, NULL, &error)) {
-      cdutils_show_profile(default_profile);
+  for (guint i = 0; i < connection->n_displays; i++) {
+    CdUtilDisplay *display = &connection->displays[i];
+    if (display->backlight != CDUTILS_NO_BACKLIGHT ||
+        cdutils_display_follows(connection, display, 0)) {
+      dimmed++;
     }
-  } else {
-    printf("(no default profile)");
   }
+  return connection->use_base && dimmed <= 1;
+}
 
-  retVal = TRUE;
-  goto out;
+/* What was default before ours: the first profile that is not ours */
+static void cdutils_open_base_connect_cb(GObject *source, GAsyncResult *res,
+                                         gpointer user_data) {
+  CdUtilOpenJob *job = user_data;
+  GError *error = NULL;
 
-out:
-  if (error != NULL) {
+  if (!cd_profile_connect_finish(CD_PROFILE(source), res, &error)) {
     printf("error: %s\n", error->message);
     g_error_free(error);
   }
+  if (--job->outstanding > 0) {
+    return;
+  }
 
-  if (connection->client != NULL) {
-    g_object_unref(connection->client);
+  for (guint i = 0; i < job->profiles->len; i++) {
+    CdProfile *profile = g_ptr_array_index(job->profiles, i);
+    if (cd_profile_get_connected(profile) &&
+        !cdutils_is_profile_created_by_us(profile) &&
+        cd_profile_get_filename(profile) != NULL) {
+      cdutils_connection_set_base(job->connection, profile);
+      break;
+    }
   }
+  g_clear_pointer(&job->profiles, g_ptr_array_unref);
+  cdutils_open_job_finish(job, TRUE, NULL);
+}
 
-  if (connection->devices != NULL) {
-    g_ptr_array_unref(connection->devices);
+/*
+Find the base profile on every open: the profiles of the primary display
+are connected to at once, only a base colord did not have before is read.
+ */
+static void cdutils_open_find_base(CdUtilOpenJob *job) {
+  CdUtilConnection *connection = job->connection;
+  CdDevice *device =
+      connection->displays[cdutils_base_display(connection)].device;
+
+  if (cdutils_base_fits(connection)) {
+    job->profiles = cd_device_get_profiles(device);
+  } else {
+    cdutils_connection_drop_base(connection);
+  }
+  if (job->profiles == NULL || job->profiles->len == 0) {
+    g_clear_pointer(&job->profiles, g_ptr_array_unref);
+    cdutils_open_job_finish(job, TRUE, NULL);
+    return;
+  }
+
+  job->outstanding = job->profiles->len;
+  for (guint i = 0; i < job->profiles->len; i++) {
+    metrics_inc(METRICS_DBUS_PROFILE_CONNECT);
+    cd_profile_connect(g_ptr_array_index(job->profiles, i), NULL,
+                       cdutils_open_base_connect_cb, job);
+  }
+}
+
+static void cdutils_open_device_connect_cb(GObject *source, GAsyncResult *res,
+                                           gpointer user_data) {
+  CdUtilOpenJob *job = user_data;
+  CdUtilConnection *connection = job->connection;
+  GError *error = NULL;
+
+  if (!cd_device_connect_finish(CD_DEVICE(source), res, &error)) {
+    printf("error: %s\n", error->message);
+    g_error_free(error);
+  } else if (connection->n_displays < CDUTILS_MAX_DISPLAYS) {
+    connection->displays[connection->n_displays++].device =
+        g_object_ref(CD_DEVICE(source));
   }
 
-  if (default_profile != NULL) {
-    g_object_unref(default_profile);
+  if (--job->outstanding > 0) {
+    return;
   }
 
-  if (new_profile != NULL) {
-    g_object_unref(new_profile);
+  if (connection->n_displays == 0) {
+    printf("no display device\n");
+    cdutils_open_job_finish(job, FALSE, NULL);
+    return;
   }
 
-  return retVal;
+  cdutils_match_displays(connection);
+  cdutils_open_find_base(job);
 }
 
-static gboolean cdutils_list_devices(GError **error) {
-  gboolean retVal = FALSE;
-  CdUtilConnection *connection = cdutils_create_connection(error);
+static void cdutils_open_get_devices_cb(GObject *source, GAsyncResult *res,
+                                        gpointer user_data) {
+  CdUtilOpenJob *job = user_data;
+  CdUtilConnection *connection = job->connection;
+  GError *error = NULL;
+
+  connection->devices =
+      cd_client_get_devices_by_kind_finish(CD_CLIENT(source), res, &error);
+  if (connection->devices == NULL) {
+    cdutils_open_job_finish(job, FALSE, error);
+    return;
+  }
 
-  if (connection == NULL) {
-    goto out;
+  if (connection->devices->len == 0) {
+    printf("no display device\n");
+    cdutils_open_job_finish(job, FALSE, NULL);
+    return;
   }
 
+  /* Connect to every display device at once */
+  job->outstanding = connection->devices->len;
   for (guint i = 0; i < connection->devices->len; i++) {
-    CdDevice *device = g_ptr_array_index(connection->devices, i);
-    if (cd_device_connect_sync(device, NULL, error)) {
-      cdutils_show_device(device);
+    metrics_inc(METRICS_DBUS_DEVICE_CONNECT);
+    cd_device_connect(g_ptr_array_index(connection->devices, i), NULL,
+                      cdutils_open_device_connect_cb, job);
+  }
+}
+
+/*
+1. Get all display devices
+2. Connect to all of them
+3. Pair them with the sysfs backlights
+4. Find the profile levels are built on
+ */
+static void cdutils_open_devices(CdUtilOpenJob *job) {
+  cdutils_connection_drop_devices(job->connection);
+
+  metrics_inc(METRICS_DBUS_GET_DEVICES);
+  cd_client_get_devices_by_kind(job->connection->client,
+                                CD_DEVICE_KIND_DISPLAY, NULL,
+                                cdutils_open_get_devices_cb, job);
+}
+
+static void cdutils_open_client_connect_cb(GObject *source, GAsyncResult *res,
+                                           gpointer user_data) {
+  CdUtilOpenJob *job = user_data;
+  GError *error = NULL;
+
+  if (!cd_client_connect_finish(CD_CLIENT(source), res, &error)) {
+    printf("cannot connect to colord\n");
+    cdutils_open_job_finish(job, FALSE, error);
+    return;
+  }
+
+  cdutils_open_devices(job);
+}
+
+/*
+Make sure the connection is usable, reconnect only if colord went away and
+refetch devices only after a hotplug. done may run before this returns.
+ */
+static void cdutils_connection_ensure_async(CdUtilConnection *connection,
+                                            CdUtilDoneFunc done,
+                                            gpointer user_data) {
+  CdUtilOpenJob *job;
+
+  if (!connection->stale && connection->client != NULL &&
+      cd_client_get_connected(connection->client) &&
+      !connection->devices_changed) {
+    done(TRUE, user_data);
+    return;
+  }
+
+  job = g_new0(CdUtilOpenJob, 1);
+  job->connection = connection;
+  job->done = done;
+  job->user_data = user_data;
+
+  if (!connection->stale && connection->client != NULL &&
+      cd_client_get_connected(connection->client)) {
+    cdutils_open_devices(job);
+    return;
+  }
+
+  if (connection->client == NULL) {
+    connection->client = cd_client_new();
+    g_signal_connect(connection->client, "changed",
+                     G_CALLBACK(cdutils_client_changed_cb), connection);
+    g_signal_connect(connection->client, "device-added",
+                     G_CALLBACK(cdutils_client_device_cb), connection);
+    g_signal_connect(connection->client, "device-removed",
+                     G_CALLBACK(cdutils_client_device_cb), connection);
+  } else {
+    metrics_inc(METRICS_RECONNECTS);
+  }
+
+  connection->stale = TRUE;
+  cdutils_connection_close(connection);
+  connection->restarted = FALSE;
+
+  /* Connect to colord */
+  metrics_inc(METRICS_DBUS_CLIENT_CONNECT);
+  cd_client_connect(connection->client, NULL, cdutils_open_client_connect_cb,
+                    job);
+}
+
+/* State of one brightness change */
+typedef struct {
+  CdUtilConnection *connection;
+  int backlight;
+  double brightness;
+  int level;
+  CdObjectScope scope;
+  gchar *filename;
+  gchar *filepath;
+  guint outstanding; /* display updates still in flight */
+  gboolean success;
+  gint64 start; /* of the create_profile call */
+  gboolean register_only; /* pool: add to every display, make nothing default */
+  CdUtilDoneFunc done;
+  gpointer user_data;
+} CdUtilApplyJob;
+
+/* Update of one display, all of them run concurrently */
+typedef struct {
+  CdUtilApplyJob *job;
+  guint display;
+  CdProfile *profile;
+  gint64 start; /* of the D-Bus call in flight */
+} CdUtilDisplayOp;
+
+static void cdutils_apply_job_finish(CdUtilApplyJob *job, gboolean success,
+                                     GError *error) {
+  if (error != NULL) {
+    printf("error: %s\n", error->message);
+    g_error_free(error);
+  }
+  if (!success) {
+    metrics_inc(METRICS_APPLY_FAILURES);
+  }
+
+  job->done(success, job->user_data);
+
+  g_free(job->filename);
+  g_free(job->filepath);
+  g_free(job);
+}
+
+/* The display shows the cached profile of level now, -1 for none of ours */
+static void cdutils_display_set_current(CdUtilConnection *connection,
+                                        guint index, int level) {
+  CdUtilDisplay *display = &connection->displays[index];
+  ProfileCacheEntry *previous =
+      profile_cache_peek(&connection->cache, display->current);
+  ProfileCacheEntry *entry = profile_cache_peek(&connection->cache, level);
+
+  if (previous != NULL && previous->users > 0) {
+    previous->users--;
+  }
+  if (entry != NULL) {
+    entry->users++;
+    entry->devices |= 1UL << index;
+  }
+  display->current = entry != NULL ? level : -1;
+
+  /* Made with other layers, nothing will make it default again */
+  if (previous != NULL && previous->users == 0 &&
+      previous->level < CDUTILS_RETIRED_LEVEL) {
+    profile_cache_remove(&connection->cache, previous->level);
+  }
+  /* The one it replaced may be over capacity */
+  profile_cache_trim(&connection->cache);
+}
+
+/*
+Cached levels were made from what changed, layers or base. Those not default
+anywhere are deleted now. The ones that are stay until every display moved
+on, under a key below CDUTILS_RETIRED_LEVEL so no brightness finds them.
+ */
+static void cdutils_connection_retire(CdUtilConnection *connection) {
+  for (unsigned int i = connection->cache.len; i-- > 0;) {
+    ProfileCacheEntry *entry = &connection->cache.entries[i];
+    if (entry->level < 0) {
+      continue;
+    }
+    if (entry->users == 0) {
+      profile_cache_remove(&connection->cache, entry->level);
+      continue;
+    }
+    for (guint d = 0; d < connection->n_displays; d++) {
+      if (connection->displays[d].current == entry->level) {
+        connection->displays[d].current = connection->retired;
+      }
+    }
+    entry->level = connection->retired--;
+  }
+
+  /* Not adoptable may have been a matter of layers or base */
+  for (guint d = 0; d < connection->n_displays; d++) {
+    g_clear_pointer(&connection->displays[d].checked, g_free);
+  }
+}
+
+gboolean cdutils_connection_set_layers(CdUtilConnection *connection,
+                                       const VcgtLayers *layers) {
+  if (vcgt_layers_equal(&connection->layers, layers)) {
+    return TRUE;
+  }
+  /* Every pool level would have to be made again */
+  if (connection->pool_size > 0 && connection->cache.len > 0) {
+    return FALSE;
+  }
+  connection->layers = *layers;
+  cdutils_connection_retire(connection);
+  return TRUE;
+}
+
+/* The base profile of levels, NULL while on sRGB */
+static const BaseProfile *cdutils_base(CdUtilConnection *connection) {
+  return connection->base.data != NULL ? &connection->base : NULL;
+}
+
+/* colord reports a new filename or contents, read it before the next level */
+static void cdutils_base_changed_cb(CdProfile *profile, gpointer user_data) {
+  CdUtilConnection *connection = user_data;
+  (void)profile;
+  connection->base_changed = TRUE;
+}
+
+/*
+Build levels on profile from now on. Its file is only read when the profile
+is new or colord reported a change, never per brightness change, and cached
+levels are only retired when its contents differ.
+ */
+static void cdutils_connection_set_base(CdUtilConnection *connection,
+                                        CdProfile *profile) {
+  const gchar *filename = cd_profile_get_filename(profile);
+  BaseProfile base;
+
+  if (connection->base_profile != NULL && !connection->base_changed &&
+      g_strcmp0(cd_profile_get_object_path(connection->base_profile),
+                cd_profile_get_object_path(profile)) == 0) {
+    return;
+  }
+  if (connection->base_profile != profile) {
+    if (connection->base_profile != NULL) {
+      g_signal_handlers_disconnect_by_data(connection->base_profile,
+                                           connection);
+      g_object_unref(connection->base_profile);
     }
+    connection->base_profile = g_object_ref(profile);
+    g_signal_connect(profile, "changed", G_CALLBACK(cdutils_base_changed_cb),
+                     connection);
+  }
+  connection->base_changed = FALSE;
+
+  metrics_inc(METRICS_BASE_PROFILE_LOADS);
+  if (filename == NULL || !base_profile_load(&base, filename)) {
+    printf("base profile %s cannot be parsed, keep the previous one\n",
+           filename != NULL ? filename : cd_profile_get_id(profile));
+    return;
+  }
+  if (connection->base.data != NULL &&
+      strcmp(connection->base.id, base.id) == 0) {
+    base_profile_destroy(&base);
+    return;
+  }
+  /* Every pool level would have to be made again */
+  if (connection->pool_size > 0 && connection->cache.len > 0) {
+    printf("base profile %s changed, the pool keeps the previous one\n",
+           filename);
+    base_profile_destroy(&base);
+    return;
   }
 
-  retVal = true;
-  return retVal;
+  printf("base profile %s%s\n", filename,
+         base.vcgt != NULL ? ", calibrated" : "");
+  base_profile_destroy(&connection->base);
+  connection->base = base;
+  /* Laid out again on the new base by the next level */
+  profile_writer_destroy(&connection->writer);
+  cdutils_connection_retire(connection);
+}
+
+/* Back to sRGB, e.g. an external monitor now follows the panel */
+static void cdutils_connection_drop_base(CdUtilConnection *connection) {
+  if (connection->base_profile != NULL) {
+    g_signal_handlers_disconnect_by_data(connection->base_profile,
+                                         connection);
+    g_clear_object(&connection->base_profile);
+  }
+  connection->base_changed = FALSE;
+  if (connection->base.data == NULL) {
+    return;
+  }
+  /* Every pool level would have to be made again */
+  if (connection->pool_size > 0 && connection->cache.len > 0) {
+    printf("levels are shared by several displays, the pool keeps its base\n");
+    return;
+  }
 
-out:
-  return retVal;
-}
\ No newline at end of file
+  printf("levels are shared by several displays, build them on sRGB\n");
+  base_profile_destroy(&connection->base);
+  profile_writer_destroy(&connection->writer);
+  cdutils_connection_retire(connection);
+}
+
+static void cdutils_display_op_finish(CdUtilDisplayOp *op, gboolean success) {
+  CdUtilApplyJob *job = op->job;
+  CdUtilConnection *connection = job->connection;
+
+  if (success) {
+    if (!job->register_only) {
+      cdutils_display_set_current(connection, op->display, job->level);
+    }
+  } else {
+    job->success = FALSE;
+    /* Keep the cache, the device may be gone, colord likely is not */
+    connection->devices_changed = TRUE;
+  }
+
+  g_object_unref(op->profile);
+  g_free(op);
+
+  if (--job->outstanding == 0) {
+    cdutils_apply_job_finish(job, job->success, NULL);
+  }
+}
+
+static void cdutils_display_make_default_cb(GObject *source, GAsyncResult *res,
+                                            gpointer user_data) {
+  CdUtilDisplayOp *op = user_data;
+  GError *error = NULL;
+  gboolean success;
+
+  metrics_observe(METRICS_STAGE_MAKE_DEFAULT, op->start);
+  success = cd_device_make_profile_default_finish(CD_DEVICE(source), res,
+                                                  &error);
+  if (success) {
+    printf("%s: make profile default success\n",
+           cd_device_get_id(CD_DEVICE(source)));
+  } else {
+    printf("error: %s\n", error->message);
+    g_error_free(error);
+  }
+  cdutils_display_op_finish(op, success);
+}
+
+static void cdutils_display_make_default(CdUtilDisplayOp *op) {
+  CdUtilConnection *connection = op->job->connection;
+
+  metrics_inc(METRICS_DBUS_MAKE_PROFILE_DEFAULT);
+  op->start = metrics_now();
+  cd_device_make_profile_default(connection->displays[op->display].device,
+                                 op->profile, NULL,
+                                 cdutils_display_make_default_cb, op);
+}
+
+static void cdutils_display_add_profile_cb(GObject *source, GAsyncResult *res,
+                                           gpointer user_data) {
+  CdUtilDisplayOp *op = user_data;
+  CdUtilConnection *connection = op->job->connection;
+  ProfileCacheEntry *entry;
+  GError *error = NULL;
+  gboolean added;
+
+  metrics_observe(METRICS_STAGE_ADD_PROFILE, op->start);
+  added = cd_device_add_profile_finish(CD_DEVICE(source), res, &error);
+  if (added) {
+    printf("%s: add profile success\n", cd_device_get_id(CD_DEVICE(source)));
+  } else {
+    printf("error: %s\n", error->message);
+    g_error_free(error);
+  }
+
+  entry = profile_cache_peek(&connection->cache, op->job->level);
+  if (entry != NULL) {
+    entry->devices |= 1UL << op->display;
+  }
+  if (op->job->register_only) {
+    cdutils_display_op_finish(op, added);
+    return;
+  }
+  cdutils_display_make_default(op);
+}
+
+/* Make the cached profile of the job level default on every target display */
+static void cdutils_apply_to_displays(CdUtilApplyJob *job,
+                                      ProfileCacheEntry *entry) {
+  CdUtilConnection *connection = job->connection;
+
+  job->outstanding = 1; /* held until every display op is started */
+  job->success = TRUE;
+
+  for (guint i = 0; i < connection->n_displays; i++) {
+    CdUtilDisplay *display = &connection->displays[i];
+    CdUtilDisplayOp *op;
+
+    if (job->register_only ? (entry->devices & (1UL << i)) != 0
+                           : !cdutils_display_follows(connection, display,
+                                                      job->backlight) ||
+                                 display->current == job->level) {
+      continue;
+    }
+
+    op = g_new0(CdUtilDisplayOp, 1);
+    op->job = job;
+    op->display = i;
+    op->profile = g_object_ref(entry->profile);
+    job->outstanding++;
+
+    if (entry->devices & (1UL << i)) {
+      cdutils_display_make_default(op);
+    } else {
+      metrics_inc(METRICS_DBUS_ADD_PROFILE);
+      op->start = metrics_now();
+      cd_device_add_profile(display->device, CD_DEVICE_RELATION_HARD,
+                            op->profile, NULL,
+                            cdutils_display_add_profile_cb, op);
+    }
+  }
+
+  if (--job->outstanding == 0) {
+    cdutils_apply_job_finish(job, job->success, NULL);
+  }
+}
+
+static void cdutils_pool_profile_connect_cb(GObject *source, GAsyncResult *res,
+                                            gpointer user_data) {
+  CdUtilApplyJob *job = user_data;
+  CdUtilConnection *connection = job->connection;
+  CdProfile *profile = CD_PROFILE(source);
+  GError *error = NULL;
+
+  if (!cd_profile_connect_finish(profile, res, &error) ||
+      !cdutils_is_profile_created_by_us(profile)) {
+    g_object_unref(profile);
+    cdutils_apply_job_finish(job, FALSE, error);
+    return;
+  }
+  printf("reuse pool profile %s\n", job->filename);
+
+  /* Another display may have been added to it, adding again is harmless */
+  profile_cache_insert(&connection->cache, job->level, profile,
+                       strdup(job->filepath));
+  cdutils_apply_to_displays(
+      job, profile_cache_peek(&connection->cache, job->level));
+}
+
+static void cdutils_pool_find_profile_cb(GObject *source, GAsyncResult *res,
+                                         gpointer user_data) {
+  CdUtilApplyJob *job = user_data;
+  CdProfile *profile;
+  GError *error = NULL;
+
+  profile = cd_client_find_profile_finish(CD_CLIENT(source), res, &error);
+  if (profile == NULL) {
+    cdutils_apply_job_finish(job, FALSE, error);
+    return;
+  }
+  metrics_inc(METRICS_DBUS_PROFILE_CONNECT);
+  cd_profile_connect(profile, NULL, cdutils_pool_profile_connect_cb, job);
+}
+
+static void cdutils_apply_create_profile_cb(GObject *source, GAsyncResult *res,
+                                            gpointer user_data) {
+  CdUtilApplyJob *job = user_data;
+  CdUtilConnection *connection = job->connection;
+  CdProfile *profile;
+  GError *error = NULL;
+
+  metrics_observe(METRICS_STAGE_CREATE_PROFILE, job->start);
+  profile = cd_client_create_profile_finish(CD_CLIENT(source), res, &error);
+  if (!CD_IS_PROFILE(profile) && job->register_only &&
+      g_error_matches(error, CD_CLIENT_ERROR, CD_CLIENT_ERROR_ALREADY_EXISTS)) {
+    /* Left by a run that did not exit cleanly, same id and same file */
+    g_error_free(error);
+    metrics_inc(METRICS_DBUS_FIND_PROFILE);
+    cd_client_find_profile(connection->client, job->filename, NULL,
+                           cdutils_pool_find_profile_cb, job);
+    return;
+  }
+  if (!CD_IS_PROFILE(profile)) {
+    remove(job->filepath);
+    connection->devices_changed = TRUE;
+    cdutils_apply_job_finish(job, FALSE, error);
+    return;
+  }
+  printf("create new profile success\n");
+
+  /* The cache owns the profile now and evicts the least recently used one,
+  its deletion overlaps with the display updates */
+  profile_cache_insert(&connection->cache, job->level, profile,
+                       strdup(job->filepath));
+  cdutils_apply_to_displays(
+      job, profile_cache_peek(&connection->cache, job->level));
+}
+
+/*
+Save the icc of job->brightness to job->filepath.
+A pack only copies mapped bytes out. The template writer only patches bytes
+and needs one write(), lcms2 and colord build the profile from scratch. The
+template falls back to colord if it cannot be laid out.
+ */
+static gboolean cdutils_save_brightness_profile(CdUtilConnection *connection,
+                                                CdUtilApplyJob *job,
+                                                GError **error) {
+  CdIcc *icc = NULL;
+  GFile *file = NULL;
+  cmsHPROFILE hsRGB;
+  gboolean ret = FALSE;
+  gint64 start = metrics_now();
+
+  /* Packs are built without layers, on sRGB */
+  if (connection->pack.data != NULL &&
+      vcgt_layers_identity(&connection->layers) &&
+      cdutils_base(connection) == NULL) {
+    ret = profile_pack_save(&connection->pack, job->level, job->filepath);
+    metrics_observe(METRICS_STAGE_SAVE, start);
+    if (ret) {
+      return ret;
+    }
+  }
+
+  switch (connection->generator) {
+  case CDUTILS_GENERATOR_TEMPLATE:
+    if (connection->writer.data != NULL ||
+        profile_writer_init(&connection->writer, connection->vcgt_size,
+                            cdutils_base(connection))) {
+      vcgt_set_layers(&connection->writer.vcgt, &connection->layers);
+      profile_writer_set_brightness(&connection->writer, job->brightness);
+      metrics_observe(METRICS_STAGE_GENERATE, start);
+      start = metrics_now();
+      ret = profile_writer_save(&connection->writer, job->filepath);
+      metrics_observe(METRICS_STAGE_SAVE, start);
+      return ret;
+    }
+    break;
+
+  case CDUTILS_GENERATOR_LCMS:
+    hsRGB = cdutils_create_brightness_profile_lcms(
+        job->brightness, &connection->layers, cdutils_base(connection));
+    metrics_observe(METRICS_STAGE_GENERATE, start);
+    start = metrics_now();
+    ret = cmsSaveProfileToFile(hsRGB, job->filepath);
+    metrics_observe(METRICS_STAGE_SAVE, start);
+    cmsCloseProfile(hsRGB);
+    return ret;
+
+  case CDUTILS_GENERATOR_COLORD:
+    break;
+  }
+
+  /* create profile with colord */
+  icc = cdutils_create_brightness_profile_colord(
+      job->brightness, connection->vcgt_size, &connection->layers,
+      cdutils_base(connection), error);
+  metrics_observe(METRICS_STAGE_GENERATE, start);
+  if (icc != NULL) {
+    start = metrics_now();
+    file = g_file_new_for_path(job->filepath);
+    ret = cd_icc_save_file(icc, file, CD_ICC_SAVE_FLAGS_NONE, NULL, error);
+    g_object_unref(file);
+    g_object_unref(icc);
+    metrics_observe(METRICS_STAGE_SAVE, start);
+  }
+  return ret;
+}
+
+/*
+1. Create new icc
+2. Save icc file
+3. Create profile with icc
+4. Add it to the cache, evicting the least recently used one if full
+5. Add profile to every target display and make it default
+ */
+static void cdutils_apply_create(CdUtilApplyJob *job) {
+  GError *error = NULL;
+  gchar *profile_brightness = NULL;
+  g_autoptr(GHashTable) profile_props = NULL;
+
+  printf("========== Creating New profile ==========\n");
+
+  /* Pool levels keep their name, a new level gets a unique one */
+  job->filename = job->register_only
+                      ? g_strdup_printf("brightness-%0.2f-pool",
+                                        job->brightness)
+                      : cdutils_new_profile_filename(job->brightness);
+  job->filepath =
+      g_build_filename(job->connection->profile_dir, job->filename, NULL);
+
+  if (cdutils_save_brightness_profile(job->connection, job, &error)) {
+    printf("save icc success\n");
+  } else {
+    printf("save icc fail\n");
+    cdutils_apply_job_finish(job, FALSE, error);
+    return;
+  }
+
+  /* Create new profile by cd_client_create_profile */
+  profile_brightness = g_strdup_printf("%0.2f", job->brightness);
+  profile_props =
+      g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+  g_hash_table_insert(profile_props, (gpointer)CD_PROFILE_PROPERTY_FILENAME,
+                      g_strdup(job->filepath));
+  g_hash_table_insert(profile_props, (gpointer)props_key_creator,
+                      g_strdup(props_value_creator));
+  g_hash_table_insert(profile_props, (gpointer) "Profile brightness",
+                      profile_brightness);
+  g_hash_table_insert(profile_props, (gpointer) "Profile layers",
+                      cdutils_layers_to_string(&job->connection->layers));
+  if (cdutils_base(job->connection) != NULL) {
+    g_hash_table_insert(profile_props, (gpointer) "Profile base",
+                        g_strdup(job->connection->base.id));
+  }
+
+  metrics_inc(METRICS_DBUS_CREATE_PROFILE);
+  job->start = metrics_now();
+  cd_client_create_profile(job->connection->client, job->filename, job->scope,
+                           profile_props, NULL,
+                           cdutils_apply_create_profile_cb, job);
+}
+
+/*
+Take over a profile of ours found as default, e.g. left by the previous run
+or by -b. Its "Profile brightness" must be a level of the current cache
+step, its "Profile layers" the current ones (neutral if it has none), its
+"Profile base" the MD5 of the current base (sRGB if it has none) and its
+icc file must still be there.
+ */
+static gboolean cdutils_adopt_profile(CdUtilConnection *connection,
+                                      guint index, CdProfile *profile) {
+  const gchar *filename = cd_profile_get_filename(profile);
+  const gchar *value;
+  gchar *end;
+  double brightness;
+  int level;
+  ProfileCacheEntry *entry;
+  g_autofree gchar *layers = NULL;
+
+  if (!cdutils_is_profile_created_by_us(profile) || filename == NULL ||
+      access(filename, R_OK) != 0) {
+    return FALSE;
+  }
+  /* Made before there were layers, those are neutral */
+  value = cd_profile_get_metadata_item(profile, "Profile layers");
+  layers = cdutils_layers_to_string(&connection->layers);
+  if (value != NULL ? g_strcmp0(value, layers) != 0
+                    : !vcgt_layers_identity(&connection->layers)) {
+    return FALSE;
+  }
+  value = cd_profile_get_metadata_item(profile, "Profile base");
+  if (value != NULL ? cdutils_base(connection) == NULL ||
+                          g_strcmp0(value, connection->base.id) != 0
+                    : cdutils_base(connection) != NULL) {
+    return FALSE;
+  }
+  value = cd_profile_get_metadata_item(profile, "Profile brightness");
+  if (value == NULL) {
+    return FALSE;
+  }
+  brightness = strtod(value, &end);
+  level = profile_cache_level(&connection->cache, brightness);
+  if (end == value || brightness < 0 || brightness > 1 ||
+      fabs(profile_cache_brightness(&connection->cache, level) - brightness) >
+          0.001) {
+    return FALSE;
+  }
+
+  /* Another display may have brought the same level along */
+  entry = profile_cache_peek(&connection->cache, level);
+  if (entry != NULL && g_strcmp0(cd_profile_get_object_path(entry->profile),
+                                 cd_profile_get_object_path(profile)) != 0) {
+    return FALSE;
+  }
+  if (entry == NULL) {
+    profile_cache_insert(&connection->cache, level, g_object_ref(profile),
+                         strdup(filename));
+  }
+
+  printf("%s: adopt profile of brightness %s\n",
+         cd_device_get_id(connection->displays[index].device), value);
+  metrics_inc(METRICS_PROFILES_ADOPTED);
+  cdutils_display_set_current(connection, index, level);
+  return TRUE;
+}
+
+/*
+Follow what colord says is default, someone else may have changed it. The
+device properties are kept up to date by colord signals, no D-Bus call.
+Returns the default profile if it is none of our cached ones.
+ */
+static CdProfile *cdutils_display_sync(CdUtilConnection *connection,
+                                       guint index) {
+  CdUtilDisplay *display = &connection->displays[index];
+  CdProfile *profile = cd_device_get_default_profile(display->device);
+  int level = -1;
+
+  for (unsigned int i = 0; profile != NULL && i < connection->cache.len; i++) {
+    if (g_strcmp0(cd_profile_get_object_path(profile),
+                  cd_profile_get_object_path(
+                      connection->cache.entries[i].profile)) == 0) {
+      level = connection->cache.entries[i].level;
+    }
+  }
+  if (level != display->current) {
+    cdutils_display_set_current(connection, index, level);
+  }
+
+  if (level != -1 || profile == NULL ||
+      g_strcmp0(display->checked, cd_profile_get_object_path(profile)) == 0) {
+    g_clear_object(&profile);
+  }
+  return profile;
+}
+
+static void cdutils_apply_checked(CdUtilApplyJob *job);
+
+static void cdutils_default_profile_connect_cb(GObject *source,
+                                               GAsyncResult *res,
+                                               gpointer user_data) {
+  CdUtilDisplayOp *op = user_data;
+  CdUtilApplyJob *job = op->job;
+  CdUtilConnection *connection = job->connection;
+  CdUtilDisplay *display = &connection->displays[op->display];
+  CdProfile *profile = CD_PROFILE(source);
+  GError *error = NULL;
+
+  if (!cd_profile_connect_finish(profile, res, &error)) {
+    printf("error: %s\n", error->message);
+    g_error_free(error);
+  } else if (!cdutils_adopt_profile(connection, op->display, profile)) {
+    /* Someone picked another calibration, dim that one from now on */
+    if (cdutils_base_fits(connection) &&
+        !cdutils_is_profile_created_by_us(profile) &&
+        op->display == cdutils_base_display(connection) &&
+        cd_profile_get_filename(profile) != NULL) {
+      cdutils_connection_set_base(connection, profile);
+    }
+    g_free(display->checked);
+    display->checked = g_strdup(cd_profile_get_object_path(profile));
+
+    /*
+    Ours but of no use, as the previous run would have deleted it. Deleting
+    it now would leave the panel undimmed until the new level is default,
+    retire it so it goes once the display moved on.
+     */
+    if (cdutils_is_profile_created_by_us(profile) &&
+        cd_profile_get_filename(profile) != NULL) {
+      printf("========== Retire previous default profile ==========\n");
+      cdutils_show_profile(profile);
+      profile_cache_insert(&connection->cache, connection->retired,
+                           g_object_ref(profile),
+                           strdup(cd_profile_get_filename(profile)));
+      cdutils_display_set_current(connection, op->display,
+                                  connection->retired--);
+    }
+  }
+
+  g_object_unref(op->profile);
+  g_free(op);
+  if (--job->outstanding == 0) {
+    cdutils_apply_checked(job);
+  }
+}
+
+/*
+Look at the default profile of every display the backlight drives. One we
+do not know yet is connected to once, if it is ours at a usable level it
+is adopted instead of creating a new one, e.g. right after a restart.
+ */
+static void cdutils_apply_connected_cb(gboolean success, gpointer user_data) {
+  CdUtilApplyJob *job = user_data;
+  CdUtilConnection *connection = job->connection;
+
+  if (!success) {
+    cdutils_apply_job_finish(job, FALSE, NULL);
+    return;
+  }
+
+  metrics_inc(METRICS_APPLIES);
+  if (connection->base_changed && connection->base_profile != NULL) {
+    cdutils_connection_set_base(connection, connection->base_profile);
+  }
+
+  job->outstanding = 1; /* held until every connect is started */
+  for (guint i = 0; i < connection->n_displays; i++) {
+    CdUtilDisplay *display = &connection->displays[i];
+    CdUtilDisplayOp *op;
+    CdProfile *profile;
+
+    if (!cdutils_display_follows(connection, display, job->backlight)) {
+      continue;
+    }
+    profile = cdutils_display_sync(connection, i);
+    if (profile == NULL) {
+      continue;
+    }
+
+    op = g_new0(CdUtilDisplayOp, 1);
+    op->job = job;
+    op->display = i;
+    op->profile = profile;
+    job->outstanding++;
+    metrics_inc(METRICS_DBUS_PROFILE_CONNECT);
+    cd_profile_connect(profile, NULL, cdutils_default_profile_connect_cb, op);
+  }
+
+  if (--job->outstanding == 0) {
+    cdutils_apply_checked(job);
+  }
+}
+
+/* Skip displays already there, reuse a cached profile or create one */
+static void cdutils_apply_checked(CdUtilApplyJob *job) {
+  CdUtilConnection *connection = job->connection;
+  ProfileCacheEntry *entry;
+  gboolean needed = FALSE;
+
+  for (guint i = 0; i < connection->n_displays; i++) {
+    CdUtilDisplay *display = &connection->displays[i];
+    if (cdutils_display_follows(connection, display, job->backlight) &&
+        display->current != job->level) {
+      printf("display: %s\n", cd_device_get_id(display->device));
+      needed = TRUE;
+    }
+  }
+
+  if (!needed) {
+    printf("profile of brightness %0.2f is already default\n",
+           job->brightness);
+    cdutils_apply_job_finish(job, TRUE, NULL);
+    return;
+  }
+
+  /* Cached profile is already registered */
+  entry = profile_cache_lookup(&connection->cache, job->level);
+  if (entry != NULL) {
+    printf("reuse cached profile %s\n", entry->filepath);
+    cdutils_apply_to_displays(job, entry);
+    return;
+  }
+
+  /* Entries in use may hold the cache over capacity, never past the cap */
+  if (connection->cache.len >= connection->max_profiles) {
+    printf("%u profiles registered, max-profiles reached\n",
+           connection->cache.len);
+    cdutils_apply_job_finish(job, FALSE, NULL);
+    return;
+  }
+
+  cdutils_apply_create(job);
+}
+
+/*
+Apply brightness of one backlight without blocking, done is called from the
+main loop once every display it drives was updated or the change failed.
+1. Make sure we are connected to colord and its display devices
+2. Reuse the cached profile of this brightness level if there is one
+3. Otherwise create and register a new one
+4. Update all displays driven by the backlight concurrently
+ */
+void cdutils_icc_change_brightness_async(CdUtilConnection *connection,
+                                         int backlight, double brightness,
+                                         CdObjectScope cdObjectScope,
+                                         CdUtilDoneFunc done,
+                                         gpointer user_data) {
+  CdUtilApplyJob *job;
+
+  if (connection == NULL) {
+    done(FALSE, user_data);
+    return;
+  }
+
+  job = g_new0(CdUtilApplyJob, 1);
+  job->connection = connection;
+  job->backlight = backlight;
+  job->level = profile_cache_level(&connection->cache, brightness);
+  job->brightness = profile_cache_brightness(&connection->cache, job->level);
+  job->scope = cdObjectScope;
+  job->done = done;
+  job->user_data = user_data;
+
+  cdutils_connection_ensure_async(connection, cdutils_apply_connected_cb, job);
+}
+
+/* State of filling the pool, a few levels are registered at a time */
+typedef struct {
+  CdUtilConnection *connection;
+  CdObjectScope scope;
+  unsigned int next;        /* first level not started */
+  guint outstanding;        /* levels in flight */
+  guint failed;
+  gint64 start;
+  unsigned long dbus_calls; /* before the fill started */
+  CdUtilDoneFunc done;
+  gpointer user_data;
+} CdUtilPoolJob;
+
+static void cdutils_pool_next(CdUtilPoolJob *job);
+
+static void cdutils_pool_level_done(gboolean success, gpointer user_data) {
+  CdUtilPoolJob *job = user_data;
+
+  job->outstanding--;
+  if (!success) {
+    job->failed++;
+  }
+  cdutils_pool_next(job);
+}
+
+/* A level is complete once its profile is added to every display */
+static gboolean cdutils_pool_has_level(CdUtilConnection *connection,
+                                       int level) {
+  ProfileCacheEntry *entry = profile_cache_peek(&connection->cache, level);
+  unsigned long all = (1UL << connection->n_displays) - 1;
+
+  return entry != NULL && (entry->devices & all) == all;
+}
+
+static void cdutils_pool_next(CdUtilPoolJob *job) {
+  CdUtilConnection *connection = job->connection;
+
+  while (job->outstanding < CDUTILS_POOL_BATCH &&
+         job->next < connection->pool_size) {
+    int level = job->next++;
+    ProfileCacheEntry *entry;
+    CdUtilApplyJob *apply;
+
+    if (cdutils_pool_has_level(connection, level)) {
+      continue;
+    }
+    apply = g_new0(CdUtilApplyJob, 1);
+    apply->connection = connection;
+    apply->backlight = CDUTILS_NO_BACKLIGHT;
+    apply->level = level;
+    apply->brightness = profile_cache_brightness(&connection->cache, level);
+    apply->scope = job->scope;
+    apply->register_only = TRUE;
+    apply->done = cdutils_pool_level_done;
+    apply->user_data = job;
+    job->outstanding++;
+
+    entry = profile_cache_peek(&connection->cache, level);
+    if (entry != NULL) {
+      cdutils_apply_to_displays(apply, entry);
+    } else {
+      cdutils_apply_create(apply);
+    }
+  }
+
+  if (job->outstanding > 0 || job->next < connection->pool_size) {
+    return;
+  }
+
+  printf("pool: %u levels on %u displays in %0.1f ms, %lu D-Bus calls, "
+         "%u failed\n",
+         connection->pool_size, connection->n_displays,
+         (metrics_now() - job->start) / 1000.0,
+         metrics_dbus_calls() - job->dbus_calls, job->failed);
+  job->done(job->failed == 0, job->user_data);
+  g_free(job);
+}
+
+static void cdutils_pool_connected_cb(gboolean success, gpointer user_data) {
+  CdUtilPoolJob *job = user_data;
+
+  if (!success) {
+    job->done(FALSE, job->user_data);
+    g_free(job);
+    return;
+  }
+  cdutils_pool_next(job);
+}
+
+void cdutils_connection_fill_pool_async(CdUtilConnection *connection,
+                                        CdObjectScope cdObjectScope,
+                                        CdUtilDoneFunc done,
+                                        gpointer user_data) {
+  CdUtilPoolJob *job;
+
+  if (connection == NULL || connection->pool_size == 0) {
+    done(connection != NULL, user_data);
+    return;
+  }
+
+  job = g_new0(CdUtilPoolJob, 1);
+  job->connection = connection;
+  job->scope = cdObjectScope;
+  job->start = metrics_now();
+  job->dbus_calls = metrics_dbus_calls();
+  job->done = done;
+  job->user_data = user_data;
+  cdutils_connection_ensure_async(connection, cdutils_pool_connected_cb, job);
+}
+
+/* State of one sweep of orphaned profiles and icc files */
+typedef struct {
+  CdUtilConnection *connection;
+  GPtrArray *profiles; /* every profile colord has */
+  guint next;          /* first one not looked at */
+  guint outstanding;   /* connects and deletes in flight */
+  GHashTable *keep;    /* icc files of live profiles of ours not cached */
+  gboolean incomplete; /* a profile could not be looked at */
+  guint kept, deleted;
+  CdUtilDoneFunc done; /* may be NULL */
+  gpointer user_data;
+} CdUtilSweepJob;
+
+static gboolean cdutils_profile_is_cached(CdUtilConnection *connection,
+                                          const gchar *object_path) {
+  for (unsigned int i = 0; i < connection->cache.len; i++) {
+    CdProfile *profile = connection->cache.entries[i].profile;
+    if (g_strcmp0(object_path, cd_profile_get_object_path(profile)) == 0) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static gboolean cdutils_profile_is_default(CdUtilConnection *connection,
+                                           const gchar *object_path) {
+  gboolean found = FALSE;
+
+  for (guint i = 0; i < connection->n_displays && !found; i++) {
+    g_autoptr(CdProfile) profile =
+        cd_device_get_default_profile(connection->displays[i].device);
+    found = profile != NULL &&
+            g_strcmp0(cd_profile_get_object_path(profile), object_path) == 0;
+  }
+  return found;
+}
+
+/* Remove icc files in profile_dir that no profile of ours points at */
+static guint cdutils_sweep_files(CdUtilSweepJob *job) {
+  CdUtilConnection *connection = job->connection;
+  GDir *dir = g_dir_open(connection->profile_dir, 0, NULL);
+  gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+  const gchar *name;
+  guint removed = 0;
+
+  while (dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+    g_autofree gchar *path = NULL;
+    struct stat st;
+    gboolean owned;
+
+    if (!g_str_has_prefix(name, "brightness-")) {
+      continue;
+    }
+    path = g_build_filename(connection->profile_dir, name, NULL);
+    owned = g_hash_table_contains(job->keep, path);
+    for (unsigned int i = 0; !owned && i < connection->cache.len; i++) {
+      owned = g_strcmp0(connection->cache.entries[i].filepath, path) == 0;
+    }
+    /* A new level may be saved but not registered yet */
+    if (owned || stat(path, &st) != 0 ||
+        st.st_mtime > now - CDUTILS_SWEEP_MIN_AGE) {
+      continue;
+    }
+    if (remove(path) == 0) {
+      removed++;
+    }
+  }
+  if (dir != NULL) {
+    g_dir_close(dir);
+  }
+  return removed;
+}
+
+static void cdutils_sweep_finish(CdUtilSweepJob *job, gboolean success) {
+  CdUtilConnection *connection = job->connection;
+  guint files = 0;
+
+  /* Without knowing every profile of ours a file may still be in use */
+  if (success && !job->incomplete) {
+    files = cdutils_sweep_files(job);
+  }
+  metrics_counters[METRICS_SWEEP_PROFILES] += job->deleted;
+  metrics_counters[METRICS_SWEEP_FILES] += files;
+  if (job->deleted > 0 || files > 0) {
+    printf("sweep: %u profiles kept, %u deleted, %u icc files removed\n",
+           connection->cache.len + job->kept, job->deleted, files);
+  }
+
+  connection->sweeping = FALSE;
+  if (job->done != NULL) {
+    job->done(success, job->user_data);
+  }
+  if (job->profiles != NULL) {
+    g_ptr_array_unref(job->profiles);
+  }
+  g_hash_table_unref(job->keep);
+  g_free(job);
+}
+
+static void cdutils_sweep_next(CdUtilSweepJob *job);
+
+static void cdutils_sweep_deleted_cb(gboolean success, gpointer user_data) {
+  CdUtilSweepJob *job = user_data;
+  (void)success;
+
+  job->outstanding--;
+  cdutils_sweep_next(job);
+}
+
+/* Ours, not cached and not default anywhere: left behind, delete it */
+static void cdutils_sweep_connect_cb(GObject *source, GAsyncResult *res,
+                                     gpointer user_data) {
+  CdUtilSweepJob *job = user_data;
+  CdUtilConnection *connection = job->connection;
+  CdProfile *profile = CD_PROFILE(source);
+  const gchar *object_path = cd_profile_get_object_path(profile);
+  const gchar *filename;
+
+  job->outstanding--;
+  connection->pending--;
+  if (!cd_profile_connect_finish(profile, res, NULL)) {
+    /* Most likely deleted meanwhile, e.g. evicted */
+    job->incomplete = TRUE;
+  } else if (!cdutils_is_profile_created_by_us(profile)) {
+    g_hash_table_add(connection->foreign, g_strdup(object_path));
+  } else if (cdutils_profile_is_cached(connection, object_path) ||
+             cdutils_profile_is_default(connection, object_path) ||
+             connection->stale || connection->n_displays == 0) {
+    /* Displays are refetched after a hotplug, look again next time */
+    filename = cd_profile_get_filename(profile);
+    if (filename != NULL) {
+      g_hash_table_add(job->keep, g_strdup(filename));
+    }
+    job->kept++;
+  } else {
+    filename = cd_profile_get_filename(profile);
+    if (filename != NULL) {
+      remove(filename);
+    }
+    job->deleted++;
+    job->outstanding++;
+    cdutils_delete_profile(connection, profile, cdutils_sweep_deleted_cb, job);
+  }
+
+  cdutils_sweep_next(job);
+}
+
+/* Keep up to CDUTILS_SWEEP_BATCH calls in flight until every one is seen */
+static void cdutils_sweep_next(CdUtilSweepJob *job) {
+  CdUtilConnection *connection = job->connection;
+
+  while (job->outstanding < CDUTILS_SWEEP_BATCH &&
+         job->next < job->profiles->len) {
+    CdProfile *profile = g_ptr_array_index(job->profiles, job->next++);
+    const gchar *object_path = cd_profile_get_object_path(profile);
+
+    if (cdutils_profile_is_cached(connection, object_path) ||
+        g_hash_table_contains(connection->foreign, object_path)) {
+      continue;
+    }
+    job->outstanding++;
+    connection->pending++;
+    metrics_inc(METRICS_DBUS_PROFILE_CONNECT);
+    cd_profile_connect(profile, NULL, cdutils_sweep_connect_cb, job);
+  }
+
+  if (job->outstanding == 0 && job->next == job->profiles->len) {
+    cdutils_sweep_finish(job, TRUE);
+  }
+}
+
+static void cdutils_sweep_get_profiles_cb(GObject *source, GAsyncResult *res,
+                                          gpointer user_data) {
+  CdUtilSweepJob *job = user_data;
+  GError *error = NULL;
+
+  job->connection->pending--;
+  job->profiles = cd_client_get_profiles_finish(CD_CLIENT(source), res, &error);
+  if (job->profiles == NULL) {
+    printf("error: %s\n", error->message);
+    g_error_free(error);
+    cdutils_sweep_finish(job, FALSE);
+    return;
+  }
+  cdutils_sweep_next(job);
+}
+
+/*
+Delete profiles of ours that are neither cached nor default on a display,
+left by a crash, a failed delete or another instance, then remove icc files
+nobody owns. Profiles that are not ours are connected to once per colord
+session. Runs next to brightness changes but only on a connected session,
+done may be NULL.
+ */
+void cdutils_connection_sweep_async(CdUtilConnection *connection,
+                                    CdUtilDoneFunc done, gpointer user_data) {
+  CdUtilSweepJob *job;
+
+  if (connection->sweeping || connection->stale ||
+      connection->client == NULL ||
+      !cd_client_get_connected(connection->client)) {
+    if (done != NULL) {
+      done(FALSE, user_data);
+    }
+    return;
+  }
+
+  job = g_new0(CdUtilSweepJob, 1);
+  job->connection = connection;
+  job->keep = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  job->done = done;
+  job->user_data = user_data;
+  connection->sweeping = TRUE;
+
+  metrics_inc(METRICS_DBUS_GET_PROFILES);
+  connection->pending++;
+  cd_client_get_profiles(connection->client, NULL,
+                         cdutils_sweep_get_profiles_cb, job);
+}
+
+typedef struct {
+  gboolean finished;
+  gboolean success;
+} CdUtilSyncWait;
+
+static void cdutils_sync_done(gboolean success, gpointer user_data) {
+  CdUtilSyncWait *wait = user_data;
+  wait->finished = TRUE;
+  wait->success = success;
+}
+
+/* Iterate the main context until the call and its background calls finish */
+static gboolean cdutils_sync_wait(CdUtilConnection *connection,
+                                  CdUtilSyncWait *wait) {
+  while (!wait->finished ||
+         (connection != NULL && connection->pending > 0)) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+  return wait->success;
+}
+
+gboolean cdutils_connection_ensure(CdUtilConnection *connection) {
+  CdUtilSyncWait wait = {FALSE, FALSE};
+  cdutils_connection_ensure_async(connection, cdutils_sync_done, &wait);
+  return cdutils_sync_wait(connection, &wait);
+}
+
+/* Blocking variant for one-shot use, applies to the primary backlight */
+gboolean cdutils_icc_change_brightness(CdUtilConnection *connection,
+                                       double brightness,
+                                       CdObjectScope cdObjectScope) {
+  CdUtilSyncWait wait = {FALSE, FALSE};
+  cdutils_icc_change_brightness_async(connection, 0, brightness, cdObjectScope,
+                                      cdutils_sync_done, &wait);
+  return cdutils_sync_wait(connection, &wait);
+}
+
+/* Show every display and the backlight chosen for it */
+gboolean cdutils_list_devices(CdUtilConnection *connection) {
+  if (connection == NULL || !cdutils_connection_ensure(connection)) {
+    return FALSE;
+  }
+
+  for (guint i = 0; i < connection->n_displays; i++) {
+    CdUtilDisplay *display = &connection->displays[i];
+    const gchar *output = cd_device_get_metadata_item(
+        display->device, CD_DEVICE_METADATA_XRANDR_NAME);
+
+    cdutils_show_device(display->device);
+    printf("  output: %s\n", output != NULL ? output : "(unknown)");
+    printf("  embedded: %s\n",
+           cd_device_get_embedded(display->device) ? "true" : "false");
+    if (display->backlight != CDUTILS_NO_BACKLIGHT) {
+      printf("  backlight: %s\n",
+             g_array_index(connection->backlights, CdUtilBacklight,
+                           display->backlight)
+                 .name);
+    } else if (connection->follow == CDUTILS_FOLLOW_PRIMARY &&
+               connection->backlights->len > 0) {
+      printf("  backlight: none, follows %s\n",
+             g_array_index(connection->backlights, CdUtilBacklight, 0).name);
+    } else {
+      printf("  backlight: none, left alone\n");
+    }
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,169 @@
+#ifndef ICC_BRIGHTNESS_COLORD_UTILS_H
+#define ICC_BRIGHTNESS_COLORD_UTILS_H
+
+#include "base-profile.h"
+#include "profile-cache.h"
+#include "profile-pack.h"
+#include "profile-writer.h"
+#include "vcgt.h"
+#include <colord.h>
+#include <lcms2.h>
+
+/* Called from the main loop when an async operation completes */
+typedef void (*CdUtilDoneFunc)(gboolean success, gpointer user_data);
+
+#define CDUTILS_PROFILE_DIR "/tmp/icc-brightness"
+#define CDUTILS_MAX_DISPLAYS 32
+#define CDUTILS_NO_BACKLIGHT -1
+#define CDUTILS_MAX_PROFILES 64
+/* D-Bus calls a sweep keeps in flight */
+#define CDUTILS_SWEEP_BATCH 16
+/* Seconds before an icc file nobody owns is removed, it may be in use */
+#define CDUTILS_SWEEP_MIN_AGE 60
+/* Largest pool, a level per "Profile brightness" step of 0.01 */
+#define CDUTILS_POOL_MAX 101
+/* Levels registered at once while filling the pool */
+#define CDUTILS_POOL_BATCH 8
+/* Cache keys below are profiles of layers that were replaced */
+#define CDUTILS_RETIRED_LEVEL -1
+
+/* What displays without a sysfs backlight of their own do */
+typedef enum {
+  CDUTILS_FOLLOW_PRIMARY, /* dim along with the first backlight */
+  CDUTILS_FOLLOW_NONE,    /* leave them alone */
+} CdUtilFollowPolicy;
+
+/* A sysfs backlight interface, the first one added is the primary */
+typedef struct {
+  gchar *name;      /* e.g. intel_backlight */
+  gchar *connector; /* e.g. eDP-1, NULL if sysfs does not tell */
+} CdUtilBacklight;
+
+/* A connected colord display device */
+typedef struct {
+  CdDevice *device;
+  int backlight;  /* index of its backlight or CDUTILS_NO_BACKLIGHT */
+  int current;    /* level of our profile that is default, -1 if unknown */
+  gchar *checked; /* default profile found not adoptable, not checked again */
+} CdUtilDisplay;
+
+/* How the icc file of a new level is produced */
+typedef enum {
+  CDUTILS_GENERATOR_TEMPLATE, /* patch a pre-serialized profile */
+  CDUTILS_GENERATOR_LCMS,     /* lcms2 parametric vcgt */
+  CDUTILS_GENERATOR_COLORD,   /* CdIcc with a sampled vcgt */
+} CdUtilGenerator;
+
+/* Long-lived colord session, reused across brightness changes */
+typedef struct {
+  CdClient *client;
+  GPtrArray *devices;
+  CdUtilDisplay displays[CDUTILS_MAX_DISPLAYS];
+  guint n_displays;
+  GArray *backlights; /* CdUtilBacklight */
+  CdUtilFollowPolicy follow;
+  ProfileCache cache;        /* our registered profiles, by brightness level */
+  CdUtilGenerator generator;
+  unsigned int vcgt_size;    /* entries per channel of generated tables */
+  VcgtLayers layers;         /* composed with brightness into every table */
+  int retired;               /* next cache key of a replaced layer profile */
+  gboolean use_base;         /* build on the display's calibrated profile */
+  BaseProfile base;          /* parsed once, data is NULL while on sRGB */
+  CdProfile *base_profile;   /* colord's profile that base was read from */
+  gboolean base_changed;     /* colord changed base_profile, read it again */
+  ProfileWriter writer;      /* serialized template, data is NULL until used */
+  ProfilePack pack;          /* pre-generated levels, data is NULL without */
+  gchar *profile_dir;        /* where icc files are saved */
+  unsigned int max_profiles; /* of ours registered in colord, hard cap */
+  unsigned int pool_size;    /* levels registered up front, 0 for none */
+  GHashTable *foreign;       /* object paths of profiles that are not ours */
+  gboolean sweeping;         /* a sweep is in flight */
+  gboolean stale;            /* colord went away, reconnect before next use */
+  gboolean restarted;        /* colord restarted, our profiles went with it */
+  gboolean devices_changed;  /* display hotplug, refetch devices */
+  guint pending;             /* background D-Bus calls still in flight */
+} CdUtilConnection;
+
+/* layers may be NULL for neutral ones, base NULL for sRGB */
+cmsHPROFILE cdutils_create_brightness_profile_lcms(double brightness,
+                                                   const VcgtLayers *layers,
+                                                   const BaseProfile *base);
+
+GPtrArray *cdutils_create_vcgt(double brightness, unsigned int size,
+                               const VcgtLayers *layers,
+                               const BaseProfile *base);
+
+CdIcc *cdutils_create_brightness_profile_colord(double brightness,
+                                                unsigned int vcgt_size,
+                                                const VcgtLayers *layers,
+                                                const BaseProfile *base,
+                                                GError **error);
+
+/* e.g. "3400K 1.00,1.00,1.00" */
+gchar *cdutils_layers_to_string(const VcgtLayers *layers);
+
+/* brightness-<brightness>-<uuid> */
+gchar *cdutils_new_profile_filename(double brightness);
+
+CdUtilConnection *cdutils_connection_new(double cache_step,
+                                         unsigned int cache_size);
+
+void cdutils_connection_set_profile_dir(CdUtilConnection *connection,
+                                        const char *profile_dir);
+
+/*
+Publish new levels from the pack at path instead of generating them,
+FALSE if it is missing or stale
+ */
+gboolean cdutils_connection_set_pack(CdUtilConnection *connection,
+                                     const char *path);
+
+/*
+Generate every level of cache_step with vcgt_size entries using the colord
+generator on jobs threads (0 for one per core) and write them as a pack to path
+ */
+gboolean cdutils_build_profile_pack(const char *path, double cache_step,
+                                    unsigned int vcgt_size,
+                                    unsigned int jobs);
+
+/*
+Compose layers with every level from now on, cached levels made with other
+layers are dropped. FALSE if a filled pool is in the way.
+ */
+gboolean cdutils_connection_set_layers(CdUtilConnection *connection,
+                                       const VcgtLayers *layers);
+
+int cdutils_connection_add_backlight(CdUtilConnection *connection,
+                                     const char *name, const char *connector);
+
+void cdutils_connection_detach_profiles(CdUtilConnection *connection);
+
+void cdutils_connection_free(CdUtilConnection *connection);
+
+void cdutils_icc_change_brightness_async(CdUtilConnection *connection,
+                                         int backlight, double brightness,
+                                         CdObjectScope cdObjectScope,
+                                         CdUtilDoneFunc done,
+                                         gpointer user_data);
+
+gboolean cdutils_connection_ensure(CdUtilConnection *connection);
+
+void cdutils_connection_sweep_async(CdUtilConnection *connection,
+                                    CdUtilDoneFunc done, gpointer user_data);
+
+/*
+Register pool_size levels of the cache step with every display, under fixed
+filenames, so a change is a single make default. done at once without a pool.
+ */
+void cdutils_connection_fill_pool_async(CdUtilConnection *connection,
+                                        CdObjectScope cdObjectScope,
+                                        CdUtilDoneFunc done,
+                                        gpointer user_data);
+
+gboolean cdutils_icc_change_brightness(CdUtilConnection *connection,
+                                       double brightness,
+                                       CdObjectScope cdObjectScope);
+
+gboolean cdutils_list_devices(CdUtilConnection *connection);
+
+#endif
@@ -0,0 +1,132 @@
+#include "control.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool control_address(const char *path, struct sockaddr_un *address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+static int control_connect(const struct sockaddr_un *address) {
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr *)address, sizeof(*address)) == -1) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+int control_listen(const char *path, gid_t group) {
+  struct sockaddr_un address;
+  mode_t mask;
+  int fd;
+
+  if (!control_address(path, &address)) {
+    return -1;
+  }
+
+  /* Left by a daemon that was killed, a live one still answers */
+  fd = control_connect(&address);
+  if (fd != -1) {
+    close(fd);
+    errno = EADDRINUSE;
+    return -1;
+  }
+  unlink(path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  /* Nobody else may connect before the group is set */
+  mask = umask(0177);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    int saved = errno;
+    umask(mask);
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  umask(mask);
+  if ((group != (gid_t)-1 &&
+       (chown(path, (uid_t)-1, group) == -1 || chmod(path, 0660) == -1)) ||
+      listen(fd, 16) == -1) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+int control_accept(int listen_fd) {
+  int fd = accept(listen_fd, NULL, NULL);
+
+  if (fd != -1) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+}
+
+bool control_request(const char *path, const ControlRequest *request,
+                     ControlReply *reply) {
+  struct timeval timeout = {CONTROL_TIMEOUT, 0};
+  struct sockaddr_un address;
+  ssize_t len;
+  int fd;
+
+  if (!control_address(path, &address) ||
+      (fd = control_connect(&address)) == -1) {
+    return false;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  len = send(fd, request, sizeof(*request), MSG_NOSIGNAL);
+  if (len == (ssize_t)sizeof(*request)) {
+    len = recv(fd, reply, sizeof(*reply), 0);
+  }
+  if (len != (ssize_t)sizeof(*reply)) {
+    /* A daemon is there but did not answer, do not apply behind its back */
+    if (len >= 0 || errno == ENOENT || errno == ECONNREFUSED) {
+      errno = EPROTO;
+    }
+    close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+const char *control_status_string(uint8_t status) {
+  switch (status) {
+  case CONTROL_OK:
+    return "ok";
+  case CONTROL_FAILED:
+    return "apply failed";
+  case CONTROL_INVALID:
+    return "invalid request";
+  case CONTROL_VERSION_MISMATCH:
+    return "daemon speaks another protocol version";
+  }
+  return "unknown status";
+}
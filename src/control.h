@@ -0,0 +1,74 @@
+#ifndef ICC_BRIGHTNESS_CONTROL_H
+#define ICC_BRIGHTNESS_CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Where the watch daemon takes requests from -b and scripts */
+#define CONTROL_SOCKET "/run/icc-brightness/control.sock"
+/* Bump when a request or reply changes */
+#define CONTROL_VERSION 1
+/* Seconds a client waits for the daemon to apply */
+#define CONTROL_TIMEOUT 10
+
+typedef enum {
+  CONTROL_SET = 1,     /* value is the brightness, replied once applied */
+  CONTROL_NUDGE,       /* value is added to the newest brightness, then SET */
+  CONTROL_GET,         /* brightness last applied */
+  CONTROL_STATS,       /* counters of the daemon */
+  CONTROL_TEMPERATURE, /* value is the white point in kelvin, every level is
+                          made again, replied once the primary one is */
+} ControlOp;
+
+typedef enum {
+  CONTROL_OK,
+  CONTROL_FAILED,  /* applying failed */
+  CONTROL_INVALID, /* unknown op, backlight or value out of range */
+  CONTROL_VERSION_MISMATCH,
+} ControlStatus;
+
+/*
+One request per datagram of a SOCK_SEQPACKET socket, native endian, the
+daemon answers each with one reply
+ */
+typedef struct {
+  uint8_t version;
+  uint8_t op;
+  uint16_t backlight; /* index in --list order, 0 is the primary one */
+  uint32_t reserved;
+  double value;
+} ControlRequest;
+
+typedef struct {
+  uint8_t version;
+  uint8_t status;
+  uint16_t reserved;
+  uint32_t backlights; /* watched by the daemon */
+  double brightness;   /* applied to backlight, -1 before the first apply */
+  uint64_t applies;
+  uint64_t apply_failures;
+  uint64_t coalesced;
+  uint64_t dbus_calls;
+  uint64_t wakeups;
+} ControlReply;
+
+/*
+Listen on path, replacing a socket no daemon answers on. Non-blocking, only
+the owner and group may connect, (gid_t)-1 for the owner alone. -1 on error.
+ */
+int control_listen(const char *path, gid_t group);
+
+/* Next pending client of listen_fd, non-blocking, -1 when there is none */
+int control_accept(int listen_fd);
+
+/*
+Send request to the daemon at path and wait for its reply. false with errno
+ENOENT or ECONNREFUSED when no daemon is running.
+ */
+bool control_request(const char *path, const ControlRequest *request,
+                     ControlReply *reply);
+
+const char *control_status_string(uint8_t status);
+
+#endif
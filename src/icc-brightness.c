@@ -1,15 +1,31 @@
-#include "backlight.c"
-#include "colord-utils.c"
+#include "backlight.h"
+#include "brightness-map.h"
+#include "brightness-slot.h"
+#include "colord-utils.h"
+#include "control.h"
+#include "metrics.h"
+#include "output.h"
+#include "trace.h"
+#include "transition.h"
+#include "vcgt.h"
 #include <bits/getopt_core.h>
 #include <colord.h>
+#include <errno.h>
 #include <getopt.h>
+#include <glib-unix.h>
+#include <grp.h>
 #include <lcms2.h>
+#include <math.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #ifndef VERSION
 #define VERSION "version not defined"
@@ -20,6 +36,25 @@ char *template;
 
 static const double min_brightness_fallback = 0.2;
 static const CdObjectScope CdObjectScope_fallback = CD_OBJECT_SCOPE_NORMAL;
+static const double cache_step_fallback = 0.01;
+static const unsigned int cache_size_fallback = 20;
+static const unsigned int max_profiles_fallback = CDUTILS_MAX_PROFILES;
+static const unsigned int coalesce_ms_fallback = 0;
+static const CdUtilFollowPolicy follow_fallback = CDUTILS_FOLLOW_PRIMARY;
+static const unsigned int vcgt_size_fallback = VCGT_SIZE_DEFAULT;
+static const CdUtilGenerator generator_fallback = CDUTILS_GENERATOR_TEMPLATE;
+static const gboolean base_fallback = TRUE;
+static const unsigned int transition_ms_fallback = 0;
+static const unsigned int transition_fps_fallback = 30;
+static const char *profile_dir_fallback = CDUTILS_PROFILE_DIR;
+static const OutputType output_fallback = OUTPUT_COLORD;
+static const char *metrics_file_fallback = "/run/icc-brightness/metrics.prom";
+static const char *control_socket_fallback = CONTROL_SOCKET;
+static const char *control_group_fallback = "video";
+static const BrightnessCurve curve_fallback = BRIGHTNESS_CURVE_LINEAR;
+static const double gamma_fallback = 2.2;
+static const double dead_band_fallback = BRIGHTNESS_DEAD_BAND;
+static const double replay_speed_fallback = 1;
 struct {
   int version_flag;
   int min_brightness_flag;
@@ -27,48 +62,873 @@ struct {
   int func_watch_flag;
   int func_list_flag;
   int func_apply_brightness_flag;
+  int cache_step_flag;
+  int cache_size_flag;
+  int coalesce_ms_flag;
+  int follow_flag;
+  int backlight_flag;
+  int vcgt_size_flag;
+  int generator_flag;
+  int base_flag;
+  int transition_ms_flag;
+  int transition_fps_flag;
+  int sysfs_root_flag;
+  int profile_dir_flag;
+  int metrics_file_flag;
+  int output_flag;
+  int drm_device_flag;
+  int max_profiles_flag;
+  int curve_flag;
+  int gamma_flag;
+  int dead_band_flag;
+  int pack_flag;
+  int build_pack_flag;
+  int pool_flag;
+  int control_socket_flag;
+  int control_group_flag;
+  int nudge_flag;
+  int func_get_flag;
+  int func_stats_flag;
+  int temperature_flag;
+  int display_gamma_flag;
+  int record_flag;
+  int replay_flag;
+  int replay_speed_flag;
 
   double *brightness;
   double *min_brightness;
   CdObjectScope *cdObjectScope;
+  double *cache_step;
+  unsigned int *cache_size;
+  unsigned int *max_profiles;
+  unsigned int *pool; /* NULL without a pool */
+  const char *control_socket;
+  const char *control_group;
+  double *nudge;
+  unsigned int *coalesce_ms;
+  CdUtilFollowPolicy *follow;
+  char *backlight_order;
+  char *sysfs_root;
+  const char *profile_dir;
+  const char *metrics_file;
+  OutputType *output;
+  char *drm_device;
+  char *pack;       /* publish levels from this pack */
+  char *build_pack; /* write a pack here and exit */
+  unsigned int *vcgt_size;
+  CdUtilGenerator *generator;
+  gboolean *base; /* build on the display's profile rather than sRGB */
+  unsigned int *transition_ms;
+  unsigned int *transition_fps;
+  BrightnessCurve *curve;
+  double *gamma;
+  double *dead_band;
+  double *temperature;   /* NULL for neutral white */
+  double *display_gamma; /* r, g, b, NULL for linear */
+  char *record;          /* trace of every raw change --watch sees */
+  char *replay;          /* feed this trace instead of sysfs */
+  double *replay_speed;  /* 1 is real time, 0 as fast as the loop runs */
 } options;
 
-#define BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define EVENT_MAX (sizeof(struct inotify_event) + NAME_MAX + 1)
+#define BUF_LEN (10 * EVENT_MAX)
+
+/* Every sysfs backlight interface, enumerated once */
+static BacklightRegistry registry;
 
 /*
-get mapped brightness in case the screen is too dark
-make sure you have called has_sysfs_backlight before calling this function
+Setup inotify notifications (IN) mask. All these defined in inotify.h.
+Only a write to actual_brightness matters, anything else would also wake us
+up for our own pread() of it (IN_ACCESS) and for every other reader.
 */
-static double get_mapped_brightness(double brightness) {
-  return *options.min_brightness + (1 - *options.min_brightness) * brightness;
-}
-
-/* Setup inotify notifications (IN) mask. All these defined in inotify.h. */
-static int event_mask =
-    (IN_ACCESS |        /* File accessed */
-     IN_ATTRIB |        /* File attributes changed */
-     IN_OPEN |          /* File was opened */
-     IN_CLOSE_WRITE |   /* Writtable File closed */
-     IN_CLOSE_NOWRITE | /* Unwrittable File closed */
-     IN_CREATE |        /* File created in directory */
-     IN_DELETE |        /* File deleted in directory */
-     IN_DELETE_SELF |   /* Directory deleted */
-     IN_MODIFY |        /* File modified */
-     IN_MOVE_SELF |     /* Directory moved */
-     IN_MOVED_FROM |    /* File moved away from the directory */
-     IN_MOVED_TO);      /* File moved into the directory */
+static int event_mask = IN_MODIFY; /* File modified */
 
-int watch_brightness_change_daemon() {
-  int inotifyFd, wd;
-  char buf[BUF_LEN];
+/* Seconds from activity to rewriting --metrics-file, idle costs nothing */
+#define METRICS_WRITE_DELAY 10
+
+/* What --temperature and --display-gamma compose with brightness */
+static void options_layers(VcgtLayers *layers) {
+  vcgt_layers_init(layers);
+  if (options.temperature != NULL) {
+    layers->temperature = *options.temperature;
+  }
+  for (int c = 0; options.display_gamma != NULL && c < 3; c++) {
+    layers->gamma[c] = options.display_gamma[c];
+  }
+}
+
+/*
+Create a colord connection that knows every sysfs backlight, their index in
+the registry is their index in the connection
+make sure the registry is initialized before calling this function
+*/
+static CdUtilConnection *create_connection(double cache_step,
+                                           unsigned int cache_size) {
+  CdUtilConnection *connection = cdutils_connection_new(cache_step, cache_size);
+
+  connection->follow = *options.follow;
+  connection->generator = *options.generator;
+  connection->use_base = *options.base;
+  connection->vcgt_size = *options.vcgt_size;
+  connection->max_profiles = *options.max_profiles;
+  connection->pool_size = options.pool != NULL ? *options.pool : 0;
+  cdutils_connection_set_profile_dir(connection, options.profile_dir);
+  if (options.pack != NULL &&
+      !cdutils_connection_set_pack(connection, options.pack)) {
+    printf("generating profiles instead\n");
+  }
+  for (unsigned int i = 0; i < registry.count; i++) {
+    Backlight *backlight = &registry.backlights[i];
+    cdutils_connection_add_backlight(
+        connection, backlight->name,
+        backlight->connector[0] != '\0' ? backlight->connector : NULL);
+  }
+  return connection;
+}
+
+/* The --output backend with the layers of the options, NULL if unusable */
+static Output *create_output(unsigned int cache_size, CdObjectScope scope) {
+  Output *output;
+  VcgtLayers layers;
+
+  switch (*options.output) {
+  case OUTPUT_DRM:
+    output = output_drm_new(options.drm_device, &registry, *options.follow);
+    break;
+  case OUTPUT_COLORD:
+  default:
+    output = output_colord_new(
+        create_connection(*options.cache_step, cache_size), scope);
+    break;
+  }
+
+  options_layers(&layers);
+  if (output != NULL) {
+    output_set_layers(output, &layers);
+  }
+  return output;
+}
+
+/* Daemon state, everything runs on the default main context */
+static struct {
+  Output *output;
+  BrightnessSlot *slots; /* newest brightness of each backlight not applied */
+  BrightnessTable *tables; /* raw actual_brightness -> level, per backlight */
+  int *levels;             /* last level handed to the applier, or -1 */
+  unsigned int next;     /* backlight to look at first, round robin */
+  gboolean applying;     /* an async apply is in flight */
+  guint coalesce_source;
+  Transition *transitions; /* of each backlight, NULL without --transition-ms */
+  int timer_fd;            /* paces transition frames */
+  int64_t timer_period;    /* armed period, 0 when disarmed */
+  int64_t frame_start;     /* when the frame in flight was started */
+  gboolean metrics_failed; /* writing --metrics-file failed, reported once */
+  guint metrics_source;    /* pending rewrite of --metrics-file */
+  gboolean swept;          /* leftovers of earlier runs were cleaned up */
+  unsigned int inflight;   /* backlight of the apply in flight */
+  double inflight_brightness;
+  unsigned long inflight_requests; /* control requests the apply covers */
+  double *current;           /* last applied per backlight, -1 before */
+  unsigned long *requests;   /* control requests posted per backlight */
+  int control_fd;            /* -1 without --control-socket */
+  GPtrArray *waiting;        /* ControlClient waiting for an apply */
+  VcgtLayers layers;         /* composed with every brightness */
+  gboolean layers_changed;   /* handed to the output before the next apply */
+  GArray **posted;  /* times of events not applied yet, per backlight */
+  GArray **started; /* of the events the apply in flight covers */
+  GMainLoop *loop;
+  TraceWriter record;   /* --record, file is NULL without */
+  Trace replay;         /* --replay, records is NULL without */
+  size_t replay_next;   /* record to feed next */
+  int64_t replay_start; /* when the first record was fed */
+  GSource *replay_source;
+  unsigned long *replay_levels; /* applies per level of --cache-step */
+} watcher;
+
+/* A connection to --control-socket, one request at a time */
+typedef struct {
+  int fd;
+  guint source;           /* reading requests, 0 while waiting */
+  unsigned int backlight; /* of the request waited for */
+  unsigned long request;  /* its number among watcher.requests */
+} ControlClient;
+
+static void watcher_control_applied(unsigned int backlight,
+                                    unsigned long request, gboolean success);
+
+static void watcher_schedule_apply(void);
+
+static void watcher_replay_begin(void);
+
+static void watcher_replay_check(void);
+
+/* Fire every period, the first frame right away. 0 disarms */
+static void watcher_arm_timer(int64_t period, gboolean now) {
+  struct itimerspec spec = {0};
+
+  if (period > 0) {
+    spec.it_interval.tv_sec = period / 1000000;
+    spec.it_interval.tv_nsec = period % 1000000 * 1000;
+    spec.it_value = spec.it_interval;
+    if (now) {
+      spec.it_value.tv_sec = 0;
+      spec.it_value.tv_nsec = 1;
+    }
+  }
+  timerfd_settime(watcher.timer_fd, 0, &spec, NULL);
+  watcher.timer_period = period;
+}
+
+static void watcher_apply_done(gboolean success, gpointer user_data) {
+  Transition *transition = user_data;
+  GArray *started = watcher.started[watcher.inflight];
+
+  if (!success) {
+    printf("apply brightness fail\n");
+  } else {
+    watcher.current[watcher.inflight] = watcher.inflight_brightness;
+    for (guint i = 0; i < started->len; i++) {
+      metrics_observe(METRICS_STAGE_EVENT_APPLIED,
+                      g_array_index(started, int64_t, i));
+    }
+    if (watcher.replay_levels != NULL) {
+      watcher.replay_levels[lround(watcher.inflight_brightness /
+                                   *options.cache_step)]++;
+    }
+  }
+  g_array_set_size(started, 0);
+  watcher_control_applied(watcher.inflight, watcher.inflight_requests,
+                          success);
+
+  /* Connected now, clean up after earlier runs once */
+  if (success && !watcher.swept) {
+    output_sweep(watcher.output);
+    watcher.swept = TRUE;
+  }
+
+  watcher.applying = FALSE;
+  if (transition != NULL) {
+    /* Fewer steps when colord cannot keep up with the frame rate */
+    transition_record_latency(transition,
+                              g_get_monotonic_time() - watcher.frame_start);
+    if (watcher.timer_period != 0 &&
+        transition_period(transition) != watcher.timer_period) {
+      watcher_arm_timer(transition_period(transition), FALSE);
+    }
+  }
+
+  watcher_schedule_apply();
+  watcher_replay_check();
+}
+
+/* Between applies, so no level in flight ends up with mixed layers */
+static void watcher_apply_layers(void) {
+  if (watcher.layers_changed) {
+    watcher.layers_changed = FALSE;
+    output_set_layers(watcher.output, &watcher.layers);
+  }
+}
+
+/* Apply the next frame of a running fade, one backlight per tick */
+static gboolean watcher_timer_cb(gint fd, GIOCondition condition,
+                                 gpointer user_data) {
+  uint64_t expirations = 0;
+  int64_t now = g_get_monotonic_time();
+  int next = -1;
+  (void)condition;
+  (void)user_data;
+
+  metrics_inc(METRICS_WAKEUPS);
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return G_SOURCE_CONTINUE;
+  }
+
+  for (unsigned int n = 0; n < registry.count; n++) {
+    unsigned int i = (watcher.next + n) % registry.count;
+    Transition *transition = &watcher.transitions[i];
+    if (!transition->active) {
+      continue;
+    }
+    /* Ticks missed while the loop was busy, and this one if colord is */
+    transition_drop(transition,
+                    expirations - 1 + (watcher.applying ? 1 : 0));
+    if (next == -1) {
+      next = i;
+    }
+  }
+
+  if (next == -1) {
+    watcher_arm_timer(0, FALSE);
+    watcher_replay_check();
+    return G_SOURCE_CONTINUE;
+  }
+  if (watcher.applying) {
+    return G_SOURCE_CONTINUE;
+  }
+
+  Transition *transition = &watcher.transitions[next];
+  double brightness = transition_frame(transition, now);
+  if (!transition->active) {
+    printf("%s: transition to %0.2f, %lu frames, %lu dropped, %0.1f fps\n",
+           registry.backlights[next].name, brightness, transition->frames,
+           transition->dropped, transition_fps(transition, now));
+  }
+
+  watcher.next = next + 1;
+  watcher.applying = TRUE;
+  watcher.inflight = next;
+  watcher.inflight_brightness = brightness;
+  watcher.inflight_requests = 0; /* answered when the fade started */
+  watcher.frame_start = now;
+  watcher_apply_layers();
+  output_apply_async(watcher.output, next, brightness, watcher_apply_done,
+                     transition);
+  return G_SOURCE_CONTINUE;
+}
+
+/* The apply about to start covers every event of backlight i so far */
+static void watcher_start_events(unsigned int i) {
+  g_array_append_vals(watcher.started[i], watcher.posted[i]->data,
+                      watcher.posted[i]->len);
+  g_array_set_size(watcher.posted[i], 0);
+}
+
+/* Apply the newest brightness, everything posted before it is dropped */
+static gboolean watcher_start_apply(gpointer user_data) {
+  double brightness;
+  (void)user_data;
+
+  watcher.coalesce_source = 0;
+  for (unsigned int n = 0; n < registry.count; n++) {
+    unsigned int i = (watcher.next + n) % registry.count;
+    if (!brightness_slot_take(&watcher.slots[i], &brightness)) {
+      continue;
+    }
+
+    printf("%s: %0.2f\n", registry.backlights[i].name, brightness);
+    watcher_start_events(i);
+
+    /* Fade from what is on screen, the timer applies the frames */
+    if (watcher.transitions != NULL && watcher.transitions[i].known) {
+      transition_start(&watcher.transitions[i], brightness,
+                       g_get_monotonic_time());
+      watcher_control_applied(i, watcher.requests[i], TRUE);
+      if (watcher.timer_period == 0) {
+        watcher_arm_timer(transition_period(&watcher.transitions[i]), TRUE);
+      }
+      continue;
+    }
+    if (watcher.transitions != NULL) {
+      transition_set(&watcher.transitions[i], brightness);
+    }
+
+    watcher.next = i + 1;
+    watcher.applying = TRUE;
+    watcher.inflight = i;
+    watcher.inflight_brightness = brightness;
+    watcher.inflight_requests = watcher.requests[i];
+    watcher_apply_layers();
+    output_apply_async(watcher.output, i, brightness, watcher_apply_done,
+                       NULL);
+    break;
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Start applying unless busy, events arriving meanwhile coalesce */
+static void watcher_schedule_apply(void) {
+  gboolean pending = FALSE;
+
+  for (unsigned int i = 0; i < registry.count; i++) {
+    pending |= watcher.slots[i].pending;
+  }
+  if (watcher.applying || watcher.coalesce_source != 0 || !pending) {
+    return;
+  }
+
+  if (*options.coalesce_ms > 0) {
+    watcher.coalesce_source =
+        g_timeout_add(*options.coalesce_ms, watcher_start_apply, NULL);
+  } else {
+    watcher_start_apply(NULL);
+  }
+}
+
+/*
+Hand the level of a raw actual_brightness of backlight i to the applier if
+that changed, from sysfs or from --replay
+ */
+static void watcher_post_raw(unsigned int i, int actual_brightness) {
+  Backlight *backlight = &registry.backlights[i];
+  int64_t now = metrics_now();
+  int level;
+
+  if (actual_brightness == backlight->last_raw) {
+    return;
+  }
+  backlight->last_raw = actual_brightness;
+  metrics_inc(METRICS_EVENTS);
+  if (watcher.record.file != NULL) {
+    trace_writer_append(&watcher.record, now, i, actual_brightness);
+  }
+
+  level = brightness_table_lookup(&watcher.tables[i], actual_brightness);
+  if (level == watcher.levels[i]) {
+    metrics_inc(METRICS_DEAD_BAND);
+    return;
+  }
+  watcher.levels[i] = level;
+  g_array_append_val(watcher.posted[i], now);
+  brightness_slot_post(&watcher.slots[i],
+                       brightness_table_brightness(&watcher.tables[i], level));
+}
+
+/* Read a backlight and hand its level to the applier if that changed */
+static void watcher_read_backlight(Backlight *backlight) {
+  int actual_brightness;
+  int64_t start = metrics_now();
+
+  if (!backlight_reader_read(&backlight->reader, &actual_brightness, NULL)) {
+    printf("read %s fail\n", backlight->actual_brightness);
+    exit(1);
+  }
+  metrics_observe(METRICS_STAGE_SYSFS_READ, start);
+  metrics_inc(METRICS_SYSFS_READS);
+  watcher_post_raw(backlight - registry.backlights, actual_brightness);
+}
+
+/* Rewrite the textfile for node_exporter, an empty --metrics-file disables */
+static void watcher_write_metrics(void) {
+  if (options.metrics_file[0] == '\0') {
+    return;
+  }
+  if (metrics_write_prometheus(options.metrics_file)) {
+    watcher.metrics_failed = FALSE;
+  } else if (!watcher.metrics_failed) {
+    printf("write %s fail\n", options.metrics_file);
+    watcher.metrics_failed = TRUE;
+  }
+}
+
+/* --record is written out when the textfile is, once things settle */
+static gboolean watcher_metrics_cb(gpointer user_data) {
+  (void)user_data;
+
+  watcher.metrics_source = 0;
+  watcher_write_metrics();
+  if (watcher.record.file != NULL) {
+    trace_writer_flush(&watcher.record);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/* Once per burst of changes instead of a timer waking up an idle daemon */
+static void watcher_schedule_metrics(void) {
+  if ((options.metrics_file[0] != '\0' || watcher.record.file != NULL) &&
+      watcher.metrics_source == 0) {
+    watcher.metrics_source =
+        g_timeout_add_seconds(METRICS_WRITE_DELAY, watcher_metrics_cb, NULL);
+  }
+}
+
+/*
+Drain the inotify fd, never blocks on colord. Events are only collected
+here, each backlight that changed is read once however many arrived.
+*/
+static gboolean watcher_inotify_cb(gint fd, GIOCondition condition,
+                                   gpointer user_data) {
+  char buf[BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
   ssize_t numRead;
   char *p;
   struct inotify_event *event;
+  int64_t start = metrics_now();
+  (void)condition;
+  (void)user_data;
+
+  metrics_inc(METRICS_WAKEUPS);
+  do {
+    numRead = read(fd, buf, BUF_LEN);
+    if (numRead == 0) {
+      printf("read() from inotify fd returned 0!");
+      exit(4);
+    }
+    if (numRead == -1) {
+      if (errno != EAGAIN) {
+        exit(3);
+      }
+      break;
+    }
+
+    /* Process all of the events in buffer returned by read() */
+    for (p = buf; p < buf + numRead;) {
+      event = (struct inotify_event *)p;
+      metrics_inc(METRICS_INOTIFY_EVENTS);
+      if (event->mask & IN_MODIFY) {
+        Backlight *backlight = backlight_registry_lookup(&registry, event->wd);
+        if (backlight != NULL) {
+          backlight->changed = true;
+        }
+      }
+
+      p += sizeof(struct inotify_event) + event->len;
+    }
+    /* A buffer with room for one more event left means the queue was empty */
+  } while ((size_t)numRead > BUF_LEN - EVENT_MAX);
+
+  for (unsigned int i = 0; i < registry.count; i++) {
+    if (registry.backlights[i].changed) {
+      registry.backlights[i].changed = false;
+      watcher_read_backlight(&registry.backlights[i]);
+    }
+  }
+
+  watcher_schedule_apply();
+  watcher_schedule_metrics();
+  metrics_observe(METRICS_STAGE_WAKEUP, start);
+  return G_SOURCE_CONTINUE;
+}
+
+static void control_client_free(ControlClient *client) {
+  if (client->source != 0) {
+    g_source_remove(client->source);
+  }
+  close(client->fd);
+  g_free(client);
+}
+
+static void watcher_control_send(ControlClient *client, uint8_t status,
+                                 unsigned int backlight) {
+  ControlReply reply = {0};
+
+  reply.version = CONTROL_VERSION;
+  reply.status = status;
+  reply.backlights = registry.count;
+  reply.brightness =
+      backlight < registry.count ? watcher.current[backlight] : -1;
+  reply.applies = metrics_counters[METRICS_APPLIES];
+  reply.apply_failures = metrics_counters[METRICS_APPLY_FAILURES];
+  reply.coalesced = metrics_counters[METRICS_EVENTS_COALESCED];
+  reply.dbus_calls = metrics_dbus_calls();
+  reply.wakeups = metrics_counters[METRICS_WAKEUPS];
+  /* A client that gave up is noticed on the next read */
+  send(client->fd, &reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static gboolean watcher_control_client_cb(gint fd, GIOCondition condition,
+                                          gpointer user_data);
+
+/* Answer every client whose request the apply of backlight covered */
+static void watcher_control_applied(unsigned int backlight,
+                                    unsigned long request, gboolean success) {
+  for (guint i = 0; watcher.waiting != NULL && i < watcher.waiting->len;) {
+    ControlClient *client = g_ptr_array_index(watcher.waiting, i);
+    if (client->backlight != backlight || client->request > request) {
+      i++;
+      continue;
+    }
+    g_ptr_array_remove_index_fast(watcher.waiting, i);
+    watcher_control_send(client, success ? CONTROL_OK : CONTROL_FAILED,
+                         backlight);
+    client->source =
+        g_unix_fd_add(client->fd, G_IO_IN, watcher_control_client_cb, client);
+  }
+}
+
+/*
+Post like a sysfs change, requests of every client arriving before the
+apply starts end up in that one apply
+ */
+static void watcher_control_post(ControlClient *client, unsigned int backlight,
+                                 double brightness) {
+  brightness_slot_post(&watcher.slots[backlight], brightness);
+  /* The next sysfs change is applied even if it lands on the old level */
+  watcher.levels[backlight] = -1;
+  client->backlight = backlight;
+  client->request = ++watcher.requests[backlight];
+  g_ptr_array_add(watcher.waiting, client);
+  watcher_schedule_apply();
+}
+
+/*
+New white point, every backlight gets its brightness again with one profile
+update. The client waits for the primary one unless nothing was applied yet.
+ */
+static gboolean watcher_control_temperature(ControlClient *client,
+                                            double temperature) {
+  watcher.layers.temperature = temperature;
+  watcher.layers_changed = TRUE;
+
+  for (unsigned int i = registry.count; i-- > 0;) {
+    if (watcher.slots[i].pending || watcher.current[i] < 0) {
+      continue;
+    }
+    if (i == 0) {
+      client->source = 0;
+      watcher_control_post(client, 0, watcher.current[0]);
+      return TRUE;
+    }
+    brightness_slot_post(&watcher.slots[i], watcher.current[i]);
+    watcher.levels[i] = -1;
+  }
+  watcher_schedule_apply();
+  return FALSE;
+}
+
+static gboolean watcher_control_client_cb(gint fd, GIOCondition condition,
+                                          gpointer user_data) {
+  ControlClient *client = user_data;
+  ControlRequest request = {0};
+  uint8_t status = CONTROL_INVALID;
+  double brightness = -1;
+  ssize_t len;
+  (void)condition;
+
+  len = recv(fd, &request, sizeof(request), MSG_DONTWAIT);
+  if (len == -1 && errno == EAGAIN) {
+    return G_SOURCE_CONTINUE;
+  }
+  if (len <= 0) {
+    client->source = 0;
+    control_client_free(client);
+    return G_SOURCE_REMOVE;
+  }
+  metrics_inc(METRICS_CONTROL_REQUESTS);
+
+  /* A short datagram leaves the rest of request unread */
+  if (len != sizeof(request)) {
+    watcher_control_send(client, CONTROL_INVALID, 0);
+    return G_SOURCE_CONTINUE;
+  }
+  if (request.version != CONTROL_VERSION) {
+    status = CONTROL_VERSION_MISMATCH;
+  } else if (request.backlight < registry.count) {
+    BrightnessSlot *slot = &watcher.slots[request.backlight];
+    switch (request.op) {
+    case CONTROL_SET:
+      brightness = request.value;
+      break;
+    case CONTROL_NUDGE:
+      /* From what is about to be applied, else from what is on screen */
+      brightness = slot->pending ? slot->brightness
+                                 : watcher.current[request.backlight];
+      if (brightness >= 0) {
+        brightness = CLAMP(brightness + request.value, 0, 1);
+      }
+      break;
+    case CONTROL_GET:
+    case CONTROL_STATS:
+      status = CONTROL_OK;
+      break;
+    case CONTROL_TEMPERATURE:
+      if (request.value < VCGT_TEMPERATURE_MIN ||
+          request.value > VCGT_TEMPERATURE_MAX) {
+        break;
+      }
+      /* Every pool level would have to be made again */
+      status = options.pool != NULL ? CONTROL_FAILED : CONTROL_OK;
+      if (status == CONTROL_OK &&
+          watcher_control_temperature(client, request.value)) {
+        return G_SOURCE_REMOVE;
+      }
+      break;
+    }
+  }
+
+  /* Replied once applied, nothing else is read from it meanwhile */
+  if ((request.op == CONTROL_SET || request.op == CONTROL_NUDGE) &&
+      status == CONTROL_INVALID && brightness >= 0 && brightness <= 1) {
+    client->source = 0;
+    watcher_control_post(client, request.backlight, brightness);
+    return G_SOURCE_REMOVE;
+  }
+
+  watcher_control_send(client, status, request.backlight);
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean watcher_control_accept_cb(gint fd, GIOCondition condition,
+                                          gpointer user_data) {
+  int client_fd;
+  (void)condition;
+  (void)user_data;
+
+  while ((client_fd = control_accept(fd)) != -1) {
+    ControlClient *client = g_new0(ControlClient, 1);
+    client->fd = client_fd;
+    client->source =
+        g_unix_fd_add(client_fd, G_IO_IN, watcher_control_client_cb, client);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+The pool is registered, changes held back meanwhile go out now. A replay
+starts here so the pool is not part of it.
+ */
+static void watcher_prepared_cb(gboolean success, gpointer user_data) {
+  (void)user_data;
+
+  if (!success) {
+    printf("prepare %s output fail\n", watcher.output->backend->name);
+  }
+  watcher.applying = FALSE;
+  watcher_schedule_apply();
+  if (watcher.replay.records != NULL) {
+    watcher_replay_begin();
+  }
+}
+
+/* SIGTERM and SIGINT leave the main loop so the output is freed */
+static gboolean watcher_quit_cb(gpointer user_data) {
+  g_main_loop_quit(user_data);
+  return G_SOURCE_REMOVE;
+}
+
+/* Profiles and icc files a crash or a failed delete left behind */
+static gboolean watcher_sweep_cb(gpointer user_data) {
+  (void)user_data;
+
+  if (!watcher.applying) {
+    output_sweep(watcher.output);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+/* kill -USR1 prints every counter and stage, and refreshes the textfile */
+static gboolean watcher_dump_cb(gpointer user_data) {
+  (void)user_data;
+
+  printf("========== metrics ==========\n");
+  metrics_print(stdout);
+  fflush(stdout);
+  watcher_write_metrics();
+  if (watcher.record.file != NULL) {
+    trace_writer_flush(&watcher.record);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+/* When record n is due, 0 at --replay-speed 0 */
+static int64_t watcher_replay_due(size_t n) {
+  const TraceRecord *records = watcher.replay.records;
+  if (*options.replay_speed == 0) {
+    return 0;
+  }
+  return watcher.replay_start +
+         (int64_t)((records[n].us - records[0].us) / *options.replay_speed);
+}
+
+/*
+Feed every record that is due, like one inotify wakeup draining a backlog.
+As fast as possible it is one record per main loop iteration, between the
+colord replies.
+ */
+static gboolean watcher_replay_cb(gpointer user_data) {
+  int64_t now = metrics_now();
+  (void)user_data;
+
+  if (watcher.replay_next == 0) {
+    watcher.replay_start = now;
+  }
+  do {
+    const TraceRecord *record =
+        &watcher.replay.records[watcher.replay_next++];
+    if (record->backlight < registry.count) {
+      watcher_post_raw(record->backlight, record->raw);
+    }
+  } while (watcher.replay_next < watcher.replay.count &&
+           *options.replay_speed > 0 &&
+           watcher_replay_due(watcher.replay_next) <= now);
+  watcher_schedule_apply();
+
+  if (watcher.replay_next == watcher.replay.count) {
+    watcher.replay_source = NULL;
+    watcher_replay_check();
+    return G_SOURCE_REMOVE;
+  }
+  g_source_set_ready_time(watcher.replay_source,
+                          watcher_replay_due(watcher.replay_next));
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean watcher_replay_dispatch(GSource *source, GSourceFunc callback,
+                                        gpointer user_data) {
+  (void)source;
+  return callback(user_data);
+}
+
+/* Woken up by its ready time only, paced to the timestamps of the trace */
+static GSourceFuncs watcher_replay_funcs = {
+    .dispatch = watcher_replay_dispatch,
+};
+
+static void watcher_replay_begin(void) {
+  watcher.replay_source =
+      g_source_new(&watcher_replay_funcs, sizeof(GSource));
+  g_source_set_callback(watcher.replay_source, watcher_replay_cb, NULL, NULL);
+  g_source_set_priority(watcher.replay_source,
+                        *options.replay_speed > 0 ? G_PRIORITY_DEFAULT
+                                                  : G_PRIORITY_DEFAULT_IDLE);
+  g_source_set_ready_time(watcher.replay_source, 0);
+  g_source_attach(watcher.replay_source, NULL);
+  g_source_unref(watcher.replay_source);
+}
+
+/* What the trace made the daemon do, then every counter and stage */
+static void watcher_replay_report(void) {
+  const Trace *trace = &watcher.replay;
+  double span = (trace->records[trace->count - 1].us - trace->records[0].us) /
+                1e6;
+  double elapsed = (metrics_now() - watcher.replay_start) / 1e6;
+  unsigned int levels = lround(1 / *options.cache_step) + 1;
 
-  static int actual_brightness;
-  static int previous_actual_brightness;
+  printf("========== replay ==========\n");
+  printf("%-28s %zu over %0.3f s\n", "trace records", trace->count, span);
+  printf("%-28s %0.3f s, %0.1fx real time\n", "replayed in", elapsed,
+         elapsed > 0 ? span / elapsed : 0);
+  printf("%-28s %lu of %lu events, %lu coalesced, %lu in dead band\n",
+         "applies", metrics_counters[METRICS_APPLIES],
+         metrics_counters[METRICS_EVENTS],
+         metrics_counters[METRICS_EVENTS_COALESCED],
+         metrics_counters[METRICS_DEAD_BAND]);
+  printf("%-28s %8s\n", "applied level", "applies");
+  for (unsigned int i = 0; i < levels; i++) {
+    if (watcher.replay_levels[i] > 0) {
+      printf("%-28.2f %8lu\n", MIN(i * *options.cache_step, 1),
+             watcher.replay_levels[i]);
+    }
+  }
+  printf("========== metrics ==========\n");
+  metrics_print(stdout);
+  fflush(stdout);
+}
+
+/* Every record was fed and everything it caused is on screen */
+static void watcher_replay_check(void) {
+  static gboolean reported;
 
-  if (!has_sysfs_backlight()) {
+  if (watcher.replay_levels == NULL || reported ||
+      watcher.replay_next < watcher.replay.count || watcher.applying ||
+      watcher.coalesce_source != 0) {
+    return;
+  }
+  for (unsigned int i = 0; i < registry.count; i++) {
+    if (watcher.slots[i].pending ||
+        (watcher.transitions != NULL && watcher.transitions[i].active)) {
+      return;
+    }
+  }
+  reported = TRUE;
+  watcher_replay_report();
+  g_main_loop_quit(watcher.loop);
+}
+
+int watch_brightness_change_daemon() {
+  GMainLoop *loop;
+
+  if (!backlight_registry_init(&registry, options.sysfs_root,
+                               options.backlight_order)) {
     perror("no sysfs backlight");
     return 1;
   }
@@ -76,14 +936,14 @@ int watch_brightness_change_daemon() {
   /* Create temporary dir to store icc files */
   umask(0000);
   errno = 0;
-  int ret = mkdir("/tmp/icc-brightness", ALLPERMS);
+  int ret = mkdir(options.profile_dir, ALLPERMS);
   if (ret == -1) {
     switch (errno) {
     case EACCES:
       printf("mkdir: the parent directory does not allow write\n");
       exit(EXIT_FAILURE);
     case EEXIST:
-      printf("mkdir: /tmp/icc-brightness already exists\n");
+      printf("mkdir: %s already exists\n", options.profile_dir);
       break;
     case ENAMETOOLONG:
       printf("mkdir: pathname is too long\n");
@@ -94,60 +954,192 @@ int watch_brightness_change_daemon() {
     }
   }
 
-  get_actual_brightness(&actual_brightness);
-  get_brightness();
-
-  /* Apply icc brightness profile once at start */
-  previous_actual_brightness = actual_brightness;
-  // cdutils_icc_change_brightness(brightness);
-  cdutils_icc_change_brightness(get_mapped_brightness(get_brightness()),
-                                *options.cdObjectScope);
+  if (options.metrics_file[0] != '\0') {
+    g_autofree gchar *metrics_dir = g_path_get_dirname(options.metrics_file);
+    if (g_mkdir_with_parents(metrics_dir, 0755) == -1) {
+      printf("mkdir: %s: %s\n", metrics_dir, strerror(errno));
+    }
+  }
 
-  printf("start watching brightness change\n");
+  /* One colord session or drm device for the whole life of the daemon */
+  watcher.output = create_output(*options.cache_size, *options.cdObjectScope);
+  if (watcher.output == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  watcher.slots = calloc(registry.count, sizeof(BrightnessSlot));
+  for (unsigned int i = 0; i < registry.count; i++) {
+    brightness_slot_init(&watcher.slots[i]);
+  }
 
-  /* Initializing inotify instance */
-  inotifyFd = inotify_init();
-  if (inotifyFd == -1)
-    exit(1);
+  /* A trace is replayed on backlights of its own size */
+  if (options.replay != NULL) {
+    if (!trace_load(&watcher.replay, options.replay)) {
+      exit(EXIT_FAILURE);
+    }
+    if (watcher.replay.count == 0 ||
+        watcher.replay.backlights > registry.count) {
+      printf("%s: %zu records of %u backlights, %u here\n", options.replay,
+             watcher.replay.count, watcher.replay.backlights, registry.count);
+      exit(EXIT_FAILURE);
+    }
+    watcher.replay_levels =
+        calloc(lround(1 / *options.cache_step) + 1, sizeof(unsigned long));
+  }
 
-  wd = inotify_add_watch(inotifyFd, actual_brightness_value, event_mask);
-  if (wd == -1) {
-    exit(2);
+  /* Every raw value is mapped once here, a change is an array index */
+  BrightnessMapping mapping = {
+      .curve = *options.curve,
+      .gamma = *options.gamma,
+      .min_brightness = *options.min_brightness,
+      .step = *options.cache_step,
+      .dead_band = *options.dead_band,
   };
-
-  while (1) { /* Read events forever */
-
-    numRead = read(inotifyFd, buf, BUF_LEN);
-    if (numRead == 0) {
-      printf("read() from inotify fd returned 0!");
-      exit(4);
+  watcher.tables = calloc(registry.count, sizeof(BrightnessTable));
+  watcher.levels = calloc(registry.count, sizeof(int));
+  watcher.current = calloc(registry.count, sizeof(double));
+  watcher.requests = calloc(registry.count, sizeof(unsigned long));
+  watcher.posted = calloc(registry.count, sizeof(GArray *));
+  watcher.started = calloc(registry.count, sizeof(GArray *));
+  for (unsigned int i = 0; i < registry.count; i++) {
+    int max = i < watcher.replay.backlights ? (int)watcher.replay.max[i]
+                                            : registry.backlights[i].reader.max;
+    if (!brightness_table_init(&watcher.tables[i], max, &mapping)) {
+      printf("%s: no brightness table\n", registry.backlights[i].name);
+      exit(EXIT_FAILURE);
     }
+    watcher.levels[i] = -1;
+    watcher.current[i] = -1;
+    watcher.posted[i] = g_array_new(FALSE, FALSE, sizeof(int64_t));
+    watcher.started[i] = g_array_new(FALSE, FALSE, sizeof(int64_t));
+  }
 
-    if (numRead == -1)
-      exit(3);
+  /* Raw values as read, with the max_brightness they are relative to */
+  if (options.record != NULL) {
+    uint32_t max[TRACE_MAX_BACKLIGHTS];
+    for (unsigned int i = 0; i < registry.count && i < TRACE_MAX_BACKLIGHTS;
+         i++) {
+      max[i] = registry.backlights[i].reader.max;
+    }
+    if (!trace_writer_open(&watcher.record, options.record,
+                           MIN(registry.count, TRACE_MAX_BACKLIGHTS), max,
+                           metrics_now())) {
+      printf("record to %s: %s\n", options.record,
+             errno == EINVAL ? "a trace of other backlights"
+                             : strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
 
-    // printf("Read %ld bytes from inotify fd\n", (long)numRead);
+  /* -b and scripts talk to us instead of racing us */
+  watcher.control_fd = -1;
+  watcher.waiting = g_ptr_array_new();
+  options_layers(&watcher.layers);
+  if (options.control_socket[0] != '\0') {
+    g_autofree gchar *control_dir = g_path_get_dirname(options.control_socket);
+    struct group *group = NULL;
 
-    /* Process all of the events in buffer returned by read() */
+    g_mkdir_with_parents(control_dir, 0755);
+    if (options.control_group[0] != '\0' &&
+        (group = getgrnam(options.control_group)) == NULL) {
+      printf("no group %s, only root may use %s\n", options.control_group,
+             options.control_socket);
+    }
+    watcher.control_fd = control_listen(
+        options.control_socket, group != NULL ? group->gr_gid : (gid_t)-1);
+    if (watcher.control_fd == -1) {
+      printf("listen on %s: %s\n", options.control_socket, strerror(errno));
+    }
+  }
 
-    for (p = buf; p < buf + numRead;) {
-      event = (struct inotify_event *)p;
-      if (event->mask & IN_MODIFY) {
-        actual_brightness = get_actual_brightness();
-        if (actual_brightness != previous_actual_brightness) {
-          printf("\033c");
-          printf("Read %ld bytes from inotify fd\n", (long)numRead);
-          previous_actual_brightness = actual_brightness;
-          printf("brightness: %0.2f\n", get_brightness());
-          cdutils_icc_change_brightness(get_mapped_brightness(get_brightness()),
-                                        *options.cdObjectScope);
-        }
-      }
+  /* Frames are paced by a timerfd on the same loop as inotify */
+  if (*options.transition_ms > 0) {
+    watcher.transitions = calloc(registry.count, sizeof(Transition));
+    for (unsigned int i = 0; i < registry.count; i++) {
+      transition_init(&watcher.transitions[i], *options.transition_ms,
+                      *options.transition_fps);
+    }
+    watcher.timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (watcher.timer_fd == -1) {
+      perror("timerfd_create");
+      exit(2);
+    }
+  }
 
-      p += sizeof(struct inotify_event) + event->len;
+  /* Apply icc brightness profile once at start, after the pool is ready */
+  loop = g_main_loop_new(NULL, FALSE);
+  watcher.loop = loop;
+  watcher.applying = TRUE;
+  for (unsigned int i = 0; i < registry.count; i++) {
+    printf("backlight %u: %s\n", i, registry.backlights[i].name);
+    if (options.replay == NULL) {
+      watcher_read_backlight(&registry.backlights[i]);
     }
   }
+  output_prepare(watcher.output, watcher_prepared_cb, NULL);
+
+  /* One inotify instance for every interface, a replay is all sysfs says */
+  if (options.replay != NULL) {
+    printf("start replaying %s\n", options.replay);
+  } else if (backlight_registry_watch(&registry, event_mask)) {
+    printf("start watching brightness change\n");
+    g_unix_fd_add(registry.inotify_fd, G_IO_IN, watcher_inotify_cb, NULL);
+  } else {
+    perror("inotify");
+    exit(2);
+  }
+  if (watcher.transitions != NULL) {
+    g_unix_fd_add(watcher.timer_fd, G_IO_IN, watcher_timer_cb, NULL);
+  }
+  if (watcher.control_fd != -1) {
+    g_unix_fd_add(watcher.control_fd, G_IO_IN, watcher_control_accept_cb,
+                  NULL);
+  }
+  g_unix_signal_add(SIGUSR1, watcher_dump_cb, NULL);
+  g_unix_signal_add(SIGTERM, watcher_quit_cb, loop);
+  g_unix_signal_add(SIGINT, watcher_quit_cb, loop);
+  watcher_schedule_metrics();
+  metrics_start();
+  g_timeout_add_seconds(OUTPUT_SWEEP_INTERVAL, watcher_sweep_cb, NULL);
+  g_main_loop_run(loop); /* Read events until a signal */
 
+  /* A pool is removed, otherwise what is on screen stays like before */
+  printf("stop watching brightness change\n");
+  if (options.pool == NULL) {
+    output_detach(watcher.output);
+  }
+  if (watcher.control_fd != -1) {
+    close(watcher.control_fd);
+    unlink(options.control_socket);
+  }
+  for (guint i = 0; i < watcher.waiting->len; i++) {
+    control_client_free(g_ptr_array_index(watcher.waiting, i));
+  }
+  g_ptr_array_unref(watcher.waiting);
+  if (watcher.record.file != NULL &&
+      !trace_writer_close(&watcher.record)) {
+    printf("write %s fail\n", options.record);
+  }
+  g_main_loop_unref(loop);
+  output_free(watcher.output);
+  free(watcher.slots);
+  for (unsigned int i = 0; i < registry.count; i++) {
+    brightness_table_destroy(&watcher.tables[i]);
+  }
+  free(watcher.tables);
+  free(watcher.levels);
+  free(watcher.current);
+  free(watcher.requests);
+  for (unsigned int i = 0; i < registry.count; i++) {
+    g_array_unref(watcher.posted[i]);
+    g_array_unref(watcher.started[i]);
+  }
+  free(watcher.posted);
+  free(watcher.started);
+  free(watcher.replay_levels);
+  trace_free(&watcher.replay);
+  free(watcher.transitions);
+  backlight_registry_destroy(&registry);
   exit(EXIT_SUCCESS);
 }
 
@@ -161,6 +1153,47 @@ Home: https://github.com/zongou/icc-brightness\n\
           VERSION);
 }
 
+/*
+Hand a request to a running --watch daemon and print its reply. FALSE if
+none is running or we may not use its socket, exits if it refused the request.
+ */
+static gboolean send_control_request(ControlOp op, double value) {
+  ControlRequest request = {CONTROL_VERSION, op, 0, 0, value};
+  ControlReply reply;
+
+  if (options.control_socket[0] == '\0') {
+    return FALSE;
+  }
+  if (!control_request(options.control_socket, &request, &reply)) {
+    if (errno == ENOENT || errno == ECONNREFUSED) {
+      return FALSE;
+    }
+    /* Not in --control-group, e.g. backlight access granted by logind */
+    if (errno == EACCES || errno == EPERM) {
+      printf("%s: not in --control-group, going without the daemon\n",
+             options.control_socket);
+      return FALSE;
+    }
+    printf("%s: %s\n", options.control_socket, strerror(errno));
+    exit(1);
+  }
+  if (reply.status != CONTROL_OK) {
+    printf("daemon: %s\n", control_status_string(reply.status));
+    exit(1);
+  }
+
+  if (op == CONTROL_STATS) {
+    printf("backlights:     %u\n", reply.backlights);
+    printf("applies:        %lu\n", (unsigned long)reply.applies);
+    printf("apply failures: %lu\n", (unsigned long)reply.apply_failures);
+    printf("coalesced:      %lu\n", (unsigned long)reply.coalesced);
+    printf("dbus calls:     %lu\n", (unsigned long)reply.dbus_calls);
+    printf("wakeups:        %lu\n", (unsigned long)reply.wakeups);
+  }
+  printf("brightness: %0.2f\n", reply.brightness);
+  return TRUE;
+}
+
 void show_help() {
   fprintf(stderr, "\
 Change OLED brightness by applying ICC profiles.\n\
@@ -170,11 +1203,68 @@ Usage:\n\
 
   fprintf(stderr, "\
 Options:\n\
-  -l, --list                 \tlist display devices.\n\
+  -l, --list                 \tlist display devices and their backlight.\n\
   -w, --watch                \twatch brightness change and apply icc profile.\n\
-  -b, --brightness [val]     \tapply brightness profile.\n\
+  -b, --brightness [val]     \tapply brightness profile, through the --watch\n\
+                             \tdaemon if one is running.\n\
+  --nudge [val]              \tadd val (-1 to 1) to the brightness of the daemon.\n\
+  --get                      \tshow the brightness the daemon applied.\n\
+  --stats                    \tshow counters of the daemon.\n\
+  --control-socket [path]    \twhere the daemon takes requests, empty to disable.\n\
+                             \t(default: /run/icc-brightness/control.sock).\n\
+  --control-group [name]     \tgroup that may use the control socket, empty for\n\
+                             \troot only, -b of others applies on its own.\n\
+                             \t(default: video).\n\
   --min-brightness [val]     \tset the min-brightness. (default: 0.2).\n\
   --tmp                      \tapply temporary icc profile, revert after quit.\n\
+  --cache-step [val]         \tquantize brightness to this step. (default: 0.01).\n\
+  --cache-size [val]         \tprofiles kept registered for reuse. (default: 20).\n\
+  --max-profiles [val]       \tnever more of our profiles in colord, older ones\n\
+                             \tleft behind are deleted. (default: 64).\n\
+  --pool [2-101]             \tregister this many evenly spaced levels at start\n\
+                             \tand only make one default per change, removed on\n\
+                             \texit. Sets --cache-step and --cache-size.\n\
+  --coalesce-ms [val]        \twait for newer brightness before applying. (default: 0).\n\
+  --follow [primary|none]    \tdisplays without backlight follow the primary one\n\
+                             \tor are left alone. (default: primary).\n\
+  --backlight [name,...]     \tpreferred backlight interfaces, first is primary.\n\
+  --generator [template|lcms|colord]\n\
+                             \thow profiles are generated. (default: template).\n\
+  --base [device|srgb]       \tbuild levels on the calibrated profile the primary\n\
+                             \tdisplay had, or on sRGB. (default: device, srgb\n\
+                             \twith --pack).\n\
+  --vcgt-size [256|1024|4096]\tvcgt entries of generated profiles. (default: 256).\n\
+  --sysfs-root [dir]         \tread backlights under dir/class/backlight. (default: /sys).\n\
+  --profile-dir [dir]        \tsave icc files in dir. (default: /tmp/icc-brightness).\n\
+  --transition-ms [val]      \tfade to a new brightness over this time. (default: 0).\n\
+  --transition-fps [val]     \tframes per second of a fade, lowered when applying\n\
+                             \ta frame takes longer. (default: 30).\n\
+  --output [colord|drm]      \tapply through colord or straight to the gamma lut\n\
+                             \tof the crtc. (default: colord).\n\
+  --drm-device [path]        \tdrm device of --output drm.\n\
+                             \t(default: first /dev/dri/card* with a gamma lut).\n\
+  --curve [linear|gamma|lstar]\thow the backlight maps to brightness, lstar\n\
+                             \tgives even perceived steps. (default: linear).\n\
+  --gamma [val]              \texponent of --curve gamma. (default: 2.2).\n\
+  --dead-band [val]          \tsmaller changes in CIE L* are not applied.\n\
+                             \t(default: 1.0).\n\
+  --temperature [val]        \twhite point in kelvin, lower is warmer, sent to\n\
+                             \tthe daemon without -w or -b. (default: 6500).\n\
+  --display-gamma [val|r,g,b]\tgamma composed with brightness, one for every\n\
+                             \tchannel or one each. (default: 1).\n\
+  --build-pack [path]        \tgenerate every level of --cache-step and\n\
+                             \t--vcgt-size on all cores into one pack file and exit.\n\
+  --pack [path]              \tpublish new levels from a pack built with\n\
+                             \t--build-pack instead of generating them.\n\
+  --record [path]            \tappend every raw brightness change --watch sees\n\
+                             \tto a trace file.\n\
+  --replay [path]            \tfeed a trace to the watch daemon instead of sysfs,\n\
+                             \tthen report what it applied and exit.\n\
+  --replay-speed [val]       \t1 is real time, 2 twice as fast, 0 as fast as\n\
+                             \tthe daemon keeps up. (default: 1).\n\
+  --metrics-file [path]      \twrite metrics in prometheus text format 10s after\n\
+                             \ta change, empty to disable.\n\
+                             \t(default: /run/icc-brightness/metrics.prom).\n\
 \n\
   -h, --help                 \tshow this help.\n\
   -v, --version              \tshow version.\n\
@@ -220,6 +1310,41 @@ int main(int argc, char **argv) {
         {"brightness", required_argument, 0, 'b'},
         {"min-brightness", required_argument, &options.min_brightness_flag, 1},
         {"tmp", no_argument, &options.cd_obj_scope_temp_flag, 1},
+        {"cache-step", required_argument, &options.cache_step_flag, 1},
+        {"cache-size", required_argument, &options.cache_size_flag, 1},
+        {"max-profiles", required_argument, &options.max_profiles_flag, 1},
+        {"coalesce-ms", required_argument, &options.coalesce_ms_flag, 1},
+        {"follow", required_argument, &options.follow_flag, 1},
+        {"backlight", required_argument, &options.backlight_flag, 1},
+        {"vcgt-size", required_argument, &options.vcgt_size_flag, 1},
+        {"generator", required_argument, &options.generator_flag, 1},
+        {"base", required_argument, &options.base_flag, 1},
+        {"sysfs-root", required_argument, &options.sysfs_root_flag, 1},
+        {"profile-dir", required_argument, &options.profile_dir_flag, 1},
+        {"transition-ms", required_argument, &options.transition_ms_flag, 1},
+        {"transition-fps", required_argument, &options.transition_fps_flag,
+         1},
+        {"metrics-file", required_argument, &options.metrics_file_flag, 1},
+        {"output", required_argument, &options.output_flag, 1},
+        {"drm-device", required_argument, &options.drm_device_flag, 1},
+        {"curve", required_argument, &options.curve_flag, 1},
+        {"gamma", required_argument, &options.gamma_flag, 1},
+        {"dead-band", required_argument, &options.dead_band_flag, 1},
+        {"pack", required_argument, &options.pack_flag, 1},
+        {"build-pack", required_argument, &options.build_pack_flag, 1},
+        {"pool", required_argument, &options.pool_flag, 1},
+        {"control-socket", required_argument, &options.control_socket_flag,
+         1},
+        {"control-group", required_argument, &options.control_group_flag, 1},
+        {"nudge", required_argument, &options.nudge_flag, 1},
+        {"get", no_argument, &options.func_get_flag, 1},
+        {"stats", no_argument, &options.func_stats_flag, 1},
+        {"temperature", required_argument, &options.temperature_flag, 1},
+        {"display-gamma", required_argument, &options.display_gamma_flag,
+         1},
+        {"record", required_argument, &options.record_flag, 1},
+        {"replay", required_argument, &options.replay_flag, 1},
+        {"replay-speed", required_argument, &options.replay_speed_flag, 1},
         {0, 0, 0, 0}};
     /* getopt_long stores the option index here. */
     int option_index = 0;
@@ -274,6 +1399,266 @@ int main(int argc, char **argv) {
         options.cd_obj_scope_temp_flag = 0;
       }
 
+      if (options.cache_step_flag) {
+        options.cache_step = malloc(sizeof(double));
+        *options.cache_step = strtod(optarg, NULL);
+        if (*options.cache_step <= 0 || *options.cache_step > 1) {
+          printf("cache-step available range (0-1]\n");
+          exit(1);
+        }
+        options.cache_step_flag = 0;
+      }
+
+      if (options.cache_size_flag) {
+        options.cache_size = malloc(sizeof(unsigned int));
+        *options.cache_size = strtoul(optarg, NULL, 10);
+        if (*options.cache_size < 1) {
+          printf("cache-size must be at least 1\n");
+          exit(1);
+        }
+        options.cache_size_flag = 0;
+      }
+
+      if (options.control_socket_flag) {
+        options.control_socket = optarg;
+        options.control_socket_flag = 0;
+      }
+
+      if (options.control_group_flag) {
+        options.control_group = optarg;
+        options.control_group_flag = 0;
+      }
+
+      if (options.nudge_flag) {
+        options.nudge = malloc(sizeof(double));
+        *options.nudge = strtod(optarg, NULL);
+        if (*options.nudge < -1 || *options.nudge > 1) {
+          printf("nudge available range [-1-1]\n");
+          exit(1);
+        }
+        options.nudge_flag = 0;
+      }
+
+      if (options.pool_flag) {
+        options.pool = malloc(sizeof(unsigned int));
+        *options.pool = strtoul(optarg, NULL, 10);
+        if (*options.pool < 2 || *options.pool > CDUTILS_POOL_MAX) {
+          printf("pool available range [2-%d]\n", CDUTILS_POOL_MAX);
+          exit(1);
+        }
+        options.pool_flag = 0;
+      }
+
+      if (options.max_profiles_flag) {
+        options.max_profiles = malloc(sizeof(unsigned int));
+        *options.max_profiles = strtoul(optarg, NULL, 10);
+        if (*options.max_profiles < 2) {
+          printf("max-profiles must be at least 2\n");
+          exit(1);
+        }
+        options.max_profiles_flag = 0;
+      }
+
+      if (options.coalesce_ms_flag) {
+        options.coalesce_ms = malloc(sizeof(unsigned int));
+        *options.coalesce_ms = strtoul(optarg, NULL, 10);
+        options.coalesce_ms_flag = 0;
+      }
+
+      if (options.follow_flag) {
+        options.follow = malloc(sizeof(CdUtilFollowPolicy));
+        if (strcmp(optarg, "primary") == 0) {
+          *options.follow = CDUTILS_FOLLOW_PRIMARY;
+        } else if (strcmp(optarg, "none") == 0) {
+          *options.follow = CDUTILS_FOLLOW_NONE;
+        } else {
+          printf("follow available values: primary, none\n");
+          exit(1);
+        }
+        options.follow_flag = 0;
+      }
+
+      if (options.backlight_flag) {
+        options.backlight_order = optarg;
+        options.backlight_flag = 0;
+      }
+
+      if (options.sysfs_root_flag) {
+        options.sysfs_root = optarg;
+        options.sysfs_root_flag = 0;
+      }
+
+      if (options.profile_dir_flag) {
+        options.profile_dir = optarg;
+        options.profile_dir_flag = 0;
+      }
+
+      if (options.metrics_file_flag) {
+        options.metrics_file = optarg;
+        options.metrics_file_flag = 0;
+      }
+
+      if (options.output_flag) {
+        options.output = malloc(sizeof(OutputType));
+        if (strcmp(optarg, "colord") == 0) {
+          *options.output = OUTPUT_COLORD;
+        } else if (strcmp(optarg, "drm") == 0) {
+          *options.output = OUTPUT_DRM;
+        } else {
+          printf("output available values: colord, drm\n");
+          exit(1);
+        }
+        options.output_flag = 0;
+      }
+
+      if (options.drm_device_flag) {
+        options.drm_device = optarg;
+        options.drm_device_flag = 0;
+      }
+
+      if (options.pack_flag) {
+        options.pack = optarg;
+        options.pack_flag = 0;
+      }
+
+      if (options.build_pack_flag) {
+        options.build_pack = optarg;
+        options.build_pack_flag = 0;
+      }
+
+      if (options.vcgt_size_flag) {
+        options.vcgt_size = malloc(sizeof(unsigned int));
+        *options.vcgt_size = strtoul(optarg, NULL, 10);
+        if (!vcgt_size_valid(*options.vcgt_size)) {
+          printf("vcgt-size available values: 256, 1024, 4096\n");
+          exit(1);
+        }
+        options.vcgt_size_flag = 0;
+      }
+
+      if (options.generator_flag) {
+        options.generator = malloc(sizeof(CdUtilGenerator));
+        if (strcmp(optarg, "template") == 0) {
+          *options.generator = CDUTILS_GENERATOR_TEMPLATE;
+        } else if (strcmp(optarg, "lcms") == 0) {
+          *options.generator = CDUTILS_GENERATOR_LCMS;
+        } else if (strcmp(optarg, "colord") == 0) {
+          *options.generator = CDUTILS_GENERATOR_COLORD;
+        } else {
+          printf("generator available values: template, lcms, colord\n");
+          exit(1);
+        }
+        options.generator_flag = 0;
+      }
+
+      if (options.base_flag) {
+        options.base = malloc(sizeof(gboolean));
+        if (strcmp(optarg, "device") == 0) {
+          *options.base = TRUE;
+        } else if (strcmp(optarg, "srgb") == 0) {
+          *options.base = FALSE;
+        } else {
+          printf("base available values: device, srgb\n");
+          exit(1);
+        }
+        options.base_flag = 0;
+      }
+
+      if (options.curve_flag) {
+        options.curve = malloc(sizeof(BrightnessCurve));
+        if (!brightness_curve_parse(optarg, options.curve)) {
+          printf("curve available values: linear, gamma, lstar\n");
+          exit(1);
+        }
+        options.curve_flag = 0;
+      }
+
+      if (options.gamma_flag) {
+        options.gamma = malloc(sizeof(double));
+        *options.gamma = strtod(optarg, NULL);
+        if (*options.gamma <= 0) {
+          printf("gamma must be above 0\n");
+          exit(1);
+        }
+        options.gamma_flag = 0;
+      }
+
+      if (options.temperature_flag) {
+        options.temperature = malloc(sizeof(double));
+        *options.temperature = strtod(optarg, NULL);
+        if (*options.temperature < VCGT_TEMPERATURE_MIN ||
+            *options.temperature > VCGT_TEMPERATURE_MAX) {
+          printf("temperature available range [%d-%d]\n",
+                 VCGT_TEMPERATURE_MIN, VCGT_TEMPERATURE_MAX);
+          exit(1);
+        }
+        options.temperature_flag = 0;
+      }
+
+      if (options.record_flag) {
+        options.record = optarg;
+        options.record_flag = 0;
+      }
+
+      if (options.replay_flag) {
+        options.replay = optarg;
+        options.replay_flag = 0;
+      }
+
+      if (options.replay_speed_flag) {
+        options.replay_speed = malloc(sizeof(double));
+        *options.replay_speed = strtod(optarg, NULL);
+        if (*options.replay_speed < 0) {
+          printf("replay-speed must be 0 (as fast as possible) or above\n");
+          exit(1);
+        }
+        options.replay_speed_flag = 0;
+      }
+
+      if (options.display_gamma_flag) {
+        options.display_gamma = malloc(3 * sizeof(double));
+        int n = sscanf(optarg, "%lf,%lf,%lf", &options.display_gamma[0],
+                       &options.display_gamma[1], &options.display_gamma[2]);
+        if (n == 1) {
+          options.display_gamma[1] = options.display_gamma[0];
+          options.display_gamma[2] = options.display_gamma[0];
+        }
+        for (int i = 0; i < 3; i++) {
+          if ((n != 1 && n != 3) || options.display_gamma[i] < 0.1 ||
+              options.display_gamma[i] > 10) {
+            printf("display-gamma is one value or r,g,b, each [0.1-10]\n");
+            exit(1);
+          }
+        }
+        options.display_gamma_flag = 0;
+      }
+
+      if (options.dead_band_flag) {
+        options.dead_band = malloc(sizeof(double));
+        *options.dead_band = strtod(optarg, NULL);
+        if (*options.dead_band < 0 || *options.dead_band > 100) {
+          printf("dead-band available range [0-100]\n");
+          exit(1);
+        }
+        options.dead_band_flag = 0;
+      }
+
+      if (options.transition_ms_flag) {
+        options.transition_ms = malloc(sizeof(unsigned int));
+        *options.transition_ms = strtoul(optarg, NULL, 10);
+        options.transition_ms_flag = 0;
+      }
+
+      if (options.transition_fps_flag) {
+        options.transition_fps = malloc(sizeof(unsigned int));
+        *options.transition_fps = strtoul(optarg, NULL, 10);
+        if (*options.transition_fps < 1 || *options.transition_fps > 1000) {
+          printf("transition-fps available range [1-1000]\n");
+          exit(1);
+        }
+        options.transition_fps_flag = 0;
+      }
+
       break;
 
     case 'h':
@@ -328,6 +1713,121 @@ int main(int argc, char **argv) {
     *options.cdObjectScope = CdObjectScope_fallback;
   }
 
+  if (options.cache_step == NULL) {
+    options.cache_step = malloc(sizeof(double));
+    *options.cache_step = cache_step_fallback;
+  }
+
+  if (options.cache_size == NULL) {
+    options.cache_size = malloc(sizeof(unsigned int));
+    *options.cache_size = cache_size_fallback;
+  }
+
+  /* The pool is the whole cache, evenly spaced levels from 0 to 1 */
+  if (options.pool != NULL) {
+    *options.cache_step = 1.0 / (*options.pool - 1);
+    *options.cache_size = *options.pool;
+    if (options.max_profiles == NULL) {
+      options.max_profiles = malloc(sizeof(unsigned int));
+      *options.max_profiles = MAX(max_profiles_fallback, *options.pool + 1);
+    }
+  }
+
+  if (options.max_profiles == NULL) {
+    options.max_profiles = malloc(sizeof(unsigned int));
+    *options.max_profiles = max_profiles_fallback;
+  }
+
+  /* Room for a new profile before the least recently used one goes */
+  if (*options.cache_size >= *options.max_profiles) {
+    printf("cache-size must be below max-profiles (%u)\n",
+           *options.max_profiles);
+    exit(1);
+  }
+
+  if (options.follow == NULL) {
+    options.follow = malloc(sizeof(CdUtilFollowPolicy));
+    *options.follow = follow_fallback;
+  }
+
+  if (options.vcgt_size == NULL) {
+    options.vcgt_size = malloc(sizeof(unsigned int));
+    *options.vcgt_size = vcgt_size_fallback;
+  }
+
+  if (options.generator == NULL) {
+    options.generator = malloc(sizeof(CdUtilGenerator));
+    *options.generator = generator_fallback;
+  }
+
+  /* Packs are built on sRGB, a base would skip them on every level */
+  if (options.base == NULL) {
+    options.base = malloc(sizeof(gboolean));
+    *options.base = options.pack != NULL ? FALSE : base_fallback;
+  }
+  if (options.pack != NULL && *options.base) {
+    printf("pack is built on sRGB, use it with --base srgb\n");
+    exit(1);
+  }
+
+  if (options.profile_dir == NULL) {
+    options.profile_dir = profile_dir_fallback;
+  }
+
+  if (options.output == NULL) {
+    options.output = malloc(sizeof(OutputType));
+    *options.output = output_fallback;
+  }
+
+  /* A replay leaves the socket and textfile of a running daemon alone */
+  if (options.metrics_file == NULL) {
+    options.metrics_file = options.replay != NULL ? "" : metrics_file_fallback;
+  }
+
+  if (options.control_group == NULL) {
+    options.control_group = control_group_fallback;
+  }
+
+  if (options.control_socket == NULL) {
+    options.control_socket =
+        options.replay != NULL ? "" : control_socket_fallback;
+  }
+
+  if (options.replay_speed == NULL) {
+    options.replay_speed = malloc(sizeof(double));
+    *options.replay_speed = replay_speed_fallback;
+  }
+
+  if (options.curve == NULL) {
+    options.curve = malloc(sizeof(BrightnessCurve));
+    *options.curve = curve_fallback;
+  }
+
+  if (options.gamma == NULL) {
+    options.gamma = malloc(sizeof(double));
+    *options.gamma = gamma_fallback;
+  }
+
+  if (options.dead_band == NULL) {
+    options.dead_band = malloc(sizeof(double));
+    *options.dead_band = dead_band_fallback;
+  }
+
+  if (options.transition_ms == NULL) {
+    options.transition_ms = malloc(sizeof(unsigned int));
+    *options.transition_ms = transition_ms_fallback;
+  }
+
+  if (options.transition_fps == NULL) {
+    options.transition_fps = malloc(sizeof(unsigned int));
+    *options.transition_fps = transition_fps_fallback;
+  }
+
+  if (options.coalesce_ms == NULL) {
+    options.coalesce_ms = malloc(sizeof(unsigned int));
+    *options.coalesce_ms = coalesce_ms_fallback;
+  }
+
   if (options.min_brightness == NULL) {
     options.min_brightness = malloc(sizeof(void *));
     *options.min_brightness = min_brightness_fallback;
@@ -341,13 +1841,62 @@ int main(int argc, char **argv) {
   if (options.version_flag) {
     show_version();
   } else if (options.func_list_flag) {
-    cdutils_list_devices(NULL);
+    backlight_registry_init(&registry, options.sysfs_root,
+                            options.backlight_order);
+    for (unsigned int i = 0; i < registry.count; i++) {
+      printf("backlight %u: %s%s (connector: %s)\n", i,
+             registry.backlights[i].name, i == 0 ? ", primary" : "",
+             registry.backlights[i].connector[0] != '\0'
+                 ? registry.backlights[i].connector
+                 : "unknown");
+    }
+    Output *output = create_output(1, *options.cdObjectScope);
+    if (output != NULL) {
+      output_list(output);
+      output_detach(output);
+      output_free(output);
+    }
+    backlight_registry_destroy(&registry);
   } else if (options.func_apply_brightness_flag) {
-    if (has_sysfs_backlight()) {
-      cdutils_icc_change_brightness(*options.brightness,
-                                    CD_OBJECT_SCOPE_NORMAL);
+    /* A running daemon applies it, otherwise do it ourselves */
+    if (send_control_request(CONTROL_SET, *options.brightness)) {
+      exit(0);
+    }
+    if (backlight_registry_init(&registry, options.sysfs_root,
+                                options.backlight_order)) {
+      Output *output = create_output(1, CD_OBJECT_SCOPE_NORMAL);
+      if (output != NULL) {
+        output_apply(output, *options.brightness);
+        /* Keep the applied profile, only drop the session */
+        output_detach(output);
+        output_free(output);
+      }
+      backlight_registry_destroy(&registry);
+    }
+  } else if (options.nudge != NULL || options.func_get_flag ||
+             options.func_stats_flag) {
+    if (!send_control_request(options.nudge != NULL ? CONTROL_NUDGE
+                              : options.func_get_flag ? CONTROL_GET
+                                                      : CONTROL_STATS,
+                              options.nudge != NULL ? *options.nudge : 0)) {
+      printf("no daemon listening on %s\n", options.control_socket);
+      exit(1);
+    }
+  } else if (options.temperature != NULL && !options.func_watch_flag &&
+             options.replay == NULL) {
+    if (!send_control_request(CONTROL_TEMPERATURE, *options.temperature)) {
+      printf("no daemon listening on %s\n", options.control_socket);
+      exit(1);
+    }
+  } else if (options.build_pack != NULL) {
+    printf("building %u levels on %u threads\n",
+           profile_pack_count(*options.cache_step), g_get_num_processors());
+    if (!cdutils_build_profile_pack(options.build_pack, *options.cache_step,
+                                    *options.vcgt_size, 0)) {
+      printf("build %s fail\n", options.build_pack);
+      exit(1);
     }
-  } else if (options.func_watch_flag) {
+  } else if (options.func_watch_flag || options.replay != NULL) {
     watch_brightness_change_daemon();
   }
 
@@ -0,0 +1,191 @@
+#include "metrics.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+unsigned long metrics_counters[METRICS_COUNTER_LAST];
+MetricsHistogram metrics_histograms[METRICS_STAGE_LAST];
+
+/* Where the wakeup rate of the next print starts */
+static int64_t metrics_rate_since;
+static unsigned long metrics_rate_wakeups;
+
+static const char *metrics_counter_names[METRICS_COUNTER_LAST] = {
+    [METRICS_DBUS_CLIENT_CONNECT] = "dbus client_connect",
+    [METRICS_DBUS_GET_DEVICES] = "dbus get_devices_by_kind",
+    [METRICS_DBUS_GET_PROFILES] = "dbus get_profiles",
+    [METRICS_DBUS_DEVICE_CONNECT] = "dbus device_connect",
+    [METRICS_DBUS_PROFILE_CONNECT] = "dbus profile_connect",
+    [METRICS_DBUS_FIND_PROFILE] = "dbus find_profile",
+    [METRICS_DBUS_CREATE_PROFILE] = "dbus create_profile",
+    [METRICS_DBUS_ADD_PROFILE] = "dbus add_profile",
+    [METRICS_DBUS_MAKE_PROFILE_DEFAULT] = "dbus make_profile_default",
+    [METRICS_DBUS_DELETE_PROFILE] = "dbus delete_profile",
+    [METRICS_RECONNECTS] = "reconnects",
+    [METRICS_APPLIES] = "applies",
+    [METRICS_APPLY_FAILURES] = "apply failures",
+    [METRICS_CACHE_HITS] = "profile cache hits",
+    [METRICS_CACHE_MISSES] = "profile cache misses",
+    [METRICS_CACHE_EVICTIONS] = "profile cache evictions",
+    [METRICS_PROFILES_ADOPTED] = "profiles adopted",
+    [METRICS_BASE_PROFILE_LOADS] = "base profiles parsed",
+    [METRICS_SWEEP_PROFILES] = "orphaned profiles deleted",
+    [METRICS_SWEEP_FILES] = "orphaned icc files removed",
+    [METRICS_EVENTS] = "brightness events",
+    [METRICS_EVENTS_COALESCED] = "brightness events coalesced",
+    [METRICS_DEAD_BAND] = "brightness events in dead band",
+    [METRICS_WAKEUPS] = "watcher wakeups",
+    [METRICS_INOTIFY_EVENTS] = "inotify events",
+    [METRICS_SYSFS_READS] = "sysfs reads",
+    [METRICS_CONTROL_REQUESTS] = "control requests",
+    [METRICS_TRANSITION_FRAMES] = "transition frames",
+    [METRICS_TRANSITION_DROPPED] = "transition frames dropped",
+};
+
+static const char *metrics_stage_names[METRICS_STAGE_LAST] = {
+    [METRICS_STAGE_WAKEUP] = "inotify_wakeup",
+    [METRICS_STAGE_SYSFS_READ] = "sysfs_read",
+    [METRICS_STAGE_GENERATE] = "profile_generate",
+    [METRICS_STAGE_SAVE] = "profile_save",
+    [METRICS_STAGE_CREATE_PROFILE] = "create_profile",
+    [METRICS_STAGE_ADD_PROFILE] = "add_profile",
+    [METRICS_STAGE_MAKE_DEFAULT] = "make_profile_default",
+    [METRICS_STAGE_DELETE_PROFILE] = "delete_profile",
+    [METRICS_STAGE_GAMMA_COMMIT] = "gamma_lut_commit",
+    [METRICS_STAGE_EVENT_APPLIED] = "event_to_applied",
+};
+
+unsigned long metrics_dbus_calls(void) {
+  unsigned long sum = 0;
+  for (int i = METRICS_DBUS_CLIENT_CONNECT; i <= METRICS_DBUS_DELETE_PROFILE;
+       i++) {
+    sum += metrics_counters[i];
+  }
+  return sum;
+}
+
+/* Largest microseconds the bucket holding quantile q may hold */
+static unsigned long long metrics_quantile(const MetricsHistogram *histogram,
+                                           double q) {
+  unsigned long rank = (unsigned long)(q * histogram->count);
+  unsigned long seen = 0;
+
+  for (int i = 0; i < METRICS_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > rank) {
+      return 1ULL << i;
+    }
+  }
+  return 1ULL << (METRICS_BUCKETS - 1);
+}
+
+void metrics_start(void) {
+  metrics_rate_since = metrics_now();
+  metrics_rate_wakeups = metrics_counters[METRICS_WAKEUPS];
+}
+
+void metrics_print(FILE *stream) {
+  int64_t now = metrics_now();
+  unsigned long changes = metrics_counters[METRICS_EVENTS];
+
+  for (int i = 0; i < METRICS_COUNTER_LAST; i++) {
+    fprintf(stream, "%-28s %lu\n", metrics_counter_names[i],
+            metrics_counters[i]);
+  }
+  fprintf(stream, "%-28s %lu\n", "dbus total", metrics_dbus_calls());
+  if (now > metrics_rate_since) {
+    fprintf(stream, "%-28s %0.3f\n", "wakeups per second",
+            (metrics_counters[METRICS_WAKEUPS] - metrics_rate_wakeups) * 1e6 /
+                (now - metrics_rate_since));
+  }
+  if (changes > 0) {
+    fprintf(stream, "%-28s %0.2f\n", "inotify events per change",
+            (double)metrics_counters[METRICS_INOTIFY_EVENTS] / changes);
+  }
+  metrics_rate_since = now;
+  metrics_rate_wakeups = metrics_counters[METRICS_WAKEUPS];
+
+  fprintf(stream, "%-28s %8s %10s %10s %10s\n", "stage", "count", "mean us",
+          "p50 <us", "p99 <us");
+  for (int i = 0; i < METRICS_STAGE_LAST; i++) {
+    const MetricsHistogram *histogram = &metrics_histograms[i];
+    if (histogram->count == 0) {
+      continue;
+    }
+    fprintf(stream, "%-28s %8lu %10llu %10llu %10llu\n", metrics_stage_names[i],
+            histogram->count, histogram->sum_us / histogram->count,
+            metrics_quantile(histogram, 0.5),
+            metrics_quantile(histogram, 0.99));
+  }
+}
+
+/* "profile cache hits" -> "profile_cache_hits" */
+static void metrics_prometheus_name(char *buf, size_t len, const char *name) {
+  size_t i;
+  for (i = 0; i + 1 < len && name[i] != '\0'; i++) {
+    buf[i] = isalnum((unsigned char)name[i]) ? name[i] : '_';
+  }
+  buf[i] = '\0';
+}
+
+bool metrics_write_prometheus(const char *path) {
+  char tmp_path[4096];
+  char name[64];
+  FILE *stream;
+  int fd;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+      (int)sizeof(tmp_path)) {
+    return false;
+  }
+  /* The daemon runs under umask 0, never leave it world writable */
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  stream = fdopen(fd, "w");
+  if (stream == NULL) {
+    close(fd);
+    remove(tmp_path);
+    return false;
+  }
+
+  for (int i = 0; i < METRICS_COUNTER_LAST; i++) {
+    metrics_prometheus_name(name, sizeof(name), metrics_counter_names[i]);
+    fprintf(stream, "# TYPE icc_brightness_%s_total counter\n", name);
+    fprintf(stream, "icc_brightness_%s_total %lu\n", name,
+            metrics_counters[i]);
+  }
+
+  fprintf(stream, "# HELP icc_brightness_stage_seconds Time spent in each "
+                  "stage of a brightness change.\n");
+  fprintf(stream, "# TYPE icc_brightness_stage_seconds histogram\n");
+  for (int i = 0; i < METRICS_STAGE_LAST; i++) {
+    const MetricsHistogram *histogram = &metrics_histograms[i];
+    unsigned long cumulative = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+      cumulative += histogram->buckets[b];
+      fprintf(stream,
+              "icc_brightness_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} "
+              "%lu\n",
+              metrics_stage_names[i], (1ULL << b) / 1e6, cumulative);
+    }
+    fprintf(stream,
+            "icc_brightness_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+            "%lu\n",
+            metrics_stage_names[i], histogram->count);
+    fprintf(stream, "icc_brightness_stage_seconds_sum{stage=\"%s\"} %g\n",
+            metrics_stage_names[i], histogram->sum_us / 1e6);
+    fprintf(stream, "icc_brightness_stage_seconds_count{stage=\"%s\"} %lu\n",
+            metrics_stage_names[i], histogram->count);
+  }
+
+  if (fclose(stream) != 0 || rename(tmp_path, path) != 0) {
+    remove(tmp_path);
+    return false;
+  }
+  return true;
+}
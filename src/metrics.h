@@ -0,0 +1,108 @@
+#ifndef ICC_BRIGHTNESS_METRICS_H
+#define ICC_BRIGHTNESS_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+enum metrics_counter {
+  METRICS_DBUS_CLIENT_CONNECT,
+  METRICS_DBUS_GET_DEVICES,
+  METRICS_DBUS_GET_PROFILES,
+  METRICS_DBUS_DEVICE_CONNECT,
+  METRICS_DBUS_PROFILE_CONNECT,
+  METRICS_DBUS_FIND_PROFILE,
+  METRICS_DBUS_CREATE_PROFILE,
+  METRICS_DBUS_ADD_PROFILE,
+  METRICS_DBUS_MAKE_PROFILE_DEFAULT,
+  METRICS_DBUS_DELETE_PROFILE,
+  METRICS_RECONNECTS,
+  METRICS_APPLIES,
+  METRICS_APPLY_FAILURES,
+  METRICS_CACHE_HITS,
+  METRICS_CACHE_MISSES,
+  METRICS_CACHE_EVICTIONS,
+  METRICS_PROFILES_ADOPTED,
+  METRICS_BASE_PROFILE_LOADS, /* calibrated profiles read and parsed */
+  METRICS_SWEEP_PROFILES,
+  METRICS_SWEEP_FILES,
+  METRICS_EVENTS,
+  METRICS_EVENTS_COALESCED,
+  METRICS_DEAD_BAND, /* changes mapped to the level already applied */
+  METRICS_WAKEUPS,        /* inotify and frame timer callbacks */
+  METRICS_INOTIFY_EVENTS, /* of any kind, ideally one per change */
+  METRICS_SYSFS_READS,
+  METRICS_CONTROL_REQUESTS, /* on --control-socket */
+  METRICS_TRANSITION_FRAMES,
+  METRICS_TRANSITION_DROPPED,
+  METRICS_COUNTER_LAST
+};
+
+/* Stages of a brightness change, each one has a latency histogram */
+enum metrics_stage {
+  METRICS_STAGE_WAKEUP, /* handling an inotify wakeup */
+  METRICS_STAGE_SYSFS_READ,
+  METRICS_STAGE_GENERATE, /* icc of a new level in memory */
+  METRICS_STAGE_SAVE,     /* icc file on disk */
+  METRICS_STAGE_CREATE_PROFILE,
+  METRICS_STAGE_ADD_PROFILE,
+  METRICS_STAGE_MAKE_DEFAULT,
+  METRICS_STAGE_DELETE_PROFILE,
+  METRICS_STAGE_GAMMA_COMMIT, /* drm atomic commit of a GAMMA_LUT */
+  METRICS_STAGE_EVENT_APPLIED, /* brightness event to the apply covering it */
+  METRICS_STAGE_LAST
+};
+
+/* Bucket i counts samples up to 2^i microseconds, the last one the rest */
+#define METRICS_BUCKETS 24
+
+typedef struct {
+  unsigned long buckets[METRICS_BUCKETS];
+  unsigned long count;
+  unsigned long long sum_us;
+} MetricsHistogram;
+
+extern unsigned long metrics_counters[METRICS_COUNTER_LAST];
+extern MetricsHistogram metrics_histograms[METRICS_STAGE_LAST];
+
+#define metrics_inc(counter) (metrics_counters[(counter)]++)
+
+/* Monotonic microseconds, the start of a stage */
+static inline int64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Record a stage that began at start, a few instructions and no allocation */
+static inline void metrics_observe(enum metrics_stage stage, int64_t start) {
+  MetricsHistogram *histogram = &metrics_histograms[stage];
+  int64_t us = metrics_now() - start;
+  /* 2^i itself belongs to bucket i, Prometheus le is inclusive */
+  unsigned int bucket = us > 1 ? 64 - __builtin_clzll(us - 1) : 0;
+
+  if (bucket >= METRICS_BUCKETS) {
+    bucket = METRICS_BUCKETS - 1;
+  }
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->sum_us += us > 0 ? us : 0;
+}
+
+/* Sum of every D-Bus round trip made to colord so far */
+unsigned long metrics_dbus_calls(void);
+
+/* Wakeups per second are reported from here on */
+void metrics_start(void);
+
+/*
+Counters, wakeups per second since the previous print and inotify events
+per change, then count, mean and bucket bounds of p50 and p99 per stage
+ */
+void metrics_print(FILE *stream);
+
+/* Prometheus text format, written next to path and renamed over it */
+bool metrics_write_prometheus(const char *path);
+
+#endif
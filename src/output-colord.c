@@ -0,0 +1,75 @@
+#include "output.h"
+
+/* The original pipeline: icc file, colord profile, make default */
+typedef struct {
+  Output parent;
+  CdUtilConnection *connection;
+  CdObjectScope scope;
+} OutputColord;
+
+static void output_colord_apply_async(Output *output, int backlight,
+                                      double brightness, CdUtilDoneFunc done,
+                                      gpointer user_data) {
+  OutputColord *self = (OutputColord *)output;
+  cdutils_icc_change_brightness_async(self->connection, backlight, brightness,
+                                      self->scope, done, user_data);
+}
+
+static gboolean output_colord_apply(Output *output, double brightness) {
+  OutputColord *self = (OutputColord *)output;
+  return cdutils_icc_change_brightness(self->connection, brightness,
+                                       self->scope);
+}
+
+static gboolean output_colord_list(Output *output) {
+  return cdutils_list_devices(((OutputColord *)output)->connection);
+}
+
+static void output_colord_sweep(Output *output) {
+  cdutils_connection_sweep_async(((OutputColord *)output)->connection, NULL,
+                                 NULL);
+}
+
+static void output_colord_prepare(Output *output, CdUtilDoneFunc done,
+                                  gpointer user_data) {
+  OutputColord *self = (OutputColord *)output;
+  cdutils_connection_fill_pool_async(self->connection, self->scope, done,
+                                     user_data);
+}
+
+static gboolean output_colord_set_layers(Output *output,
+                                         const VcgtLayers *layers) {
+  return cdutils_connection_set_layers(((OutputColord *)output)->connection,
+                                       layers);
+}
+
+static void output_colord_detach(Output *output) {
+  cdutils_connection_detach_profiles(((OutputColord *)output)->connection);
+}
+
+static void output_colord_free(Output *output) {
+  OutputColord *self = (OutputColord *)output;
+  cdutils_connection_free(self->connection);
+  g_free(self);
+}
+
+static const OutputBackend output_colord_backend = {
+    .name = "colord",
+    .apply_async = output_colord_apply_async,
+    .apply = output_colord_apply,
+    .list = output_colord_list,
+    .sweep = output_colord_sweep,
+    .prepare = output_colord_prepare,
+    .set_layers = output_colord_set_layers,
+    .detach = output_colord_detach,
+    .free = output_colord_free,
+};
+
+Output *output_colord_new(CdUtilConnection *connection, CdObjectScope scope) {
+  OutputColord *self = g_new0(OutputColord, 1);
+
+  self->parent.backend = &output_colord_backend;
+  self->connection = connection;
+  self->scope = scope;
+  return &self->parent;
+}
@@ -0,0 +1,457 @@
+#include "output.h"
+#include <stdio.h>
+
+#ifdef HAVE_LIBDRM
+
+#include "metrics.h"
+#include "vcgt.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#define OUTPUT_DRM_MAX_CARDS 16
+
+/* A lit connector, the CRTC scanning it out and its gamma LUT */
+typedef struct {
+  uint32_t crtc_id;
+  uint32_t gamma_lut;      /* GAMMA_LUT property id */
+  uint32_t lut_size;       /* GAMMA_LUT_SIZE */
+  uint32_t blob_id;        /* our blob that is applied, 0 if none */
+  char connector[32];      /* e.g. eDP-1, as sysfs names it */
+  gboolean embedded;       /* eDP, LVDS or DSI panel */
+  int backlight;           /* index in the registry or CDUTILS_NO_BACKLIGHT */
+} OutputDrmCrtc;
+
+typedef struct {
+  Output parent;
+  int fd;
+  gchar *path;
+  OutputDrmCrtc crtcs[CDUTILS_MAX_DISPLAYS];
+  guint n_crtcs;
+  const BacklightRegistry *registry;
+  CdUtilFollowPolicy follow;
+  gboolean detached;
+  Vcgt vcgt;                  /* sized to the LUT being filled */
+  VcgtLayers layers;          /* composed into every LUT */
+  struct drm_color_lut *lut;  /* vcgt.size entries */
+} OutputDrm;
+
+/* Property id and current value of name on a CRTC, false if it has none */
+static gboolean output_drm_crtc_property(int fd, uint32_t crtc_id,
+                                         const char *name, uint32_t *id,
+                                         uint64_t *value) {
+  drmModeObjectProperties *props =
+      drmModeObjectGetProperties(fd, crtc_id, DRM_MODE_OBJECT_CRTC);
+  gboolean found = FALSE;
+
+  for (uint32_t i = 0; props != NULL && i < props->count_props && !found;
+       i++) {
+    drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+    if (prop != NULL && strcmp(prop->name, name) == 0) {
+      *id = prop->prop_id;
+      *value = props->prop_values[i];
+      found = TRUE;
+    }
+    drmModeFreeProperty(prop);
+  }
+  drmModeFreeObjectProperties(props);
+  return found;
+}
+
+/* The CRTC lighting the connector, or a free one it could use */
+static uint32_t output_drm_connector_crtc(int fd, drmModeRes *res,
+                                          drmModeConnector *connector,
+                                          uint32_t taken) {
+  uint32_t crtc_id = 0;
+
+  if (connector->encoder_id != 0) {
+    drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoder_id);
+    if (encoder != NULL) {
+      crtc_id = encoder->crtc_id;
+      drmModeFreeEncoder(encoder);
+    }
+  }
+
+  for (int e = 0; crtc_id == 0 && e < connector->count_encoders; e++) {
+    drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoders[e]);
+    if (encoder == NULL) {
+      continue;
+    }
+    for (int c = 0; crtc_id == 0 && c < res->count_crtcs && c < 32; c++) {
+      if ((encoder->possible_crtcs & (1u << c)) && !(taken & (1u << c))) {
+        crtc_id = res->crtcs[c];
+      }
+    }
+    drmModeFreeEncoder(encoder);
+  }
+  return crtc_id;
+}
+
+/* Every connected connector whose CRTC has a GAMMA_LUT */
+static gboolean output_drm_open(OutputDrm *self, const char *path) {
+  drmModeRes *res;
+  uint32_t taken = 0;
+
+  self->fd = open(path, O_RDWR | O_CLOEXEC);
+  if (self->fd == -1) {
+    return FALSE;
+  }
+  if (drmSetClientCap(self->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0 ||
+      drmSetClientCap(self->fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0 ||
+      (res = drmModeGetResources(self->fd)) == NULL) {
+    close(self->fd);
+    self->fd = -1;
+    return FALSE;
+  }
+
+  self->n_crtcs = 0;
+  for (int i = 0; i < res->count_connectors &&
+                  self->n_crtcs < CDUTILS_MAX_DISPLAYS;
+       i++) {
+    drmModeConnector *connector =
+        drmModeGetConnector(self->fd, res->connectors[i]);
+    if (connector == NULL) {
+      continue;
+    }
+
+    uint32_t crtc_id = 0;
+    OutputDrmCrtc *crtc = &self->crtcs[self->n_crtcs];
+    uint64_t lut_size = 0;
+    uint64_t blob = 0;
+    uint32_t size_id;
+
+    if (connector->connection == DRM_MODE_CONNECTED) {
+      crtc_id = output_drm_connector_crtc(self->fd, res, connector, taken);
+    }
+    if (crtc_id != 0 &&
+        output_drm_crtc_property(self->fd, crtc_id, "GAMMA_LUT",
+                                 &crtc->gamma_lut, &blob) &&
+        output_drm_crtc_property(self->fd, crtc_id, "GAMMA_LUT_SIZE",
+                                 &size_id, &lut_size) &&
+        lut_size >= 2) {
+      const char *type = drmModeGetConnectorTypeName(connector->connector_type);
+
+      crtc->crtc_id = crtc_id;
+      crtc->lut_size = lut_size;
+      crtc->blob_id = 0;
+      snprintf(crtc->connector, sizeof(crtc->connector), "%s-%u",
+               type != NULL ? type : "Unknown", connector->connector_type_id);
+      crtc->embedded = connector->connector_type == DRM_MODE_CONNECTOR_eDP ||
+                       connector->connector_type == DRM_MODE_CONNECTOR_LVDS ||
+                       connector->connector_type == DRM_MODE_CONNECTOR_DSI;
+      for (int c = 0; c < res->count_crtcs && c < 32; c++) {
+        if (res->crtcs[c] == crtc_id) {
+          taken |= 1u << c;
+        }
+      }
+      self->n_crtcs++;
+    }
+    drmModeFreeConnector(connector);
+  }
+  drmModeFreeResources(res);
+
+  if (self->n_crtcs == 0) {
+    close(self->fd);
+    self->fd = -1;
+    return FALSE;
+  }
+  self->path = g_strdup(path);
+  return TRUE;
+}
+
+/* Same rules as colord displays: connector, embedded panel, first output */
+static void output_drm_match(OutputDrm *self) {
+  for (guint i = 0; i < self->n_crtcs; i++) {
+    self->crtcs[i].backlight = CDUTILS_NO_BACKLIGHT;
+  }
+
+  for (unsigned int b = 0; b < self->registry->count; b++) {
+    const char *connector = self->registry->backlights[b].connector;
+    gboolean matched = FALSE;
+
+    for (guint i = 0; connector[0] != '\0' && i < self->n_crtcs; i++) {
+      if (self->crtcs[i].backlight == CDUTILS_NO_BACKLIGHT &&
+          strcmp(self->crtcs[i].connector, connector) == 0) {
+        self->crtcs[i].backlight = b;
+        matched = TRUE;
+      }
+    }
+
+    for (guint i = 0; !matched && i < self->n_crtcs; i++) {
+      if (self->crtcs[i].backlight == CDUTILS_NO_BACKLIGHT &&
+          self->crtcs[i].embedded) {
+        self->crtcs[i].backlight = b;
+        matched = TRUE;
+      }
+    }
+
+    if (!matched && b == 0 &&
+        self->crtcs[0].backlight == CDUTILS_NO_BACKLIGHT) {
+      self->crtcs[0].backlight = 0;
+    }
+  }
+}
+
+static gboolean output_drm_follows(OutputDrm *self, OutputDrmCrtc *crtc,
+                                   int backlight) {
+  if (crtc->backlight == backlight) {
+    return TRUE;
+  }
+  return crtc->backlight == CDUTILS_NO_BACKLIGHT && backlight == 0 &&
+         self->follow == CDUTILS_FOLLOW_PRIMARY;
+}
+
+/* A blob holding the ramp of brightness at the LUT size of crtc */
+static gboolean output_drm_create_lut(OutputDrm *self, OutputDrmCrtc *crtc,
+                                      double brightness, uint32_t *blob_id) {
+  int64_t start = metrics_now();
+
+  if (self->vcgt.size != crtc->lut_size) {
+    vcgt_destroy(&self->vcgt);
+    g_free(self->lut);
+    self->lut = NULL;
+    if (!vcgt_init(&self->vcgt, crtc->lut_size)) {
+      vcgt_destroy(&self->vcgt);
+      return FALSE;
+    }
+    self->lut = g_new0(struct drm_color_lut, crtc->lut_size);
+  }
+
+  /* Only recomputes the layers that changed */
+  vcgt_set_layers(&self->vcgt, &self->layers);
+  vcgt_fill_brightness(&self->vcgt, brightness);
+  const uint16_t *red = vcgt_channel(&self->vcgt, 0);
+  const uint16_t *green = vcgt_channel(&self->vcgt, 1);
+  const uint16_t *blue = vcgt_channel(&self->vcgt, 2);
+  for (unsigned int i = 0; i < self->vcgt.size; i++) {
+    self->lut[i].red = red[i];
+    self->lut[i].green = green[i];
+    self->lut[i].blue = blue[i];
+  }
+  metrics_observe(METRICS_STAGE_GENERATE, start);
+
+  return drmModeCreatePropertyBlob(self->fd, self->lut,
+                                   self->vcgt.size *
+                                       sizeof(struct drm_color_lut),
+                                   blob_id) == 0;
+}
+
+/*
+Set GAMMA_LUT of every CRTC the backlight drives in one atomic commit.
+blob_id 0 restores the linear LUT.
+ */
+static gboolean output_drm_commit(OutputDrm *self, int backlight,
+                                  double brightness, gboolean reset) {
+  drmModeAtomicReq *req = drmModeAtomicAlloc();
+  uint32_t blobs[CDUTILS_MAX_DISPLAYS] = {0};
+  gboolean success = req != NULL;
+  int64_t start;
+
+  for (guint i = 0; success && i < self->n_crtcs; i++) {
+    OutputDrmCrtc *crtc = &self->crtcs[i];
+    if (!reset && !output_drm_follows(self, crtc, backlight)) {
+      continue;
+    }
+    if (reset && crtc->blob_id == 0) {
+      continue;
+    }
+    if (!reset) {
+      success = output_drm_create_lut(self, crtc, brightness, &blobs[i]);
+    }
+    success = success && drmModeAtomicAddProperty(req, crtc->crtc_id,
+                                                  crtc->gamma_lut,
+                                                  blobs[i]) >= 0;
+  }
+
+  /* A commit still in flight makes a nonblocking one fail, wait for it */
+  start = metrics_now();
+  if (success &&
+      drmModeAtomicCommit(self->fd, req, DRM_MODE_ATOMIC_NONBLOCK, NULL) != 0) {
+    success =
+        errno == EBUSY && drmModeAtomicCommit(self->fd, req, 0, NULL) == 0;
+    if (!success) {
+      perror("drm atomic commit");
+    }
+  }
+  metrics_observe(METRICS_STAGE_GAMMA_COMMIT, start);
+  drmModeAtomicFree(req);
+
+  /* The CRTC state holds a reference, ours can go once replaced */
+  for (guint i = 0; i < self->n_crtcs; i++) {
+    OutputDrmCrtc *crtc = &self->crtcs[i];
+    if (!reset && !output_drm_follows(self, crtc, backlight)) {
+      continue;
+    }
+    if (!success) {
+      if (blobs[i] != 0) {
+        drmModeDestroyPropertyBlob(self->fd, blobs[i]);
+      }
+      continue;
+    }
+    if (crtc->blob_id != 0) {
+      drmModeDestroyPropertyBlob(self->fd, crtc->blob_id);
+    }
+    crtc->blob_id = blobs[i];
+  }
+  return success;
+}
+
+typedef struct {
+  gboolean success;
+  CdUtilDoneFunc done;
+  gpointer user_data;
+} OutputDrmDone;
+
+static gboolean output_drm_done_cb(gpointer user_data) {
+  OutputDrmDone *done = user_data;
+  done->done(done->success, done->user_data);
+  g_free(done);
+  return G_SOURCE_REMOVE;
+}
+
+/* Commits right away, done still runs from the main loop like colord's */
+static void output_drm_apply_async(Output *output, int backlight,
+                                   double brightness, CdUtilDoneFunc done,
+                                   gpointer user_data) {
+  OutputDrm *self = (OutputDrm *)output;
+  OutputDrmDone *result = g_new0(OutputDrmDone, 1);
+
+  metrics_inc(METRICS_APPLIES);
+  result->success = output_drm_commit(self, backlight, brightness, FALSE);
+  if (!result->success) {
+    metrics_inc(METRICS_APPLY_FAILURES);
+  }
+  result->done = done;
+  result->user_data = user_data;
+  g_idle_add(output_drm_done_cb, result);
+}
+
+static gboolean output_drm_apply(Output *output, double brightness) {
+  metrics_inc(METRICS_APPLIES);
+  return output_drm_commit((OutputDrm *)output, 0, brightness, FALSE);
+}
+
+static gboolean output_drm_list(Output *output) {
+  OutputDrm *self = (OutputDrm *)output;
+
+  printf("device: %s\n", self->path);
+  for (guint i = 0; i < self->n_crtcs; i++) {
+    OutputDrmCrtc *crtc = &self->crtcs[i];
+    uint32_t id;
+    uint64_t blob_id = 0;
+
+    printf("crtc %u:\n", crtc->crtc_id);
+    printf("  output: %s\n", crtc->connector);
+    printf("  embedded: %s\n", crtc->embedded ? "true" : "false");
+    printf("  gamma lut size: %u\n", crtc->lut_size);
+
+    /* Read back what is applied, whoever set it */
+    output_drm_crtc_property(self->fd, crtc->crtc_id, "GAMMA_LUT", &id,
+                             &blob_id);
+    drmModePropertyBlobRes *blob =
+        blob_id != 0 ? drmModeGetPropertyBlob(self->fd, blob_id) : NULL;
+    if (blob != NULL && blob->length >= sizeof(struct drm_color_lut)) {
+      const struct drm_color_lut *lut = blob->data;
+      size_t last = blob->length / sizeof(struct drm_color_lut) - 1;
+      printf("  gamma lut max: %0.2f\n", lut[last].red / 65535.0);
+    } else {
+      printf("  gamma lut max: none, linear\n");
+    }
+    drmModeFreePropertyBlob(blob);
+
+    if (crtc->backlight != CDUTILS_NO_BACKLIGHT) {
+      printf("  backlight: %s\n",
+             self->registry->backlights[crtc->backlight].name);
+    } else if (self->follow == CDUTILS_FOLLOW_PRIMARY &&
+               self->registry->count > 0) {
+      printf("  backlight: none, follows %s\n",
+             self->registry->backlights[0].name);
+    } else {
+      printf("  backlight: none, left alone\n");
+    }
+  }
+  return TRUE;
+}
+
+static gboolean output_drm_set_layers(Output *output,
+                                      const VcgtLayers *layers) {
+  ((OutputDrm *)output)->layers = *layers;
+  return TRUE;
+}
+
+static void output_drm_detach(Output *output) {
+  ((OutputDrm *)output)->detached = TRUE;
+}
+
+/* Like deleting our colord profiles: back to linear unless detached */
+static void output_drm_free(Output *output) {
+  OutputDrm *self = (OutputDrm *)output;
+
+  if (!self->detached) {
+    vcgt_layers_init(&self->layers);
+    output_drm_commit(self, CDUTILS_NO_BACKLIGHT, 1, TRUE);
+  }
+  close(self->fd);
+  vcgt_destroy(&self->vcgt);
+  g_free(self->lut);
+  g_free(self->path);
+  g_free(self);
+}
+
+static const OutputBackend output_drm_backend = {
+    .name = "drm",
+    .apply_async = output_drm_apply_async,
+    .apply = output_drm_apply,
+    .list = output_drm_list,
+    .sweep = NULL,
+    .prepare = NULL,
+    .set_layers = output_drm_set_layers,
+    .detach = output_drm_detach,
+    .free = output_drm_free,
+};
+
+Output *output_drm_new(const char *device, const BacklightRegistry *registry,
+                       CdUtilFollowPolicy follow) {
+  OutputDrm *self = g_new0(OutputDrm, 1);
+  gboolean opened = FALSE;
+
+  self->parent.backend = &output_drm_backend;
+  self->registry = registry;
+  self->follow = follow;
+  vcgt_layers_init(&self->layers);
+
+  if (device != NULL) {
+    opened = output_drm_open(self, device);
+  }
+  for (int i = 0; device == NULL && !opened && i < OUTPUT_DRM_MAX_CARDS;
+       i++) {
+    char path[32];
+    snprintf(path, sizeof(path), DRM_DEV_NAME, DRM_DIR_NAME, i);
+    opened = output_drm_open(self, path);
+  }
+  if (!opened) {
+    printf("no drm device with a GAMMA_LUT%s%s\n", device != NULL ? ": " : "",
+           device != NULL ? device : "");
+    g_free(self);
+    return NULL;
+  }
+
+  output_drm_match(self);
+  return &self->parent;
+}
+
+#else
+
+Output *output_drm_new(const char *device, const BacklightRegistry *registry,
+                       CdUtilFollowPolicy follow) {
+  (void)device;
+  (void)registry;
+  (void)follow;
+  printf("built without libdrm, rebuild with make DRM=1\n");
+  return NULL;
+}
+
+#endif
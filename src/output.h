@@ -0,0 +1,97 @@
+#ifndef ICC_BRIGHTNESS_OUTPUT_H
+#define ICC_BRIGHTNESS_OUTPUT_H
+
+#include "backlight.h"
+#include "colord-utils.h"
+
+/* Where brightness ends up */
+typedef enum {
+  OUTPUT_COLORD, /* icc profile made default through colord */
+  OUTPUT_DRM,    /* GAMMA_LUT of the CRTC, no color manager needed */
+} OutputType;
+
+/* Seconds between two sweeps of the watch daemon */
+#define OUTPUT_SWEEP_INTERVAL 600
+
+typedef struct Output Output;
+
+/* What every backend implements */
+typedef struct {
+  const char *name;
+  /* Apply brightness of one backlight, done is called from the main loop */
+  void (*apply_async)(Output *output, int backlight, double brightness,
+                      CdUtilDoneFunc done, gpointer user_data);
+  /* Blocking, for one-shot use, applies to the primary backlight */
+  gboolean (*apply)(Output *output, double brightness);
+  /* Show every display and the backlight chosen for it */
+  gboolean (*list)(Output *output);
+  /* Clean up what earlier runs left behind in the background, may be NULL */
+  void (*sweep)(Output *output);
+  /* Register what later changes need before the first one, may be NULL */
+  void (*prepare)(Output *output, CdUtilDoneFunc done, gpointer user_data);
+  /* Compose layers with the next changes, FALSE if they cannot be */
+  gboolean (*set_layers)(Output *output, const VcgtLayers *layers);
+  /* Keep what was applied after free */
+  void (*detach)(Output *output);
+  void (*free)(Output *output);
+} OutputBackend;
+
+/* Embedded first in the state of each backend */
+struct Output {
+  const OutputBackend *backend;
+};
+
+static inline void output_apply_async(Output *output, int backlight,
+                                      double brightness, CdUtilDoneFunc done,
+                                      gpointer user_data) {
+  output->backend->apply_async(output, backlight, brightness, done, user_data);
+}
+
+static inline gboolean output_apply(Output *output, double brightness) {
+  return output->backend->apply(output, brightness);
+}
+
+static inline gboolean output_list(Output *output) {
+  return output->backend->list(output);
+}
+
+static inline void output_sweep(Output *output) {
+  if (output->backend->sweep != NULL) {
+    output->backend->sweep(output);
+  }
+}
+
+static inline void output_prepare(Output *output, CdUtilDoneFunc done,
+                                  gpointer user_data) {
+  if (output->backend->prepare != NULL) {
+    output->backend->prepare(output, done, user_data);
+  } else {
+    done(TRUE, user_data);
+  }
+}
+
+static inline gboolean output_set_layers(Output *output,
+                                         const VcgtLayers *layers) {
+  return output->backend->set_layers(output, layers);
+}
+
+static inline void output_detach(Output *output) {
+  output->backend->detach(output);
+}
+
+static inline void output_free(Output *output) {
+  output->backend->free(output);
+}
+
+/* Takes ownership of the connection */
+Output *output_colord_new(CdUtilConnection *connection, CdObjectScope scope);
+
+/*
+Open device (NULL for the first /dev/dri/card* with a GAMMA_LUT) and pair
+its CRTCs with the backlights of registry like colord displays are paired.
+NULL if built without libdrm or nothing usable was found.
+ */
+Output *output_drm_new(const char *device, const BacklightRegistry *registry,
+                       CdUtilFollowPolicy follow);
+
+#endif
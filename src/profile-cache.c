@@ -0,0 +1,142 @@
+#include "profile-cache.h"
+#include "metrics.h"
+#include <math.h>
+#include <stdlib.h>
+
+void profile_cache_init(ProfileCache *cache, double step, unsigned int capacity,
+                        ProfileCacheEvictFunc evict, void *user_data) {
+  if (capacity < 1) {
+    capacity = 1;
+  }
+
+  /* One spare slot, the new profile is inserted before the LRU is evicted */
+  cache->allocated = capacity + 1;
+  cache->entries = calloc(cache->allocated, sizeof(ProfileCacheEntry));
+  cache->len = 0;
+  cache->capacity = capacity;
+  cache->step = step > 0 ? step : 0.01;
+  cache->clock = 0;
+  cache->evict = evict;
+  cache->user_data = user_data;
+}
+
+void profile_cache_destroy(ProfileCache *cache) {
+  profile_cache_clear(cache);
+  free(cache->entries);
+  cache->entries = NULL;
+}
+
+int profile_cache_level(const ProfileCache *cache, double brightness) {
+  return (int)lround(brightness / cache->step);
+}
+
+double profile_cache_brightness(const ProfileCache *cache, int level) {
+  double brightness = level * cache->step;
+  return brightness > 1 ? 1 : brightness;
+}
+
+ProfileCacheEntry *profile_cache_peek(ProfileCache *cache, int level) {
+  for (unsigned int i = 0; i < cache->len; i++) {
+    if (cache->entries[i].level == level) {
+      return &cache->entries[i];
+    }
+  }
+  return NULL;
+}
+
+ProfileCacheEntry *profile_cache_lookup(ProfileCache *cache, int level) {
+  ProfileCacheEntry *entry = profile_cache_peek(cache, level);
+  if (entry != NULL) {
+    entry->last_used = ++cache->clock;
+    metrics_inc(METRICS_CACHE_HITS);
+  } else {
+    metrics_inc(METRICS_CACHE_MISSES);
+  }
+  return entry;
+}
+
+static void profile_cache_evict_index(ProfileCache *cache, unsigned int i) {
+  ProfileCacheEntry entry = cache->entries[i];
+
+  cache->entries[i] = cache->entries[--cache->len];
+
+  metrics_inc(METRICS_CACHE_EVICTIONS);
+  if (cache->evict != NULL) {
+    cache->evict(&entry, cache->user_data);
+  }
+  free(entry.filepath);
+}
+
+/* Evict least recently used unused entries beyond capacity, never keep */
+static void profile_cache_shrink(ProfileCache *cache, int keep) {
+  while (cache->len > cache->capacity) {
+    int lru = -1;
+    for (unsigned int i = 0; i < cache->len; i++) {
+      if (cache->entries[i].users == 0 && cache->entries[i].level != keep &&
+          (lru == -1 ||
+           cache->entries[i].last_used < cache->entries[lru].last_used)) {
+        lru = i;
+      }
+    }
+    /* Everything is default somewhere, stay over capacity for now */
+    if (lru == -1) {
+      break;
+    }
+    profile_cache_evict_index(cache, lru);
+  }
+}
+
+void profile_cache_insert(ProfileCache *cache, int level, void *profile,
+                          char *filepath) {
+  ProfileCacheEntry *entry;
+
+  profile_cache_remove(cache, level);
+
+  /* Entries in use are not evicted, so len may go past capacity */
+  if (cache->len == cache->allocated) {
+    cache->allocated *= 2;
+    cache->entries =
+        realloc(cache->entries, cache->allocated * sizeof(ProfileCacheEntry));
+  }
+  entry = &cache->entries[cache->len++];
+  entry->level = level;
+  entry->last_used = ++cache->clock;
+  entry->profile = profile;
+  entry->filepath = filepath;
+  entry->users = 0;
+  entry->devices = 0;
+
+  /* Not the new one, it is about to be made default */
+  profile_cache_shrink(cache, level);
+}
+
+void profile_cache_trim(ProfileCache *cache) {
+  profile_cache_shrink(cache, -1);
+}
+
+void profile_cache_remove(ProfileCache *cache, int level) {
+  ProfileCacheEntry *entry = profile_cache_peek(cache, level);
+  if (entry != NULL) {
+    profile_cache_evict_index(cache, entry - cache->entries);
+  }
+}
+
+void profile_cache_clear(ProfileCache *cache) {
+  while (cache->len > 0) {
+    profile_cache_evict_index(cache, cache->len - 1);
+  }
+}
+
+void profile_cache_forget(ProfileCache *cache) {
+  for (unsigned int i = 0; i < cache->len; i++) {
+    free(cache->entries[i].filepath);
+  }
+  cache->len = 0;
+}
+
+void profile_cache_reset_devices(ProfileCache *cache) {
+  for (unsigned int i = 0; i < cache->len; i++) {
+    cache->entries[i].users = 0;
+    cache->entries[i].devices = 0;
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef ICC_BRIGHTNESS_PROFILE_CACHE_H
+#define ICC_BRIGHTNESS_PROFILE_CACHE_H
+
+#include <stdbool.h>
+
+/* A registered profile and the icc file backing it */
+typedef struct {
+  int level; /* quantized brightness, brightness = level * step */
+  unsigned long last_used;
+  void *profile;
+  char *filepath;
+  unsigned int users;   /* displays using it as default, never evicted */
+  unsigned long devices; /* bitmask of displays it was added to */
+} ProfileCacheEntry;
+
+typedef void (*ProfileCacheEvictFunc)(ProfileCacheEntry *entry,
+                                      void *user_data);
+
+/* Bounded LRU cache of profiles keyed by quantized brightness */
+typedef struct {
+  ProfileCacheEntry *entries;
+  unsigned int len;
+  unsigned int allocated;
+  unsigned int capacity;
+  double step;
+  unsigned long clock;
+  ProfileCacheEvictFunc evict;
+  void *user_data;
+} ProfileCache;
+
+void profile_cache_init(ProfileCache *cache, double step, unsigned int capacity,
+                        ProfileCacheEvictFunc evict, void *user_data);
+
+void profile_cache_destroy(ProfileCache *cache);
+
+int profile_cache_level(const ProfileCache *cache, double brightness);
+
+double profile_cache_brightness(const ProfileCache *cache, int level);
+
+/* Find the entry for level and mark it as most recently used */
+ProfileCacheEntry *profile_cache_lookup(ProfileCache *cache, int level);
+
+/* Find the entry for level without touching it */
+ProfileCacheEntry *profile_cache_peek(ProfileCache *cache, int level);
+
+/*
+Add an entry, evicting the least recently used unused ones beyond capacity.
+The new entry itself is never evicted.
+ */
+void profile_cache_insert(ProfileCache *cache, int level, void *profile,
+                          char *filepath);
+
+/* Evict unused entries an insert had to keep beyond capacity */
+void profile_cache_trim(ProfileCache *cache);
+
+/* Evict one entry */
+void profile_cache_remove(ProfileCache *cache, int level);
+
+/* Evict every entry */
+void profile_cache_clear(ProfileCache *cache);
+
+/* Remove every entry without calling evict, caller keeps ownership */
+void profile_cache_forget(ProfileCache *cache);
+
+/* Displays were enumerated again, nothing is known to use any entry */
+void profile_cache_reset_devices(ProfileCache *cache);
+
+#endif
@@ -0,0 +1,199 @@
+#include "profile-pack.h"
+#include <fcntl.h>
+#include <glib.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PROFILE_PACK_ALIGN 8
+
+uint32_t profile_pack_count(double step) {
+  return (uint32_t)lround(1 / step) + 1;
+}
+
+static uint32_t profile_pack_step_ppm(double step) {
+  return (uint32_t)lround(step * 1e6);
+}
+
+/* SHA-256 of the index and the icc files */
+static void profile_pack_checksum(const uint8_t *body, size_t size,
+                                  uint8_t *out) {
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  gsize len = 32;
+
+  g_checksum_update(checksum, body, size);
+  g_checksum_get_digest(checksum, out, &len);
+  g_checksum_free(checksum);
+}
+
+bool profile_pack_write(const char *path, double step, unsigned int vcgt_size,
+                        const uint8_t *const *icc, const uint32_t *sizes,
+                        uint32_t count) {
+  ProfilePackHeader *header;
+  ProfilePackEntry *entries;
+  size_t size = sizeof(ProfilePackHeader) + count * sizeof(ProfilePackEntry);
+  uint8_t *data;
+  gchar *tmp_path;
+  bool ret = false;
+  int fd;
+
+  for (uint32_t i = 0; i < count; i++) {
+    size = (size + PROFILE_PACK_ALIGN - 1) & ~(size_t)(PROFILE_PACK_ALIGN - 1);
+    size += sizes[i];
+  }
+  if (size > UINT32_MAX) {
+    return false;
+  }
+  data = calloc(1, size);
+  if (data == NULL) {
+    return false;
+  }
+
+  header = (ProfilePackHeader *)data;
+  memcpy(header->magic, PROFILE_PACK_MAGIC, sizeof(header->magic));
+  header->version = GUINT32_TO_LE(PROFILE_PACK_VERSION);
+  header->count = GUINT32_TO_LE(count);
+  header->step_ppm = GUINT32_TO_LE(profile_pack_step_ppm(step));
+  header->vcgt_size = GUINT32_TO_LE(vcgt_size);
+
+  entries = (ProfilePackEntry *)(data + sizeof(ProfilePackHeader));
+  size_t offset = sizeof(ProfilePackHeader) + count * sizeof(ProfilePackEntry);
+  for (uint32_t i = 0; i < count; i++) {
+    offset = (offset + PROFILE_PACK_ALIGN - 1) &
+             ~(size_t)(PROFILE_PACK_ALIGN - 1);
+    entries[i].offset = GUINT32_TO_LE(offset);
+    entries[i].size = GUINT32_TO_LE(sizes[i]);
+    memcpy(data + offset, icc[i], sizes[i]);
+    offset += sizes[i];
+  }
+  profile_pack_checksum(data + sizeof(ProfilePackHeader),
+                        size - sizeof(ProfilePackHeader), header->checksum);
+
+  /* Never leave a half written pack behind for the daemon to map */
+  tmp_path = g_strdup_printf("%s.tmp", path);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    ret = write(fd, data, size) == (ssize_t)size;
+    ret = close(fd) == 0 && ret;
+    ret = ret && rename(tmp_path, path) == 0;
+    if (!ret) {
+      remove(tmp_path);
+    }
+  }
+  g_free(tmp_path);
+  free(data);
+  return ret;
+}
+
+static bool profile_pack_reject(ProfilePack *pack, const char *path,
+                                const char *reason) {
+  printf("profile pack %s: %s\n", path, reason);
+  profile_pack_close(pack);
+  return false;
+}
+
+bool profile_pack_open(ProfilePack *pack, const char *path, double step,
+                       unsigned int vcgt_size) {
+  const ProfilePackHeader *header;
+  uint8_t checksum[32];
+  struct stat st;
+  void *data;
+  int fd;
+
+  memset(pack, 0, sizeof(*pack));
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror(path);
+    return false;
+  }
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header)) {
+    close(fd);
+    printf("profile pack %s: too short\n", path);
+    return false;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  pack->data = data;
+  pack->size = st.st_size;
+
+  header = data;
+  if (memcmp(header->magic, PROFILE_PACK_MAGIC, sizeof(header->magic)) != 0) {
+    return profile_pack_reject(pack, path, "not a profile pack");
+  }
+  if (GUINT32_FROM_LE(header->version) != PROFILE_PACK_VERSION) {
+    return profile_pack_reject(pack, path, "built by another version");
+  }
+  if (GUINT32_FROM_LE(header->step_ppm) != profile_pack_step_ppm(step) ||
+      GUINT32_FROM_LE(header->count) != profile_pack_count(step)) {
+    return profile_pack_reject(pack, path, "built for another --cache-step");
+  }
+  if (GUINT32_FROM_LE(header->vcgt_size) != vcgt_size) {
+    return profile_pack_reject(pack, path, "built for another vcgt size");
+  }
+
+  pack->count = GUINT32_FROM_LE(header->count);
+  pack->entries = (const ProfilePackEntry *)(pack->data + sizeof(*header));
+  if (sizeof(*header) + pack->count * sizeof(ProfilePackEntry) > pack->size) {
+    return profile_pack_reject(pack, path, "truncated index");
+  }
+  for (uint32_t i = 0; i < pack->count; i++) {
+    uint64_t end = (uint64_t)GUINT32_FROM_LE(pack->entries[i].offset) +
+                   GUINT32_FROM_LE(pack->entries[i].size);
+    if (end > pack->size) {
+      return profile_pack_reject(pack, path, "truncated");
+    }
+  }
+
+  profile_pack_checksum(pack->data + sizeof(*header),
+                        pack->size - sizeof(*header), checksum);
+  if (memcmp(checksum, header->checksum, sizeof(checksum)) != 0) {
+    return profile_pack_reject(pack, path, "checksum mismatch");
+  }
+  return true;
+}
+
+void profile_pack_close(ProfilePack *pack) {
+  if (pack->data != NULL) {
+    munmap((void *)pack->data, pack->size);
+  }
+  memset(pack, 0, sizeof(*pack));
+}
+
+const uint8_t *profile_pack_lookup(const ProfilePack *pack, int level,
+                                   uint32_t *size) {
+  if (pack->data == NULL || level < 0 || (uint32_t)level >= pack->count) {
+    return NULL;
+  }
+  *size = GUINT32_FROM_LE(pack->entries[level].size);
+  return pack->data + GUINT32_FROM_LE(pack->entries[level].offset);
+}
+
+bool profile_pack_save(const ProfilePack *pack, int level, const char *path) {
+  const uint8_t *icc;
+  uint32_t size;
+  ssize_t written;
+  int fd;
+
+  icc = profile_pack_lookup(pack, level, &size);
+  if (icc == NULL) {
+    return false;
+  }
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  written = write(fd, icc, size);
+  if (close(fd) == -1 || written != (ssize_t)size) {
+    remove(path);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,65 @@
+#ifndef ICC_BRIGHTNESS_PROFILE_PACK_H
+#define ICC_BRIGHTNESS_PROFILE_PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bump when the layout or the generated profiles change */
+#define PROFILE_PACK_VERSION 1
+#define PROFILE_PACK_MAGIC "ICCBPACK"
+
+/*
+Every quantized level in one file, little-endian:
+header | index of count (offset, size) | icc files, 8-byte aligned
+Level n is entry n, brightness = n * step. The checksum is a SHA-256 of
+everything after the header.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint32_t step_ppm; /* step in millionths */
+  uint32_t vcgt_size;
+  uint8_t checksum[32];
+  uint32_t reserved[2];
+} ProfilePackHeader;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t size;
+} ProfilePackEntry;
+
+/* A pack mapped read-only */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  const ProfilePackEntry *entries;
+  uint32_t count;
+} ProfilePack;
+
+/* Levels of a pack of step, 0 to 1 included */
+uint32_t profile_pack_count(double step);
+
+/* icc files of every level in order, written to a temporary then renamed */
+bool profile_pack_write(const char *path, double step, unsigned int vcgt_size,
+                        const uint8_t *const *icc, const uint32_t *sizes,
+                        uint32_t count);
+
+/*
+mmap path and check magic, version, step, vcgt size, bounds and checksum.
+false and a message on stdout for a missing or stale pack.
+ */
+bool profile_pack_open(ProfilePack *pack, const char *path, double step,
+                       unsigned int vcgt_size);
+
+void profile_pack_close(ProfilePack *pack);
+
+/* The mapped icc file of level, NULL if the pack does not have it */
+const uint8_t *profile_pack_lookup(const ProfilePack *pack, int level,
+                                   uint32_t *size);
+
+/* Publish level to path with a single write(2) from the mapping */
+bool profile_pack_save(const ProfilePack *pack, int level, const char *path);
+
+#endif
@@ -0,0 +1,221 @@
+#include "profile-writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <lcms2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ICC_HEADER_SIZE 128
+#define ICC_TAG_ENTRY_SIZE 12
+#define DESC_TEMPLATE "Brightness 0.00"
+#define DESC_PLACEHOLDER "0.00"
+
+static uint32_t read_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void write_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void write_be16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+/*
+Serialize sRGB or base with the template description, lcms2 lays out the
+tags. base was serialized without a vcgt.
+ */
+static uint8_t *serialize_base_profile(const BaseProfile *base,
+                                       uint32_t *size) {
+  cmsContext context = cmsCreateContext(NULL, NULL);
+  cmsHPROFILE profile =
+      base != NULL ? cmsOpenProfileFromMemTHR(context, base->data, base->size)
+                   : cmsCreate_sRGBProfileTHR(context);
+  cmsMLU *mlu;
+  uint8_t *data = NULL;
+
+  if (profile == NULL) {
+    cmsDeleteContext(context);
+    return NULL;
+  }
+  mlu = cmsMLUalloc(context, 1);
+  cmsMLUsetASCII(mlu, "en", "US", DESC_TEMPLATE);
+  cmsWriteTag(profile, cmsSigProfileDescriptionTag, mlu);
+  cmsMLUfree(mlu);
+
+  if (cmsSaveProfileToMem(profile, NULL, size)) {
+    data = malloc(*size);
+    if (!cmsSaveProfileToMem(profile, data, size)) {
+      free(data);
+      data = NULL;
+    }
+  }
+
+  cmsCloseProfile(profile);
+  cmsDeleteContext(context);
+  return data;
+}
+
+/* Remember where "0.00" sits in the description, in ascii and utf-16be */
+static void find_description(ProfileWriter *writer, uint32_t offset,
+                             uint32_t size) {
+  const char *placeholder = DESC_PLACEHOLDER;
+  size_t len = strlen(placeholder);
+
+  for (uint32_t i = offset; i + 2 * len <= offset + size; i++) {
+    bool ascii = memcmp(writer->data + i, placeholder, len) == 0;
+    bool utf16 = true;
+    for (size_t j = 0; j < len && utf16; j++) {
+      utf16 = writer->data[i + 2 * j] == 0 &&
+              writer->data[i + 2 * j + 1] == (uint8_t)placeholder[j];
+    }
+    if ((ascii || utf16) && writer->n_desc < PROFILE_WRITER_MAX_DESC) {
+      writer->desc_offsets[writer->n_desc] = i;
+      writer->desc_widths[writer->n_desc] = utf16 ? 2 : 1;
+      writer->n_desc++;
+    }
+  }
+}
+
+/*
+Lay the template out as:
+header | tag table + vcgt entry | lcms2 tag data | vcgt tag
+The vcgt tag is written by hand so its table size and offset are known.
+ */
+bool profile_writer_init(ProfileWriter *writer, unsigned int vcgt_size,
+                         const BaseProfile *base) {
+  uint32_t base_size, tag_count, tags_end, vcgt_tag, vcgt_tag_size;
+  uint8_t *serialized;
+
+  memset(writer, 0, sizeof(*writer));
+  if (!vcgt_size_valid(vcgt_size) || !vcgt_init(&writer->vcgt, vcgt_size)) {
+    return false;
+  }
+  if (base != NULL) {
+    vcgt_set_base(&writer->vcgt, base->vcgt, base->vcgt_size);
+  }
+  serialized = serialize_base_profile(base, &base_size);
+  if (serialized == NULL || base_size < ICC_HEADER_SIZE + 4) {
+    free(serialized);
+    vcgt_destroy(&writer->vcgt);
+    return false;
+  }
+
+  tag_count = read_be32(serialized + ICC_HEADER_SIZE);
+  tags_end = ICC_HEADER_SIZE + 4 + tag_count * ICC_TAG_ENTRY_SIZE;
+  if (tags_end > base_size) {
+    free(serialized);
+    vcgt_destroy(&writer->vcgt);
+    return false;
+  }
+
+  /* 'vcgt' sig, reserved, table type, channels, entries, entry size */
+  vcgt_tag = (base_size + ICC_TAG_ENTRY_SIZE + 3) & ~3u;
+  vcgt_tag_size = 18 + 3 * vcgt_size * 2;
+  writer->size = (vcgt_tag + vcgt_tag_size + 3) & ~3u;
+  writer->data = calloc(1, writer->size);
+  writer->vcgt_offset = vcgt_tag + 18;
+
+  memcpy(writer->data, serialized, tags_end);
+  memcpy(writer->data + tags_end + ICC_TAG_ENTRY_SIZE, serialized + tags_end,
+         base_size - tags_end);
+  write_be32(writer->data, writer->size);
+  write_be32(writer->data + ICC_HEADER_SIZE, tag_count + 1);
+
+  /* Existing tag data moved down by one table entry */
+  for (uint32_t i = 0; i < tag_count; i++) {
+    uint8_t *entry = writer->data + ICC_HEADER_SIZE + 4 + i * 12;
+    write_be32(entry + 4, read_be32(entry + 4) + ICC_TAG_ENTRY_SIZE);
+    if (read_be32(entry) == cmsSigProfileDescriptionTag) {
+      find_description(writer, read_be32(entry + 4), read_be32(entry + 8));
+    }
+  }
+  free(serialized);
+
+  uint8_t *entry = writer->data + tags_end;
+  write_be32(entry, cmsSigVcgtTag);
+  write_be32(entry + 4, vcgt_tag);
+  write_be32(entry + 8, vcgt_tag_size);
+
+  uint8_t *vcgt = writer->data + vcgt_tag;
+  write_be32(vcgt, cmsSigVcgtTag);
+  write_be32(vcgt + 8, 0); /* table, not formula */
+  write_be16(vcgt + 12, 3);
+  write_be16(vcgt + 14, vcgt_size);
+  write_be16(vcgt + 16, 2);
+
+  if (writer->n_desc == 0) {
+    profile_writer_destroy(writer);
+    return false;
+  }
+
+  profile_writer_set_brightness(writer, 1);
+  return true;
+}
+
+void profile_writer_destroy(ProfileWriter *writer) {
+  free(writer->data);
+  vcgt_destroy(&writer->vcgt);
+  memset(writer, 0, sizeof(*writer));
+}
+
+/* MD5 of the profile with flags, rendering intent and ID zeroed (ICC 7.2.18) */
+static void update_profile_id(ProfileWriter *writer) {
+  uint8_t saved[4 + 4];
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_MD5);
+  gsize len = 16;
+
+  memcpy(saved, writer->data + 44, 4);
+  memcpy(saved + 4, writer->data + 64, 4);
+  memset(writer->data + 44, 0, 4);
+  memset(writer->data + 64, 0, 4);
+  memset(writer->data + 84, 0, 16);
+
+  g_checksum_update(checksum, writer->data, writer->size);
+  g_checksum_get_digest(checksum, writer->data + 84, &len);
+  g_checksum_free(checksum);
+
+  memcpy(writer->data + 44, saved, 4);
+  memcpy(writer->data + 64, saved + 4, 4);
+}
+
+void profile_writer_set_brightness(ProfileWriter *writer, double brightness) {
+  char digits[8];
+
+  vcgt_fill_brightness(&writer->vcgt, brightness);
+  vcgt_store_be(&writer->vcgt, writer->data + writer->vcgt_offset);
+
+  snprintf(digits, sizeof(digits), "%0.2f", brightness);
+  for (unsigned int d = 0; d < writer->n_desc; d++) {
+    uint8_t *p = writer->data + writer->desc_offsets[d];
+    for (size_t j = 0; j < strlen(DESC_PLACEHOLDER); j++) {
+      p[j * writer->desc_widths[d] + writer->desc_widths[d] - 1] = digits[j];
+    }
+  }
+
+  update_profile_id(writer);
+}
+
+bool profile_writer_save(const ProfileWriter *writer, const char *path) {
+  ssize_t written;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  written = write(fd, writer->data, writer->size);
+  if (close(fd) == -1 || written != (ssize_t)writer->size) {
+    remove(path);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,41 @@
+#ifndef ICC_BRIGHTNESS_PROFILE_WRITER_H
+#define ICC_BRIGHTNESS_PROFILE_WRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "base-profile.h"
+#include "vcgt.h"
+
+#define PROFILE_WRITER_MAX_DESC 4
+
+/*
+An sRGB or base profile serialized once, with a VCGT tag and a description
+at fixed offsets. A brightness level is produced by patching those in place.
+ */
+typedef struct {
+  uint8_t *data;
+  uint32_t size;
+  uint32_t vcgt_offset; /* first byte of the 16-bit big-endian table */
+  Vcgt vcgt;            /* native endian scratch table */
+  uint32_t desc_offsets[PROFILE_WRITER_MAX_DESC]; /* "0.00" in the desc */
+  uint8_t desc_widths[PROFILE_WRITER_MAX_DESC];   /* 1 ascii, 2 utf-16 */
+  unsigned int n_desc;
+} ProfileWriter;
+
+/*
+Serialize base (NULL for sRGB) with a vcgt_size entries table composed with
+its calibration, false if lcms2 output is not understood
+ */
+bool profile_writer_init(ProfileWriter *writer, unsigned int vcgt_size,
+                         const BaseProfile *base);
+
+void profile_writer_destroy(ProfileWriter *writer);
+
+/* Rewrite VCGT, description and profile ID for brightness */
+void profile_writer_set_brightness(ProfileWriter *writer, double brightness);
+
+/* Write the current buffer out with a single write(2) */
+bool profile_writer_save(const ProfileWriter *writer, const char *path);
+
+#endif
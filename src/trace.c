@@ -0,0 +1,225 @@
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void trace_put_u32(uint8_t *out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint32_t trace_get_u32(const uint8_t *in) {
+  return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 |
+         (uint32_t)in[3] << 24;
+}
+
+/* LEB128, 7 bits per byte, high bit set on all but the last */
+static size_t trace_put_varint(uint8_t *out, uint64_t value) {
+  size_t len = 0;
+
+  while (value >= 0x80) {
+    out[len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (uint8_t)value;
+  return len;
+}
+
+/* false if the data ends before the varint does */
+static bool trace_get_varint(const uint8_t **p, const uint8_t *end,
+                             uint64_t *value) {
+  *value = 0;
+  for (unsigned int shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*p)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+Records go after the last complete one of what fd holds, a record cut short
+by a kill would swallow the next. false if it is a trace of other backlights.
+ */
+static bool trace_writer_resume(int fd, const uint8_t *header, size_t len,
+                                off_t size) {
+  uint8_t *data = malloc(size);
+  const uint8_t *p, *end, *complete;
+  bool ret = false;
+
+  if (data == NULL || pread(fd, data, size, 0) != size) {
+    free(data);
+    return false;
+  }
+  if ((size_t)size < len || memcmp(data, header, len) != 0) {
+    errno = EINVAL;
+    free(data);
+    return false;
+  }
+
+  complete = p = data + len;
+  end = data + size;
+  while (p < end) {
+    uint64_t value;
+    if (!trace_get_varint(&p, end, &value) ||
+        !trace_get_varint(&p, end, &value) ||
+        !trace_get_varint(&p, end, &value)) {
+      break;
+    }
+    complete = p;
+  }
+  ret = complete == end || ftruncate(fd, complete - data) == 0;
+  free(data);
+  return ret;
+}
+
+bool trace_writer_open(TraceWriter *writer, const char *path,
+                       uint32_t backlights, const uint32_t *max,
+                       int64_t start_us) {
+  uint8_t header[16 + 4 * TRACE_MAX_BACKLIGHTS];
+  size_t len = 16 + 4 * backlights;
+  struct stat st;
+  int fd;
+
+  if (backlights > TRACE_MAX_BACKLIGHTS) {
+    return false;
+  }
+  memcpy(header, TRACE_MAGIC, 8);
+  trace_put_u32(header + 8, TRACE_VERSION);
+  trace_put_u32(header + 12, backlights);
+  for (uint32_t i = 0; i < backlights; i++) {
+    trace_put_u32(header + 16 + 4 * i, max[i]);
+  }
+
+  /* The daemon runs under umask 0, never leave it world writable */
+  fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  if (fstat(fd, &st) != 0 ||
+      (st.st_size > 0 && !trace_writer_resume(fd, header, len, st.st_size)) ||
+      (writer->file = fdopen(fd, "ab")) == NULL) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return false;
+  }
+  writer->last_us = start_us;
+  writer->backlights = backlights;
+
+  /* The gap between two runs is not recorded, replay goes straight on */
+  if (st.st_size == 0 && fwrite(header, 1, len, writer->file) != len) {
+    trace_writer_close(writer);
+    return false;
+  }
+  return true;
+}
+
+bool trace_writer_append(TraceWriter *writer, int64_t us, uint32_t backlight,
+                         uint32_t raw) {
+  uint8_t record[3 * 10];
+  size_t len = 0;
+
+  len += trace_put_varint(record,
+                          us > writer->last_us ? us - writer->last_us : 0);
+  len += trace_put_varint(record + len, backlight);
+  len += trace_put_varint(record + len, raw);
+  if (us > writer->last_us) {
+    writer->last_us = us;
+  }
+  return fwrite(record, 1, len, writer->file) == len;
+}
+
+bool trace_writer_flush(TraceWriter *writer) {
+  return fflush(writer->file) == 0;
+}
+
+bool trace_writer_close(TraceWriter *writer) {
+  bool ret = fclose(writer->file) == 0;
+  writer->file = NULL;
+  return ret;
+}
+
+bool trace_load(Trace *trace, const char *path) {
+  FILE *file = fopen(path, "rbe");
+  uint8_t *data = NULL;
+  const uint8_t *p, *end;
+  long size = 0;
+  size_t allocated = 0;
+  int64_t us = 0;
+
+  memset(trace, 0, sizeof(*trace));
+  if (file == NULL) {
+    printf("%s: cannot be opened\n", path);
+    return false;
+  }
+  if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 16 &&
+      fseek(file, 0, SEEK_SET) == 0 && (data = malloc(size)) != NULL &&
+      fread(data, 1, size, file) != (size_t)size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+
+  if (data == NULL || memcmp(data, TRACE_MAGIC, 8) != 0) {
+    printf("%s: not a trace\n", path);
+    free(data);
+    return false;
+  }
+  if (trace_get_u32(data + 8) != TRACE_VERSION) {
+    printf("%s: trace version %u, want %u\n", path, trace_get_u32(data + 8),
+           TRACE_VERSION);
+    free(data);
+    return false;
+  }
+  trace->backlights = trace_get_u32(data + 12);
+  if (trace->backlights == 0 || trace->backlights > TRACE_MAX_BACKLIGHTS ||
+      16 + 4 * (long)trace->backlights > size) {
+    printf("%s: bad backlight count %u\n", path, trace->backlights);
+    free(data);
+    return false;
+  }
+  trace->max = malloc(trace->backlights * sizeof(uint32_t));
+  for (uint32_t i = 0; i < trace->backlights; i++) {
+    trace->max[i] = trace_get_u32(data + 16 + 4 * i);
+  }
+
+  p = data + 16 + 4 * trace->backlights;
+  end = data + size;
+  while (p < end) {
+    uint64_t delta, backlight, raw;
+    if (!trace_get_varint(&p, end, &delta) ||
+        !trace_get_varint(&p, end, &backlight) ||
+        !trace_get_varint(&p, end, &raw)) {
+      break;
+    }
+    if (backlight >= trace->backlights || raw > UINT32_MAX) {
+      printf("%s: bad record %zu\n", path, trace->count);
+      free(data);
+      trace_free(trace);
+      return false;
+    }
+    if (trace->count == allocated) {
+      allocated = allocated > 0 ? 2 * allocated : 1024;
+      trace->records =
+          realloc(trace->records, allocated * sizeof(TraceRecord));
+    }
+    us += (int64_t)delta;
+    trace->records[trace->count++] = (TraceRecord){us, backlight, raw};
+  }
+
+  free(data);
+  return true;
+}
+
+void trace_free(Trace *trace) {
+  free(trace->max);
+  free(trace->records);
+  memset(trace, 0, sizeof(*trace));
+}
@@ -0,0 +1,63 @@
+#ifndef ICC_BRIGHTNESS_TRACE_H
+#define ICC_BRIGHTNESS_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Bump when the layout changes */
+#define TRACE_VERSION 1
+#define TRACE_MAGIC "ICCBTRCE"
+#define TRACE_MAX_BACKLIGHTS 64
+
+/*
+Raw actual_brightness changes as --record saw them, little-endian:
+magic | version u32 | backlights u32 | max_brightness u32 of each |
+records of three LEB128 varints: microseconds since the previous record,
+backlight, raw value. A change is 3 to 6 bytes, a truncated last record
+(the daemon was killed) is ignored.
+ */
+typedef struct {
+  int64_t us; /* since the start of the trace */
+  uint32_t backlight;
+  uint32_t raw;
+} TraceRecord;
+
+typedef struct {
+  FILE *file;
+  int64_t last_us;
+  uint32_t backlights;
+} TraceWriter;
+
+/* A whole trace decoded in memory */
+typedef struct {
+  uint32_t backlights;
+  uint32_t *max;
+  TraceRecord *records;
+  size_t count;
+} Trace;
+
+/*
+Append to path, written 0644 with a header if it is new. An existing trace
+must have the same backlights and max_brightness, else false with EINVAL.
+The first record is timed from start_us.
+ */
+bool trace_writer_open(TraceWriter *writer, const char *path,
+                       uint32_t backlights, const uint32_t *max,
+                       int64_t start_us);
+
+/* Buffered, us is on the clock of start_us */
+bool trace_writer_append(TraceWriter *writer, int64_t us, uint32_t backlight,
+                         uint32_t raw);
+
+bool trace_writer_flush(TraceWriter *writer);
+
+bool trace_writer_close(TraceWriter *writer);
+
+/* false and a message on stdout if path is not a trace of this version */
+bool trace_load(Trace *trace, const char *path);
+
+void trace_free(Trace *trace);
+
+#endif
@@ -0,0 +1,69 @@
+#include "transition.h"
+#include "metrics.h"
+
+void transition_init(Transition *transition, unsigned int duration_ms,
+                     unsigned int fps) {
+  *transition = (Transition){0};
+  transition->duration = (int64_t)duration_ms * 1000;
+  transition->frame = 1000000 / (fps > 0 ? fps : 1);
+}
+
+void transition_set(Transition *transition, double value) {
+  transition->current = value;
+  transition->known = true;
+  transition->active = false;
+}
+
+void transition_start(Transition *transition, double value, int64_t now) {
+  /* Restart from wherever a running fade got to */
+  transition->from = transition->current;
+  transition->to = value;
+  transition->start = now;
+  if (!transition->active) {
+    transition->begin = now;
+    transition->frames = 0;
+    transition->dropped = 0;
+  }
+  transition->active = true;
+}
+
+double transition_frame(Transition *transition, int64_t now) {
+  double t = transition->duration > 0
+                 ? (double)(now - transition->start) / transition->duration
+                 : 1;
+
+  if (t >= 1) {
+    t = 1;
+    transition->active = false;
+  }
+  transition->current =
+      transition->from + (transition->to - transition->from) * t;
+  transition->frames++;
+  metrics_inc(METRICS_TRANSITION_FRAMES);
+  return transition->current;
+}
+
+void transition_drop(Transition *transition, unsigned long frames) {
+  transition->dropped += frames;
+  metrics_counters[METRICS_TRANSITION_DROPPED] += frames;
+}
+
+/* Average over about 8 applies, reacts to a slowing colord within a fade */
+void transition_record_latency(Transition *transition, int64_t latency) {
+  if (transition->latency == 0) {
+    transition->latency = latency;
+  } else {
+    transition->latency += (latency - transition->latency) / 8;
+  }
+}
+
+int64_t transition_period(const Transition *transition) {
+  return transition->latency > transition->frame ? transition->latency
+                                                 : transition->frame;
+}
+
+double transition_fps(const Transition *transition, int64_t now) {
+  return now > transition->begin
+             ? transition->frames * 1e6 / (now - transition->begin)
+             : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef ICC_BRIGHTNESS_TRANSITION_H
+#define ICC_BRIGHTNESS_TRANSITION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+Fade of one backlight between two mapped brightness values.
+Frames are paced by the caller's timer, the period grows to the measured
+apply latency so a slow colord gets fewer, larger steps instead of a queue.
+Times are in microseconds of the monotonic clock.
+ */
+typedef struct {
+  double from, to;
+  double current;       /* last value handed out or applied */
+  bool known;           /* current is valid */
+  bool active;          /* frames left to hand out */
+  int64_t begin;        /* first frame, a retarget keeps it */
+  int64_t start;        /* of the fade to the current target */
+  int64_t duration;     /* of a full fade */
+  int64_t frame;        /* wanted frame period */
+  int64_t latency;      /* moving average of the apply latency */
+  unsigned long frames; /* of the running fade */
+  unsigned long dropped;
+} Transition;
+
+void transition_init(Transition *transition, unsigned int duration_ms,
+                     unsigned int fps);
+
+/* The value applied without a fade */
+void transition_set(Transition *transition, double value);
+
+/* Fade from the current value to value, retargets a running fade */
+void transition_start(Transition *transition, double value, int64_t now);
+
+/* Value to apply at now, the last frame ends the fade */
+double transition_frame(Transition *transition, int64_t now);
+
+/* A frame could not be applied because the previous one was in flight */
+void transition_drop(Transition *transition, unsigned long frames);
+
+void transition_record_latency(Transition *transition, int64_t latency);
+
+/* Frame period to arm the timer with */
+int64_t transition_period(const Transition *transition);
+
+/* Frames per second achieved by the fade so far */
+double transition_fps(const Transition *transition, int64_t now);
+
+#endif
@@ -0,0 +1,236 @@
+#include "vcgt.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool vcgt_size_valid(unsigned int size) {
+  return size == 256 || size == 1024 || size == 4096;
+}
+
+void vcgt_layers_init(VcgtLayers *layers) {
+  layers->temperature = VCGT_TEMPERATURE_NEUTRAL;
+  for (int c = 0; c < 3; c++) {
+    layers->gamma[c] = 1;
+  }
+}
+
+bool vcgt_layers_equal(const VcgtLayers *a, const VcgtLayers *b) {
+  return a->temperature == b->temperature && a->gamma[0] == b->gamma[0] &&
+         a->gamma[1] == b->gamma[1] && a->gamma[2] == b->gamma[2];
+}
+
+bool vcgt_layers_identity(const VcgtLayers *layers) {
+  VcgtLayers neutral;
+  vcgt_layers_init(&neutral);
+  return vcgt_layers_equal(layers, &neutral);
+}
+
+/*
+sRGB value of a black body, 0 to 255, Tanner Helland's fit of the
+Planckian locus. Good to a few percent, which is what a night light needs.
+ */
+static void blackbody(double temperature, double rgb[3]) {
+  double t = temperature / 100;
+
+  if (t <= 66) {
+    rgb[0] = 255;
+    rgb[1] = 99.4708025861 * log(t) - 161.1195681661;
+  } else {
+    rgb[0] = 329.698727446 * pow(t - 60, -0.1332047592);
+    rgb[1] = 288.1221695283 * pow(t - 60, -0.0755148492);
+  }
+  if (t >= 66) {
+    rgb[2] = 255;
+  } else if (t <= 19) {
+    rgb[2] = 0;
+  } else {
+    rgb[2] = 138.5177312231 * log(t - 10) - 305.0447927307;
+  }
+  for (int c = 0; c < 3; c++) {
+    rgb[c] = rgb[c] < 0 ? 0 : rgb[c] > 255 ? 255 : rgb[c];
+  }
+}
+
+/* Relative to 6500K so it is exactly neutral, the brightest channel is 1 */
+void vcgt_white_point(double temperature, double white[3]) {
+  double neutral[3];
+  double max = 0;
+
+  temperature = temperature < VCGT_TEMPERATURE_MIN   ? VCGT_TEMPERATURE_MIN
+                : temperature > VCGT_TEMPERATURE_MAX ? VCGT_TEMPERATURE_MAX
+                                                     : temperature;
+  blackbody(temperature, white);
+  blackbody(VCGT_TEMPERATURE_NEUTRAL, neutral);
+  for (int c = 0; c < 3; c++) {
+    white[c] /= neutral[c];
+    max = white[c] > max ? white[c] : max;
+  }
+  for (int c = 0; c < 3; c++) {
+    white[c] /= max;
+  }
+}
+
+bool vcgt_init(Vcgt *vcgt, unsigned int size) {
+  vcgt->size = size;
+  vcgt->data = malloc(3 * size * sizeof(uint16_t));
+  vcgt_layers_init(&vcgt->layers);
+  vcgt->shape = NULL;
+  vcgt->base = NULL;
+  vcgt->base_size = 0;
+  for (int c = 0; c < 3; c++) {
+    vcgt->white[c] = 1;
+  }
+  return vcgt->data != NULL;
+}
+
+void vcgt_destroy(Vcgt *vcgt) {
+  free(vcgt->data);
+  free(vcgt->shape);
+  free(vcgt->base);
+  vcgt->data = NULL;
+  vcgt->shape = NULL;
+  vcgt->base = NULL;
+  vcgt->base_size = 0;
+  vcgt->size = 0;
+}
+
+/*
+out[i] = round(i / (size - 1) * brightness * 65535) in 16.16 fixed point.
+i * step stays below 2^32 for any size, the loop has no float conversion
+and no branch so the compiler vectorizes it.
+ */
+static void ramp(uint16_t *restrict out, unsigned int size, uint32_t step) {
+  for (uint32_t i = 0; i < size; i++) {
+    out[i] = (uint16_t)((i * step + 0x8000) >> 16);
+  }
+}
+
+/* out[i] = round(shape[i] * gain), gain in 16.16 and at most 1.0 */
+static void scale(uint16_t *restrict out, const uint16_t *restrict shape,
+                  unsigned int size, uint32_t gain) {
+  for (uint32_t i = 0; i < size; i++) {
+    out[i] = (uint16_t)((shape[i] * gain + 0x8000) >> 16);
+  }
+}
+
+/*
+out[i] = base[out[i]], interpolated between the base_size entries of base.
+x stays below 2^28 and each product below 2^32 for any size.
+ */
+static void compose(uint16_t *restrict out, unsigned int size,
+                    const uint16_t *restrict base, unsigned int base_size) {
+  for (uint32_t i = 0; i < size; i++) {
+    uint32_t x = out[i] * (base_size - 1);
+    uint32_t j = x / 65535, frac = x % 65535;
+    out[i] = (uint16_t)((base[j] * (65535 - frac) +
+                         base[j + (frac != 0)] * frac + 32767) /
+                        65535);
+  }
+}
+
+static uint32_t ramp_step(const Vcgt *vcgt, double gain) {
+  return (uint32_t)lround(gain * 65535.0 * 65536.0 / (vcgt->size - 1));
+}
+
+/* The gamma layer of every channel, free while they are all linear */
+static void vcgt_fill_shape(Vcgt *vcgt, const double gamma[3]) {
+  if (gamma[0] == 1 && gamma[1] == 1 && gamma[2] == 1) {
+    free(vcgt->shape);
+    vcgt->shape = NULL;
+    return;
+  }
+  if (vcgt->shape == NULL) {
+    vcgt->shape = malloc(3 * vcgt->size * sizeof(uint16_t));
+    if (vcgt->shape == NULL) {
+      return;
+    }
+  }
+
+  for (int c = 0; c < 3; c++) {
+    uint16_t *shape = vcgt->shape + (unsigned int)c * vcgt->size;
+    if (gamma[c] == 1) {
+      ramp(shape, vcgt->size, ramp_step(vcgt, 1));
+      continue;
+    }
+    for (unsigned int i = 0; i < vcgt->size; i++) {
+      shape[i] = (uint16_t)lround(
+          pow((double)i / (vcgt->size - 1), 1 / gamma[c]) * 65535);
+    }
+  }
+}
+
+void vcgt_set_layers(Vcgt *vcgt, const VcgtLayers *layers) {
+  if (layers->temperature != vcgt->layers.temperature) {
+    vcgt_white_point(layers->temperature, vcgt->white);
+  }
+  if (memcmp(layers->gamma, vcgt->layers.gamma, sizeof(layers->gamma)) != 0) {
+    vcgt_fill_shape(vcgt, layers->gamma);
+  }
+  vcgt->layers = *layers;
+  /* Out of memory, stay linear and try again next time */
+  if (vcgt->shape == NULL) {
+    for (int c = 0; c < 3; c++) {
+      vcgt->layers.gamma[c] = 1;
+    }
+  }
+}
+
+void vcgt_set_base(Vcgt *vcgt, const uint16_t *table, unsigned int size) {
+  free(vcgt->base);
+  vcgt->base = NULL;
+  vcgt->base_size = 0;
+  if (table == NULL || size < 2 || size > 4096) {
+    return;
+  }
+  vcgt->base = malloc(3 * size * sizeof(uint16_t));
+  if (vcgt->base != NULL) {
+    memcpy(vcgt->base, table, 3 * size * sizeof(uint16_t));
+    vcgt->base_size = size;
+  }
+}
+
+void vcgt_fill_brightness(Vcgt *vcgt, double brightness) {
+  brightness = brightness < 0 ? 0 : brightness > 1 ? 1 : brightness;
+
+  if (vcgt->shape == NULL && vcgt->white[0] == 1 && vcgt->white[1] == 1 &&
+      vcgt->white[2] == 1) {
+    /* Neutral layers, one ramp shared by every channel */
+    ramp(vcgt_channel(vcgt, 0), vcgt->size, ramp_step(vcgt, brightness));
+    memcpy(vcgt_channel(vcgt, 1), vcgt_channel(vcgt, 0),
+           vcgt->size * sizeof(uint16_t));
+    memcpy(vcgt_channel(vcgt, 2), vcgt_channel(vcgt, 0),
+           vcgt->size * sizeof(uint16_t));
+  } else {
+    /* Brightness and white point are one gain per channel */
+    for (int c = 0; c < 3; c++) {
+      double gain = brightness * vcgt->white[c];
+      if (vcgt->shape == NULL) {
+        ramp(vcgt_channel(vcgt, c), vcgt->size, ramp_step(vcgt, gain));
+      } else {
+        scale(vcgt_channel(vcgt, c),
+              vcgt->shape + (unsigned int)c * vcgt->size, vcgt->size,
+              (uint32_t)lround(gain * 65536));
+      }
+    }
+  }
+
+  if (vcgt->base != NULL) {
+    for (int c = 0; c < 3; c++) {
+      compose(vcgt_channel(vcgt, c), vcgt->size,
+              vcgt->base + (unsigned int)c * vcgt->base_size, vcgt->base_size);
+    }
+  }
+}
+
+void vcgt_store_be(const Vcgt *vcgt, uint8_t *out) {
+  const uint16_t *restrict in = vcgt->data;
+  uint16_t *restrict be = (uint16_t *)out;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  memcpy(be, in, 3 * vcgt->size * sizeof(uint16_t));
+#else
+  for (unsigned int i = 0; i < 3 * vcgt->size; i++) {
+    be[i] = __builtin_bswap16(in[i]);
+  }
+#endif
+}
@@ -0,0 +1,75 @@
+#ifndef ICC_BRIGHTNESS_VCGT_H
+#define ICC_BRIGHTNESS_VCGT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VCGT_SIZE_DEFAULT 256
+/* White point of sRGB, the temperature layer leaves white alone */
+#define VCGT_TEMPERATURE_NEUTRAL 6500
+#define VCGT_TEMPERATURE_MIN 1000
+#define VCGT_TEMPERATURE_MAX 25000
+
+/* What is composed with brightness, per channel r, g, b */
+typedef struct {
+  double temperature; /* white point in kelvin */
+  double gamma[3];    /* user gamma, out = in ^ (1 / gamma) */
+} VcgtLayers;
+
+/* Video card gamma table, size 16-bit entries per channel, r then g then b */
+typedef struct {
+  uint16_t *data;
+  unsigned int size;
+  VcgtLayers layers; /* what shape and white were computed for */
+  uint16_t *shape;   /* gamma layer of every channel, NULL while linear */
+  double white[3];   /* gain of every channel at the temperature */
+  uint16_t *base;    /* calibration applied last, NULL while there is none */
+  unsigned int base_size; /* entries per channel of base */
+} Vcgt;
+
+/* Neutral white and a gamma of 1 */
+void vcgt_layers_init(VcgtLayers *layers);
+
+bool vcgt_layers_equal(const VcgtLayers *a, const VcgtLayers *b);
+
+/* Neutral, tables are the plain brightness ramp */
+bool vcgt_layers_identity(const VcgtLayers *layers);
+
+/* Gain of r, g and b for a white point, 1 for each at 6500K */
+void vcgt_white_point(double temperature, double white[3]);
+
+/* 256, 1024 or 4096 entries */
+bool vcgt_size_valid(unsigned int size);
+
+/* The layers start neutral */
+bool vcgt_init(Vcgt *vcgt, unsigned int size);
+
+void vcgt_destroy(Vcgt *vcgt);
+
+static inline uint16_t *vcgt_channel(const Vcgt *vcgt, int channel) {
+  return vcgt->data + (unsigned int)channel * vcgt->size;
+}
+
+/*
+Compose the following fills with layers. Only the layer that changed is
+recomputed: the gamma shape costs a pow() per entry, the white point three.
+ */
+void vcgt_set_layers(Vcgt *vcgt, const VcgtLayers *layers);
+
+/*
+Run every fill through the calibration table of a base profile, size
+entries per channel, kept at its own size. NULL removes it.
+ */
+void vcgt_set_base(Vcgt *vcgt, const uint16_t *table, unsigned int size);
+
+/*
+Ramp from 0 to brightness, times the white point and shaped by the gamma of
+each channel, in one pass over the table. A base calibration is a second
+pass: the dimmed signal is calibrated, as the panel expects it.
+ */
+void vcgt_fill_brightness(Vcgt *vcgt, double brightness);
+
+/* Copy out big-endian, as stored in the ICC vcgt tag */
+void vcgt_store_be(const Vcgt *vcgt, uint8_t *out);
+
+#endif